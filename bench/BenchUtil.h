@@ -0,0 +1,95 @@
+#pragma once
+// Timing, accuracy, model and command-line helpers shared by the benchmarks
+#include "Aligned.h"
+#include "CCELossNode.h"
+#include "DataParallelTrainer.h"
+#include "FFNode.h"
+#include "MNIST.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+namespace bench{
+
+using profile::seconds_since;
+
+// Returns the average time of one call in microseconds. The calls are repeated, doubling their
+// number, until a run takes at least 0.2 s
+template <typename F>
+double time_us(F&& f){
+    using clock = std::chrono::steady_clock;
+    // Warm up caches and the kernel dispatch
+    for(int i = 0; i != 3; i++){
+        f();
+    }
+    size_t iterations = 1;
+    while(true){
+        auto start = clock::now();
+        for(size_t i = 0; i != iterations; i++){
+            f();
+        }
+        double elapsed = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+        if(elapsed > 200000.0){
+            return elapsed / static_cast<double>(iterations);
+        }
+        iterations *= 2;
+    }
+}
+
+// Largest difference between the elements of b and the reference a, relative to the magnitude
+// of a where it exceeds one
+inline float max_error(aligned_vector<float> const& a, aligned_vector<float> const& b){
+    float error{0.0};
+    for(size_t i = 0; i != a.size(); i++){
+        error = std::max(error, std::abs(a[i] - b[i]) / std::max(float{1.0}, std::abs(a[i])));
+    }
+    return error;
+}
+
+// The topology of `nn train`: the samples of the dataset through a ReLU hidden layer and a softmax
+// output layer into the loss, which is bound to the labels of the input. The layers are FFNodes
+// with a hidden layer of the given width unless Hidden and Output name other node types, which
+// are then constructed from their names alone
+template <typename Hidden = FFNode, typename Output = FFNode>
+Replica make_model(IDXDataset const& dataset, size_t batch_size, uint16_t hidden_size = 32){
+    Model model{"ff"};
+    MNIST& mnist = model.add_node<MNIST>(dataset, batch_size);
+    Node* hidden;
+    Node* output;
+    if constexpr(std::is_same_v<Hidden, FFNode> && std::is_same_v<Output, FFNode>){
+        hidden = &model.add_node<FFNode>("hidden", Activation::ReLU, hidden_size, 784);
+        output = &model.add_node<FFNode>("output", Activation::Softmax, 10, hidden_size);
+    }else{
+        hidden = &model.add_node<Hidden>("hidden");
+        output = &model.add_node<Output>("output");
+    }
+    CCELossNode& loss = model.add_node<CCELossNode>("loss", 10, batch_size);
+    loss.set_target(mnist.label(), mnist.label_index());
+    model.create_edge(*hidden, mnist);
+    model.create_edge(*output, *hidden);
+    model.create_edge(loss, *output);
+    return Replica{std::move(model), &mnist, &loss};
+}
+
+// Returns the text following the flag name in the arguments, or fallback if it is absent
+inline char const* text_option(int argc, char* argv[], char const* name, char const* fallback){
+    for(int i = 1; i + 1 < argc; i++){
+        if(strcmp(argv[i], name) == 0){
+            return argv[i + 1];
+        }
+    }
+    return fallback;
+}
+
+// Returns the value following the flag name in the arguments, or fallback if it is absent
+inline size_t option(int argc, char* argv[], char const* name, size_t fallback){
+    char const* text = text_option(argc, argv, name, nullptr);
+    return text == nullptr ? fallback : strtoull(text, nullptr, 10);
+}
+
+} // namespace bench
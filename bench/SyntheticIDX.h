@@ -0,0 +1,103 @@
+#pragma once
+// Generates a synthetic MNIST-like IDX dataset so benchmarks run without the real image files.
+// Every class is a fixed random stroke pattern; samples are shifted, noisy copies of their class
+// pattern, with roughly the sparsity of MNIST digits.
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace synthetic{
+
+inline void write_be(std::ofstream& out, uint32_t value){
+    char bytes[4] = {
+        static_cast<char>(value >> 24),
+        static_cast<char>(value >> 16),
+        static_cast<char>(value >> 8),
+        static_cast<char>(value)
+    };
+    out.write(bytes, 4);
+}
+
+constexpr size_t side = 28;
+constexpr size_t dim = side * side;
+
+// Writes <dir>/<prefix>-images-idx3-ubyte and <dir>/<prefix>-labels-idx1-ubyte. The files are
+// written under temporary names and renamed into place, so a process that has the previous files
+// mapped keeps reading them intact
+inline void write_idx(std::filesystem::path const& dir, std::string const& prefix, uint32_t count, uint32_t seed){
+    std::filesystem::create_directories(dir);
+    std::filesystem::path images_path = dir / (prefix + "-images-idx3-ubyte");
+    std::filesystem::path labels_path = dir / (prefix + "-labels-idx1-ubyte");
+    std::string suffix = ".tmp" + std::to_string(getpid());
+
+    // The class patterns do not depend on the seed so train and test sets agree
+    std::mt19937 pattern_rne{1234};
+    std::vector<std::vector<uint8_t>> patterns(10, std::vector<uint8_t>(dim, 0));
+    for(auto& pattern : patterns){
+        for(int stroke = 0; stroke != 4; stroke++){
+            int r = 4 + static_cast<int>(pattern_rne() % 20);
+            int c = 4 + static_cast<int>(pattern_rne() % 20);
+            int dr = static_cast<int>(pattern_rne() % 3) - 1;
+            int dc = static_cast<int>(pattern_rne() % 2) * 2 - 1;
+            for(int k = 0; k != 10; k++){
+                int rr = std::min(27, std::max(0, r + dr * k));
+                int cc = std::min(27, std::max(0, c + dc * k));
+                pattern[rr * side + cc] = 255;
+            }
+        }
+    }
+
+    std::ofstream images{images_path.string() + suffix, std::ios::binary};
+    std::ofstream labels{labels_path.string() + suffix, std::ios::binary};
+    write_be(images, 2051);
+    write_be(images, count);
+    write_be(images, side);
+    write_be(images, side);
+    write_be(labels, 2049);
+    write_be(labels, count);
+
+    std::mt19937 rne{seed};
+    std::vector<uint8_t> image(dim);
+    for(uint32_t i = 0; i != count; i++){
+        uint8_t label = static_cast<uint8_t>(rne() % 10);
+        int shift = static_cast<int>(rne() % 5) - 2;
+        for(size_t j = 0; j != dim; j++){
+            long source = static_cast<long>(j) - shift;
+            uint8_t value = 0;
+            if(source >= 0 && source < static_cast<long>(dim) && patterns[label][source] != 0){
+                value = static_cast<uint8_t>(255 - rne() % 80);
+            }else if(rne() % 100 < 5){
+                value = static_cast<uint8_t>(rne() % 256);
+            }
+            image[j] = value;
+        }
+        images.write(reinterpret_cast<char const*>(image.data()), dim);
+        labels.put(static_cast<char>(label));
+    }
+    images.close();
+    labels.close();
+    std::filesystem::rename(images_path.string() + suffix, images_path);
+    std::filesystem::rename(labels_path.string() + suffix, labels_path);
+}
+
+// Writes the dataset as write_idx does unless both files already exist with the size of count
+// samples, so repeated and concurrent benchmark runs share one copy
+inline void ensure_idx(std::filesystem::path const& dir, std::string const& prefix, uint32_t count, uint32_t seed){
+    std::error_code error;
+    auto images_size = std::filesystem::file_size(dir / (prefix + "-images-idx3-ubyte"), error);
+    if(!error && images_size == 16 + size_t{count} * dim){
+        auto labels_size = std::filesystem::file_size(dir / (prefix + "-labels-idx1-ubyte"), error);
+        if(!error && labels_size == 8 + size_t{count}){
+            return;
+        }
+    }
+    write_idx(dir, prefix, count, seed);
+}
+
+} // namespace synthetic
@@ -0,0 +1,144 @@
+// Benchmark of the backward pass of a feedforward layer (input gradient dI = dZ * W and
+// weight gradient dW += dZ^T * I) implemented four ways:
+//   per-sample   the original loops, run once per sample, with the stride-input_size
+//                scatter into the weight gradients
+//   batched      the same products as plain loops over the whole batch
+//   sgemm        two separate sgemm calls
+//   fused        dense_backward, one sweep over W and dW
+#include "Aligned.h"
+#include "BenchUtil.h"
+#include "GEMM.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+namespace{
+
+struct Shape{
+    size_t batch;
+    size_t in;
+    size_t out;
+};
+
+struct Buffers{
+    float const* dz;
+    float const* inputs;
+    float const* weights;
+    float* di;
+    float* dw;
+};
+
+void per_sample(Shape s, Buffers const& buf){
+    for(size_t b = 0; b != s.batch; b++){
+        float const* dz = buf.dz + b * s.out;
+        float const* input = buf.inputs + b * s.in;
+        float* di = buf.di + b * s.in;
+
+        std::fill(di, di + s.in, 0.0f);
+        for(size_t i = 0; i != s.out; i++){
+            size_t offset = i * s.in;
+            for(size_t j = 0; j != s.in; j++){
+                di[j] += buf.weights[offset + j] * dz[i];
+            }
+        }
+
+        for(size_t i = 0; i != s.in; i++){
+            for(size_t j = 0; j != s.out; j++){
+                buf.dw[j * s.in + i] += input[i] * dz[j];
+            }
+        }
+    }
+}
+
+void batched(Shape s, Buffers const& buf){
+    std::fill(buf.di, buf.di + s.batch * s.in, 0.0f);
+    for(size_t b = 0; b != s.batch; b++){
+        float* di = buf.di + b * s.in;
+        for(size_t i = 0; i != s.out; i++){
+            size_t offset = i * s.in;
+            float g = buf.dz[b * s.out + i];
+            for(size_t j = 0; j != s.in; j++){
+                di[j] += buf.weights[offset + j] * g;
+            }
+        }
+    }
+    for(size_t i = 0; i != s.out; i++){
+        size_t offset = i * s.in;
+        for(size_t b = 0; b != s.batch; b++){
+            float const* input = buf.inputs + b * s.in;
+            float g = buf.dz[b * s.out + i];
+            for(size_t j = 0; j != s.in; j++){
+                buf.dw[offset + j] += input[j] * g;
+            }
+        }
+    }
+}
+
+void gemm_pair(Shape s, Buffers const& buf){
+    sgemm(Transpose::No, Transpose::No, s.batch, s.in, s.out,
+          buf.dz, s.out, buf.weights, s.in, 0.0f, buf.di, s.in);
+    sgemm(Transpose::Yes, Transpose::No, s.out, s.in, s.batch,
+          buf.dz, s.out, buf.inputs, s.in, 1.0f, buf.dw, s.in);
+}
+
+void fused(Shape s, Buffers const& buf){
+    dense_backward(s.batch, s.in, s.out, buf.dz, buf.inputs, buf.weights, buf.di, buf.dw);
+}
+
+} // namespace
+
+int main(){
+    std::printf("sgemm kernel: %s\n", sgemm_kernel_name());
+    std::printf("%5s %5s %5s %14s %12s %12s %12s %9s %9s\n",
+                "batch", "in", "out", "per-sample(us)", "batched(us)", "sgemm(us)", "fused(us)", "speedup", "max err");
+
+    Shape shapes[] = {
+        {80, 784, 32},
+        {80, 32, 10},
+        {256, 784, 128},
+    };
+
+    std::mt19937 rne{1};
+    std::uniform_real_distribution<float> dist{-1.0, 1.0};
+    auto random_vector = [&](size_t size){
+        aligned_vector<float> v(size);
+        for(float& x : v){
+            x = dist(rne);
+        }
+        return v;
+    };
+
+    using Variant = void (*)(Shape, Buffers const&);
+    Variant variants[] = {per_sample, batched, gemm_pair, fused};
+
+    for(Shape s : shapes){
+        auto dz = random_vector(s.batch * s.out);
+        auto inputs = random_vector(s.batch * s.in);
+        auto weights = random_vector(s.out * s.in);
+
+        double us[4];
+        aligned_vector<float> di[4];
+        aligned_vector<float> dw[4];
+        for(size_t v = 0; v != 4; v++){
+            di[v].resize(s.batch * s.in);
+            dw[v].resize(s.out * s.in);
+            Buffers buf{dz.data(), inputs.data(), weights.data(), di[v].data(), dw[v].data()};
+            us[v] = bench::time_us([&]{ variants[v](s, buf); });
+
+            // One call from zeroed weight gradients to compare the results
+            std::fill(dw[v].begin(), dw[v].end(), 0.0f);
+            variants[v](s, buf);
+        }
+
+        float error{0.0};
+        for(size_t v = 1; v != 4; v++){
+            error = std::max({error, bench::max_error(di[0], di[v]), bench::max_error(dw[0], dw[v])});
+        }
+
+        std::printf("%5zu %5zu %5zu %14.2f %12.2f %12.2f %12.2f %8.2fx %9.1e\n",
+                    s.batch, s.in, s.out, us[0], us[1], us[2], us[3], us[0] / us[3], error);
+    }
+
+    return 0;
+}
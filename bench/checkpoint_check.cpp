@@ -0,0 +1,125 @@
+// Self-check of the validation done by Model::load. A checkpoint of the 784 -> 32 -> 10 model is
+// saved and then damaged in several ways; every damaged file must be rejected with an error, while
+// the intact file and its version 1 rewrite must load the saved parameters:
+//   valid / valid_verify     the file as saved, without and with --verify
+//   version_1                the file rewritten with the shorter version 1 header
+//   truncated_header         cut within the header
+//   truncated_parameters     cut within the parameter blob
+//   flipped_parameter        one bit of the parameters flipped, loaded with --verify
+//   flipped_table            one bit of the node table flipped
+//   other_layout             loaded into a model with a hidden layer of 64
+// Exits with a non-zero status if any check fails.
+#include "CCELossNode.h"
+#include "Checkpoint.h"
+#include "FFNode.h"
+#include "MNIST.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace{
+
+Model make_model(uint16_t hidden_size){
+    Model model{"ff"};
+    MNIST& mnist = model.add_node<MNIST>(size_t{1});
+    FFNode& hidden = model.add_node<FFNode>("hidden", Activation::ReLU, hidden_size, 784);
+    FFNode& output = model.add_node<FFNode>("output", Activation::Softmax, 10, hidden_size);
+    CCELossNode& loss = model.add_node<CCELossNode>("loss", 10, 1);
+    model.create_edge(hidden, mnist);
+    model.create_edge(output, hidden);
+    model.create_edge(loss, output);
+    return model;
+}
+
+vector<char> read_file(std::filesystem::path const& path){
+    std::ifstream in{path, std::ios::binary};
+    return vector<char>{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+}
+
+void write_file(std::filesystem::path const& path, vector<char> const& bytes){
+    std::ofstream out{path, std::ios::binary};
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+// Rewrites a version 2 checkpoint without training state as version 1: the header ends before
+// the training state and the table follows it directly, the blob stays where it is
+vector<char> to_version_1(vector<char> const& file){
+    checkpoint::Header header;
+    memcpy(&header, file.data(), sizeof(header));
+    size_t old_size = checkpoint::header_size(checkpoint::VERSION);
+    size_t new_size = checkpoint::header_size(1);
+    size_t table_bytes = header.node_count * sizeof(checkpoint::Entry);
+
+    header.version = 1;
+    header.table_checksum = 0;
+    header.table_checksum = checkpoint::checksum(file.data() + old_size, table_bytes,
+                                                 checkpoint::checksum(&header, new_size));
+    vector<char> rewritten(file.size(), 0);
+    memcpy(rewritten.data(), &header, new_size);
+    memcpy(rewritten.data() + new_size, file.data() + old_size, table_bytes);
+    std::copy(file.begin() + static_cast<std::ptrdiff_t>(header.blob_offset), file.end(),
+              rewritten.begin() + static_cast<std::ptrdiff_t>(header.blob_offset));
+    return rewritten;
+}
+
+} // namespace
+
+int main(){
+    auto dir = std::filesystem::temp_directory_path();
+    auto saved_path = dir / "checkpoint_check.params";
+    auto damaged_path = dir / "checkpoint_check_damaged.params";
+
+    Model saved = make_model(32);
+    saved.init(1);
+    saved.save(saved_path);
+    vector<char> file = read_file(saved_path);
+    FloatSpan expected = saved.parameters();
+    checkpoint::Header header;
+    memcpy(&header, file.data(), sizeof(header));
+
+    int failures = 0;
+    auto report = [&](char const* name, bool passed, char const* detail){
+        std::printf("%-22s %s%s%s\n", name, passed ? "ok" : "FAILED", *detail != '\0' ? ": " : "", detail);
+        failures += passed ? 0 : 1;
+    };
+    // Loads the bytes into a model of the given hidden size and checks the outcome
+    auto check = [&](char const* name, vector<char> const& bytes, bool verify, bool accept, uint16_t hidden = 32){
+        write_file(damaged_path, bytes);
+        Model model = make_model(hidden);
+        try{
+            model.load(damaged_path, verify);
+        }catch(std::exception const& e){
+            report(name, !accept, e.what());
+            return;
+        }
+        FloatSpan loaded = model.parameters();
+        bool same = loaded.size == expected.size
+            && memcmp(loaded.data, expected.data, expected.size * sizeof(float)) == 0;
+        report(name, accept && same, accept && !same ? "parameters differ" : "");
+    };
+
+    check("valid", file, false, true);
+    check("valid_verify", file, true, true);
+    check("version_1", to_version_1(file), true, true);
+
+    check("truncated_header", vector<char>(file.begin(), file.begin() + 40), false, false);
+    vector<char> truncated{file.begin(), file.begin() + static_cast<std::ptrdiff_t>(header.blob_offset + header.blob_bytes / 2)};
+    check("truncated_parameters", truncated, false, false);
+
+    vector<char> flipped = file;
+    flipped[header.blob_offset + header.blob_bytes / 3] ^= 0x10;
+    check("flipped_parameter", flipped, true, false);
+
+    flipped = file;
+    flipped[sizeof(checkpoint::Header) + offsetof(checkpoint::Entry, count) + sizeof(checkpoint::Entry)] ^= 0x01;
+    check("flipped_table", flipped, false, false);
+
+    check("other_layout", file, false, false, 64);
+
+    std::filesystem::remove(saved_path);
+    std::filesystem::remove(damaged_path);
+    std::printf("%s\n", failures == 0 ? "All checks passed" : "Some checks FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+// Scaling of multi-threaded training from 1 to N threads on a synthetic dataset with the
+// 784 -> 32 -> 10 topology of `nn train`, comparing synchronous data-parallel training
+// (DataParallelTrainer) with lock-free asynchronous Hogwild! training (HogwildTrainer). Accuracy
+// is measured on a held-out synthetic test set after one epoch.
+// Usage: data_parallel_bench [max threads (default: hardware concurrency)]
+#include "BenchUtil.h"
+#include "GDOptimizer.h"
+#include "HogwildTrainer.h"
+#include "Prefetcher.h"
+#include "Sampler.h"
+#include "SyntheticIDX.h"
+#include "ThreadPool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace{
+
+// Accuracy of the trained model on the test set
+float test_accuracy(Model& trained, IDXDataset const& test){
+    constexpr size_t batch_size = 500;
+    Replica replica = bench::make_model(test, batch_size);
+    replica.model.share_parameters(trained);
+    auto& mnist = static_cast<MNIST&>(*replica.input);
+    for(size_t i = 0; i < mnist.size(); i += batch_size){
+        replica.model.forward(nullptr, std::min(batch_size, mnist.size() - i));
+    }
+    return replica.loss->accuracy();
+}
+
+// Returns samples per second of one epoch of training and the test accuracy afterwards
+std::pair<double, float> run(IDXDataset const& dataset, IDXDataset const& test, bool hogwild,
+                             size_t threads, size_t batch_size){
+    ThreadPool pool{threads};
+    vector<Replica> replicas;
+    for(size_t t = 0; t != threads; t++){
+        replicas.push_back(bench::make_model(dataset, batch_size));
+    }
+    Model& model = replicas.front().model;
+    model.init(1);
+
+    GDOptimizer optimizer{float{0.3}};
+    Sampler sampler{dataset.size(), batch_size, 1};
+
+    auto start = std::chrono::steady_clock::now();
+    if(hogwild){
+        HogwildTrainer trainer{replicas, pool, dataset, sampler};
+        trainer.train(0, sampler.batches_per_epoch(), optimizer);
+    }else{
+        DataParallelTrainer trainer{replicas, pool, MNIST::DIM};
+        Prefetcher input{dataset, sampler, 8, 1};
+        for(size_t i = 0; i != sampler.batches_per_epoch(); i++){
+            trainer.step(input.next());
+            model.train(optimizer);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return {dataset.size() / seconds, test_accuracy(model, test)};
+}
+
+} // namespace
+
+int main(int argc, char* argv[]){
+    size_t max_threads = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+    max_threads = std::max<size_t>(max_threads, 1);
+
+    auto dir = std::filesystem::temp_directory_path() / "nn_bench_data";
+    synthetic::ensure_idx(dir, "train", 60000, 1);
+    synthetic::ensure_idx(dir, "t10k", 10000, 2);
+    IDXDataset dataset{dir / "train-images-idx3-ubyte", dir / "train-labels-idx1-ubyte"};
+    IDXDataset test{dir / "t10k-images-idx3-ubyte", dir / "t10k-labels-idx1-ubyte"};
+
+    std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+    std::printf("%-8s %7s %7s %14s %9s %9s\n", "mode", "batch", "threads", "samples/s", "speedup", "accuracy");
+    for(bool hogwild : {false, true}){
+        for(size_t batch_size : {80, 512}){
+            double base = 0.0;
+            for(size_t threads = 1; threads <= max_threads; threads++){
+                auto [rate, accuracy] = run(dataset, test, hogwild, threads, batch_size);
+                if(threads == 1){
+                    base = rate;
+                }
+                std::printf("%-8s %7zu %7zu %14.0f %8.2fx %8.2f%%\n", hogwild ? "hogwild" : "sync",
+                            batch_size, threads, rate, rate / base, accuracy * 100.0f);
+            }
+        }
+    }
+    return 0;
+}
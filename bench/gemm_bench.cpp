@@ -0,0 +1,136 @@
+// Microbenchmark comparing the blocked SIMD sgemm kernel against the scalar loops
+// FFNode used before it, for the three products of a feedforward layer:
+//   forward          Z  = I * W^T          [batch x out]
+//   input gradient   dI = dZ * W           [batch x in]
+//   weight gradient  dW += dZ^T * I        [out x in]
+#include "Aligned.h"
+#include "BenchUtil.h"
+#include "GEMM.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+namespace{
+
+struct Shape{
+    size_t batch;
+    size_t in;
+    size_t out;
+};
+
+void loops_forward(Shape s, float const* inputs, float const* weights, float* z){
+    for(size_t i = 0; i != s.out; i++){
+        size_t offset = i * s.in;
+        for(size_t b = 0; b != s.batch; b++){
+            float const* input = inputs + b * s.in;
+            float acc{0.0};
+            for(size_t j = 0; j != s.in; j++){
+                acc += weights[offset + j] * input[j];
+            }
+            z[b * s.out + i] = acc;
+        }
+    }
+}
+
+void loops_input_gradient(Shape s, float const* dz, float const* weights, float* di){
+    std::fill(di, di + s.batch * s.in, 0.0f);
+    for(size_t b = 0; b != s.batch; b++){
+        float* input_gradients = di + b * s.in;
+        for(size_t i = 0; i != s.out; i++){
+            size_t offset = i * s.in;
+            float g = dz[b * s.out + i];
+            for(size_t j = 0; j != s.in; j++){
+                input_gradients[j] += weights[offset + j] * g;
+            }
+        }
+    }
+}
+
+void loops_weight_gradient(Shape s, float const* dz, float const* inputs, float* dw){
+    for(size_t i = 0; i != s.out; i++){
+        size_t offset = i * s.in;
+        for(size_t b = 0; b != s.batch; b++){
+            float const* input = inputs + b * s.in;
+            float g = dz[b * s.out + i];
+            for(size_t j = 0; j != s.in; j++){
+                dw[offset + j] += input[j] * g;
+            }
+        }
+    }
+}
+
+void report(char const* op, Shape s, double loops_us, double gemm_us, float error){
+    double flops = 2.0 * s.batch * s.in * s.out;
+    std::printf("%-16s %5zu %5zu %5zu %10.2f %8.2f %10.2f %8.2f %7.2fx %9.1e\n",
+                op, s.batch, s.in, s.out,
+                loops_us, flops / loops_us * 1e-3,
+                gemm_us, flops / gemm_us * 1e-3,
+                loops_us / gemm_us, error);
+}
+
+} // namespace
+
+int main(){
+    std::printf("sgemm kernel: %s\n", sgemm_kernel_name());
+    std::printf("%-16s %5s %5s %5s %10s %8s %10s %8s %8s %9s\n",
+                "op", "batch", "in", "out", "loops(us)", "GFLOP/s", "sgemm(us)", "GFLOP/s", "speedup", "max err");
+
+    Shape shapes[] = {
+        {80, 784, 32},
+        {80, 32, 10},
+        {256, 784, 128},
+        {1, 784, 32},
+    };
+
+    std::mt19937 rne{1};
+    std::uniform_real_distribution<float> dist{-1.0, 1.0};
+    auto random_vector = [&](size_t size){
+        aligned_vector<float> v(size);
+        for(float& x : v){
+            x = dist(rne);
+        }
+        return v;
+    };
+
+    for(Shape s : shapes){
+        auto inputs = random_vector(s.batch * s.in);
+        auto weights = random_vector(s.out * s.in);
+        auto dz = random_vector(s.batch * s.out);
+
+        aligned_vector<float> z_loops(s.batch * s.out);
+        aligned_vector<float> z_gemm(s.batch * s.out);
+        double loops_us = bench::time_us([&]{ loops_forward(s, inputs.data(), weights.data(), z_loops.data()); });
+        double gemm_us = bench::time_us([&]{
+            sgemm(Transpose::No, Transpose::Yes, s.batch, s.out, s.in,
+                  inputs.data(), s.in, weights.data(), s.in, 0.0f, z_gemm.data(), s.out);
+        });
+        report("forward", s, loops_us, gemm_us, bench::max_error(z_loops, z_gemm));
+
+        aligned_vector<float> di_loops(s.batch * s.in);
+        aligned_vector<float> di_gemm(s.batch * s.in);
+        loops_us = bench::time_us([&]{ loops_input_gradient(s, dz.data(), weights.data(), di_loops.data()); });
+        gemm_us = bench::time_us([&]{
+            sgemm(Transpose::No, Transpose::No, s.batch, s.in, s.out,
+                  dz.data(), s.out, weights.data(), s.in, 0.0f, di_gemm.data(), s.in);
+        });
+        report("input gradient", s, loops_us, gemm_us, bench::max_error(di_loops, di_gemm));
+
+        // The weight gradient accumulates, so compare a single call from zero
+        aligned_vector<float> dw_loops(s.out * s.in);
+        aligned_vector<float> dw_gemm(s.out * s.in);
+        loops_us = bench::time_us([&]{ loops_weight_gradient(s, dz.data(), inputs.data(), dw_loops.data()); });
+        gemm_us = bench::time_us([&]{
+            sgemm(Transpose::Yes, Transpose::No, s.out, s.in, s.batch,
+                  dz.data(), s.out, inputs.data(), s.in, 1.0f, dw_gemm.data(), s.in);
+        });
+        std::fill(dw_loops.begin(), dw_loops.end(), 0.0f);
+        std::fill(dw_gemm.begin(), dw_gemm.end(), 0.0f);
+        loops_weight_gradient(s, dz.data(), inputs.data(), dw_loops.data());
+        sgemm(Transpose::Yes, Transpose::No, s.out, s.in, s.batch,
+              dz.data(), s.out, inputs.data(), s.in, 1.0f, dw_gemm.data(), s.in);
+        report("weight gradient", s, loops_us, gemm_us, bench::max_error(dw_loops, dw_gemm));
+    }
+
+    return 0;
+}
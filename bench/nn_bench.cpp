@@ -0,0 +1,309 @@
+// Benchmark suite for tracking performance across commits. It times the building blocks of a
+// training run in isolation:
+//   ffnode.forward / ffnode.reverse  one feedforward layer on a batch, for several layer shapes
+//   cce_loss                         the loss node's forward and reverse passes on a batch
+//   gd_optimizer.train               one SGD update over the parameters of a model
+//   mnist.read_next                  gathering one sample from the mapped dataset
+//   model.save / model.load          writing and mapping the checkpoint of the 784 -> 32 -> 10 model
+// and the end-to-end rates of `nn train` and `nn evaluate` (single-threaded) in samples per
+// second. The data is a synthetic MNIST-like IDX dataset, generated unless an earlier run left it
+// in the temporary directory, so the suite does not need the real image files.
+//
+// The results are written as JSON, to stdout or to the file given with --out, one record per
+// measurement with a stable name and shape so that two runs can be diffed. The times are per
+// call: the minimum and the median over --repetitions (default 5) repetitions, each running the
+// call for at least --min-time seconds (default 0.1).
+#include "BenchUtil.h"
+#include "CCELossNode.h"
+#include "DataParallelTrainer.h"
+#include "Evaluator.h"
+#include "FFNode.h"
+#include "GDOptimizer.h"
+#include "GEMM.h"
+#include "MNIST.h"
+#include "Prefetcher.h"
+#include "QGEMM.h"
+#include "Sampler.h"
+#include "Sparse.h"
+#include "SyntheticIDX.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+namespace{
+
+struct Options{
+    char const* out = nullptr;
+    size_t repetitions = 5;
+    double min_time = 0.1;
+};
+
+Options parse(int argc, char* argv[]){
+    Options options;
+    for(int i = 1; i < argc; i++){
+        bool has_value = i + 1 < argc;
+        if(strcmp(argv[i], "--out") == 0 && has_value){
+            options.out = argv[++i];
+        }else if(strcmp(argv[i], "--repetitions") == 0 && has_value){
+            options.repetitions = std::max<size_t>(strtoull(argv[++i], nullptr, 10), 1);
+        }else if(strcmp(argv[i], "--min-time") == 0 && has_value){
+            options.min_time = strtod(argv[++i], nullptr);
+        }else{
+            throw runtime_error{string{"Unknown argument "} + argv[i]};
+        }
+    }
+    return options;
+}
+
+// Collects the measurements and writes them as one JSON document
+class Report{
+public:
+    explicit Report(Options const& options) : options_{options}{}
+
+    // Times f, one call per measured unit, and records it under name with the given shape
+    // fields (pairs of a key and a value)
+    template <typename F>
+    void time(char const* name, std::initializer_list<std::pair<char const*, size_t>> shape, F&& f){
+        // Calibrate the number of calls per repetition, which also warms up the caches
+        size_t calls = 1;
+        while(true){
+            auto start = std::chrono::steady_clock::now();
+            for(size_t i = 0; i != calls; i++){
+                f();
+            }
+            if(bench::seconds_since(start) >= options_.min_time){
+                break;
+            }
+            calls *= 2;
+        }
+
+        vector<double> samples;
+        for(size_t r = 0; r != options_.repetitions; r++){
+            auto start = std::chrono::steady_clock::now();
+            for(size_t i = 0; i != calls; i++){
+                f();
+            }
+            samples.push_back(bench::seconds_since(start) * 1e6 / static_cast<double>(calls));
+        }
+        sort(samples.begin(), samples.end());
+
+        string record = string{"{\"name\": \""} + name + "\"";
+        for(auto const& [key, value] : shape){
+            record += string{", \""} + key + "\": " + to_string(value);
+        }
+        record += ", \"calls\": " + to_string(calls);
+        record += ", \"min_us\": " + number(samples.front());
+        record += ", \"median_us\": " + number(samples[samples.size() / 2]) + "}";
+        records_.push_back(std::move(record));
+        fprintf(stderr, "%-20s %10.3f us\n", name, samples.front());
+    }
+
+    // Records an end-to-end rate
+    void rate(char const* name, size_t batch, double samples_per_second){
+        records_.push_back(string{"{\"name\": \""} + name + "\", \"batch\": " + to_string(batch)
+                           + ", \"samples_per_second\": " + number(samples_per_second) + "}");
+        fprintf(stderr, "%-20s %10.0f samples/s\n", name, samples_per_second);
+    }
+
+    void write(FILE* out) const{
+        fprintf(out, "{\n");
+        fprintf(out, "  \"kernels\": {\"sgemm\": \"%s\", \"qgemm\": \"%s\", \"sparse\": \"%s\"},\n",
+                sgemm_kernel_name(), qgemm_kernel_name(), sparse_kernel_name());
+        fprintf(out, "  \"repetitions\": %zu,\n", options_.repetitions);
+        fprintf(out, "  \"results\": [\n");
+        for(size_t i = 0; i != records_.size(); i++){
+            fprintf(out, "    %s%s\n", records_[i].c_str(), i + 1 == records_.size() ? "" : ",");
+        }
+        fprintf(out, "  ]\n}\n");
+    }
+
+private:
+    static string number(double value){
+        char text[32];
+        snprintf(text, sizeof(text), "%.6g", value);
+        return text;
+    }
+
+    Options options_;
+    vector<string> records_;
+};
+
+// Both layers of a model, and at batch 80 its loss node, after a forward pass over the first
+// batch of the dataset. The reverse passes add to the gradients, which are not used afterwards
+void bench_layers(Report& report, IDXDataset const& dataset, size_t batch, uint16_t hidden_size){
+    Replica replica = bench::make_model(dataset, batch, hidden_size);
+    Model& model = replica.model;
+    model.init(1);
+    model.forward(nullptr, batch);
+
+    vector<unique_ptr<Node>> const& nodes = model.nodes();
+    for(size_t l = 1; l != 3; l++){
+        Node& input = *nodes[l - 1];
+        Node& layer = *nodes[l];
+        size_t in = input.output_size();
+        size_t out = layer.output_size();
+        report.time("ffnode.forward", {{"batch", batch}, {"in", in}, {"out", out}}, [&]{
+            layer.forward(input.output(), batch);
+        });
+        if(batch <= 80){
+            vector<float> gradients(batch * out, float{0.001});
+            layer.forward(input.output(), batch);
+            report.time("ffnode.reverse", {{"batch", batch}, {"in", in}, {"out", out}}, [&]{
+                layer.reverse(gradients.data());
+            });
+        }
+    }
+
+    if(batch <= 80 && hidden_size == 32){
+        Node& output = *nodes[2];
+        CCELossNode& loss = *replica.loss;
+        report.time("cce_loss.forward", {{"batch", batch}, {"classes", 10}}, [&]{
+            loss.forward(output.output(), batch);
+        });
+        report.time("cce_loss.reverse", {{"batch", batch}, {"classes", 10}}, [&]{
+            loss.reverse();
+        });
+    }
+}
+
+void bench_optimizer(Report& report, IDXDataset const& dataset){
+    Replica replica = bench::make_model(dataset, 80, 32);
+    replica.model.init(1);
+    FloatSpan parameters = replica.model.parameters();
+    FloatSpan gradients = replica.model.gradients();
+    // A learning rate of zero keeps the parameters unchanged over the calls
+    GDOptimizer optimizer{float{0.0}};
+    report.time("gd_optimizer.train", {{"params", parameters.size}}, [&]{
+        optimizer.train(parameters.data, gradients.data, parameters.size);
+    });
+}
+
+void bench_input(Report& report, IDXDataset const& dataset){
+    constexpr size_t batch = 80;
+    Model model{"input"};
+    MNIST& mnist = model.add_node<MNIST>(dataset, batch);
+    size_t row = 0;
+    report.time("mnist.read_next", {{"dim", MNIST::DIM}}, [&]{
+        mnist.read_next(row);
+        row = row + 1 == batch ? 0 : row + 1;
+    });
+}
+
+void bench_checkpoint(Report& report, IDXDataset const& dataset, std::filesystem::path const& dir){
+    auto path = dir / "nn_bench.params";
+    Replica saved = bench::make_model(dataset, 80, 32);
+    saved.model.init(1);
+    size_t params = saved.model.parameters().size;
+    report.time("model.save", {{"params", params}}, [&]{
+        saved.model.save(path);
+    });
+
+    Replica loaded = bench::make_model(dataset, 80, 32);
+    report.time("model.load", {{"params", params}}, [&]{
+        loaded.model.load(path);
+    });
+    report.time("model.load_verify", {{"params", params}}, [&]{
+        loaded.model.load(path, true);
+    });
+    std::filesystem::remove(path);
+}
+
+// Samples per second of one single-threaded epoch of `nn train` (sgd, batch 80). The trained
+// model is saved to checkpoint, outside of the timed epoch
+double train_rate(IDXDataset const& dataset, std::filesystem::path const& checkpoint){
+    constexpr size_t batch = 80;
+    ThreadPool pool{1};
+    vector<Replica> replicas;
+    replicas.push_back(bench::make_model(dataset, batch, 32));
+    Model& model = replicas.front().model;
+    model.init(1);
+
+    GDOptimizer optimizer{float{0.3}};
+    Sampler sampler{dataset.size(), batch, 1};
+    DataParallelTrainer trainer{replicas, pool, MNIST::DIM};
+    Prefetcher input{dataset, sampler, 4, 1};
+
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i != sampler.batches_per_epoch(); i++){
+        trainer.step(input.next());
+        model.train(optimizer);
+    }
+    double rate = static_cast<double>(dataset.size()) / bench::seconds_since(start);
+    model.save(checkpoint);
+    return rate;
+}
+
+// Samples per second of a single-threaded `nn evaluate` pass (batch 1000) of the model trained
+// by train_rate. Its activations, unlike those of random weights, decide between the dense and
+// sparse kernels as in a real run
+double evaluate_rate(IDXDataset const& test, std::filesystem::path const& checkpoint){
+    ThreadPool pool{1};
+    vector<Replica> replicas;
+    replicas.push_back(bench::make_model(test, 1000, 32));
+    replicas.front().model.load(checkpoint);
+    Evaluator evaluator{replicas, pool, test, 1000};
+
+    double best = 0.0;
+    for(int r = 0; r != 3; r++){
+        auto start = std::chrono::steady_clock::now();
+        evaluator.run();
+        best = std::max(best, static_cast<double>(test.size()) / bench::seconds_since(start));
+    }
+    return best;
+}
+
+void bench_end_to_end(Report& report, IDXDataset const& dataset, IDXDataset const& test,
+                      std::filesystem::path const& dir, size_t repetitions){
+    auto path = dir / "nn_bench.params";
+    double best = 0.0;
+    for(size_t r = 0; r != repetitions; r++){
+        best = std::max(best, train_rate(dataset, path));
+    }
+    report.rate("train", 80, best);
+    report.rate("evaluate", 1000, evaluate_rate(test, path));
+    std::filesystem::remove(path);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]){
+    Options options = parse(argc, argv);
+
+    // The nodes report themselves on stdout as they are built. Unless the JSON goes to a file,
+    // it keeps stdout to itself and everything else is sent to stderr
+    FILE* out;
+    if(options.out != nullptr){
+        out = fopen(options.out, "w");
+        if(out == nullptr){
+            throw runtime_error{string{"Cannot open "} + options.out};
+        }
+    }else{
+        fflush(stdout);
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    auto dir = std::filesystem::temp_directory_path() / "nn_bench_data";
+    synthetic::ensure_idx(dir, "train", 60000, 1);
+    synthetic::ensure_idx(dir, "t10k", 10000, 2);
+    IDXDataset dataset{dir / "train-images-idx3-ubyte", dir / "train-labels-idx1-ubyte"};
+    IDXDataset test{dir / "t10k-images-idx3-ubyte", dir / "t10k-labels-idx1-ubyte"};
+
+    Report report{options};
+    for(uint16_t hidden_size : {32, 128}){
+        bench_layers(report, dataset, 80, hidden_size);
+    }
+    bench_layers(report, dataset, 1000, 32);
+    bench_optimizer(report, dataset);
+    bench_input(report, dataset);
+    bench_checkpoint(report, dataset, dir);
+    bench_end_to_end(report, dataset, test, dir, options.repetitions);
+
+    report.write(out);
+    fclose(out);
+    return 0;
+}
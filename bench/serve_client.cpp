@@ -0,0 +1,164 @@
+// Load generator for `nn serve`. Every connection runs on its own thread and keeps --pipeline
+// requests (default 1) in flight: it sends the images of the test set in turn and sends the next
+// one whenever an answer arrives. Reports the throughput, the latency percentiles seen by the
+// clients (from sending a request to receiving its answer) and the accuracy of the answers.
+//
+// The images come from <dir>/t10k-images-idx3-ubyte (and labels) with --data <dir>, otherwise
+// from the synthetic test set the other benchmarks generate, which matches a model trained on
+// the synthetic training set.
+#include "BenchUtil.h"
+#include "IDXDataset.h"
+#include "InferenceServer.h"
+#include "SyntheticIDX.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace{
+
+using Clock = std::chrono::steady_clock;
+
+int connect_to(std::string const& path){
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)){
+        throw std::runtime_error{"Socket path too long: " + path};
+    }
+    strcpy(address.sun_path, path.c_str());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || ::connect(fd, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0){
+        throw std::runtime_error{"Cannot connect to " + path + ": " + strerror(errno)};
+    }
+    return fd;
+}
+
+void transfer(int fd, void* data, size_t bytes, bool sending){
+    auto* position = static_cast<char*>(data);
+    while(bytes != 0){
+        ssize_t count = sending ? ::send(fd, position, bytes, MSG_NOSIGNAL) : ::read(fd, position, bytes);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            throw std::runtime_error{"The server closed the connection"};
+        }
+        position += count;
+        bytes -= static_cast<size_t>(count);
+    }
+}
+
+struct ClientResult{
+    std::vector<double> latencies;
+    size_t correct{0};
+    // Largest deviation of a prediction's probabilities from summing up to one
+    float sum_error{0.0f};
+    std::string error;
+};
+
+void run_client(std::string const& socket_path, IDXDataset const& test, size_t first, size_t requests,
+                size_t pipeline, ClientResult& result){
+    try{
+        int fd = connect_to(socket_path);
+        std::vector<Clock::time_point> sent(requests);
+        result.latencies.reserve(requests);
+        auto send = [&](size_t i){
+            size_t sample = (first + i) % test.size();
+            sent[i] = Clock::now();
+            transfer(fd, const_cast<uint8_t*>(test.image(sample)), serving::REQUEST_BYTES, true);
+        };
+
+        size_t next = 0;
+        for(; next != std::min(pipeline, requests); next++){
+            send(next);
+        }
+        for(size_t i = 0; i != requests; i++){
+            // Answers come back in the order of the requests
+            serving::Prediction prediction;
+            transfer(fd, &prediction, sizeof(prediction), false);
+            result.latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent[i]).count());
+            if(next != requests){
+                send(next++);
+            }
+
+            size_t sample = (first + i) % test.size();
+            result.correct += prediction.label == test.label(sample);
+            float sum{0.0f};
+            for(float probability : prediction.probabilities){
+                sum += probability;
+            }
+            result.sum_error = std::max(result.sum_error, std::abs(sum - 1.0f));
+        }
+        ::close(fd);
+    }catch(std::exception const& e){
+        result.error = e.what();
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]){
+    std::string socket_path = bench::text_option(argc, argv, "--socket", "nn.sock");
+    size_t connections = std::max<size_t>(bench::option(argc, argv, "--connections", 16), 1);
+    size_t requests = std::max<size_t>(bench::option(argc, argv, "--requests", 2000), 1);
+    size_t pipeline = std::max<size_t>(bench::option(argc, argv, "--pipeline", 1), 1);
+
+    std::filesystem::path dir;
+    if(char const* data = bench::text_option(argc, argv, "--data", nullptr)){
+        dir = data;
+    }else{
+        dir = std::filesystem::temp_directory_path() / "nn_bench_data";
+        synthetic::ensure_idx(dir, "t10k", 10000, 2);
+    }
+    IDXDataset test{dir / "t10k-images-idx3-ubyte", dir / "t10k-labels-idx1-ubyte"};
+    if(test.image_size() != serving::REQUEST_BYTES){
+        throw std::runtime_error{"Expected 28x28 images"};
+    }
+
+    std::vector<ClientResult> results(connections);
+    std::vector<std::thread> clients;
+    auto start = Clock::now();
+    for(size_t c = 0; c != connections; c++){
+        clients.emplace_back(run_client, std::cref(socket_path), std::cref(test), c * requests, requests, pipeline,
+                             std::ref(results[c]));
+    }
+    for(std::thread& client : clients){
+        client.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> latencies;
+    size_t correct = 0;
+    float sum_error{0.0f};
+    for(ClientResult const& result : results){
+        if(!result.error.empty()){
+            fprintf(stderr, "Client failed: %s\n", result.error.c_str());
+            return 1;
+        }
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        correct += result.correct;
+        sum_error = std::max(sum_error, result.sum_error);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p){
+        size_t rank = static_cast<size_t>(std::ceil(p * static_cast<double>(latencies.size())));
+        return latencies[std::max<size_t>(rank, 1) - 1] * 1e-3;
+    };
+
+    printf("%zu connections x %zu requests, %zu in flight per connection\n", connections, requests, pipeline);
+    printf("Throughput: %.0f requests/s\n", static_cast<double>(latencies.size()) / seconds);
+    printf("Latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", percentile(0.5), percentile(0.99),
+           latencies.back() * 1e-3);
+    printf("Accuracy: %.2f%%, probabilities sum to 1 within %.1e\n",
+           100.0 * static_cast<double>(correct) / static_cast<double>(latencies.size()), sum_error);
+    return 0;
+}
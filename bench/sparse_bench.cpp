@@ -0,0 +1,106 @@
+// Benchmark of the sparse-input path of a feedforward layer against the dense sgemm calls, over
+// inputs of varying density. Each sparse time includes the work the layer does per batch:
+//   forward          compress the inputs, transpose W, Z = I * W^T over the non-zero inputs
+//   weight gradient  clear G^T, G^T += I^T * dZ over the non-zero inputs, dW += G
+// The crossover densities are where FFNode falls back to the dense path (sparse_forward_density
+// and sparse_gradient_density in Sparse.h, which depend on the width of the layer).
+#include "Aligned.h"
+#include "BenchUtil.h"
+#include "GEMM.h"
+#include "Sparse.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+namespace{
+
+struct Shape{
+    size_t batch;
+    size_t in;
+    size_t out;
+};
+
+} // namespace
+
+int main(){
+    std::printf("sgemm kernel: %s, sparse kernels: %s\n", sgemm_kernel_name(), sparse_kernel_name());
+    std::printf("%-16s %5s %5s %5s %7s %10s %10s %8s %9s\n",
+                "op", "batch", "in", "out", "density", "dense(us)", "sparse(us)", "speedup", "max err");
+
+    Shape shapes[] = {
+        {80, 784, 16},
+        {80, 784, 32},
+        {80, 784, 64},
+        {80, 784, 128},
+        {1000, 784, 32},
+        {256, 784, 128},
+    };
+    float densities[] = {0.05f, 0.1f, 0.2f, 0.3f, 0.4f, 0.5f};
+
+    std::mt19937 rne{1};
+    std::uniform_real_distribution<float> dist{-1.0, 1.0};
+    std::uniform_real_distribution<float> unit{0.0, 1.0};
+
+    for(Shape s : shapes){
+        size_t ldt = (s.out + SPARSE_ALIGN - 1) / SPARSE_ALIGN * SPARSE_ALIGN;
+        aligned_vector<float> weights(s.out * s.in);
+        aligned_vector<float> dz(s.batch * s.out);
+        for(float& x : weights){
+            x = dist(rne);
+        }
+        for(float& x : dz){
+            x = dist(rne);
+        }
+
+        for(float density : densities){
+            aligned_vector<float> inputs(s.batch * s.in);
+            for(float& x : inputs){
+                x = unit(rne) < density ? unit(rne) : 0.0f;
+            }
+
+            SparseRows sparse;
+            aligned_vector<float> weights_t(s.in * ldt);
+            aligned_vector<float> gradients_t(s.in * ldt);
+
+            aligned_vector<float> z_dense(s.batch * s.out);
+            aligned_vector<float> z_sparse(s.batch * s.out);
+            double dense_us = bench::time_us([&]{
+                sgemm(Transpose::No, Transpose::Yes, s.batch, s.out, s.in,
+                      inputs.data(), s.in, weights.data(), s.in, 0.0f, z_dense.data(), s.out);
+            });
+            double sparse_us = bench::time_us([&]{
+                compress_rows(inputs.data(), s.batch, s.in, 1.0f, sparse);
+                transpose(weights.data(), s.out, s.in, s.in, weights_t.data(), ldt, false);
+                sparse_gemm(sparse, weights_t.data(), ldt, s.out, z_sparse.data(), s.out);
+            });
+            std::printf("%-16s %5zu %5zu %5zu %7.2f %10.2f %10.2f %7.2fx %9.1e\n",
+                        "forward", s.batch, s.in, s.out, density, dense_us, sparse_us,
+                        dense_us / sparse_us, bench::max_error(z_dense, z_sparse));
+
+            // The weight gradient accumulates, so compare a single call from zero
+            aligned_vector<float> dw_dense(s.out * s.in);
+            aligned_vector<float> dw_sparse(s.out * s.in);
+            auto dense = [&]{
+                sgemm(Transpose::Yes, Transpose::No, s.out, s.in, s.batch,
+                      dz.data(), s.out, inputs.data(), s.in, 1.0f, dw_dense.data(), s.in);
+            };
+            auto sparse_update = [&]{
+                std::fill(gradients_t.begin(), gradients_t.end(), 0.0f);
+                sparse_outer(sparse, dz.data(), s.out, s.out, gradients_t.data(), ldt);
+                transpose(gradients_t.data(), s.in, s.out, ldt, dw_sparse.data(), s.in, true);
+            };
+            dense_us = bench::time_us(dense);
+            sparse_us = bench::time_us(sparse_update);
+            std::fill(dw_dense.begin(), dw_dense.end(), 0.0f);
+            std::fill(dw_sparse.begin(), dw_sparse.end(), 0.0f);
+            dense();
+            sparse_update();
+            std::printf("%-16s %5zu %5zu %5zu %7.2f %10.2f %10.2f %7.2fx %9.1e\n",
+                        "weight gradient", s.batch, s.in, s.out, density, dense_us, sparse_us,
+                        dense_us / sparse_us, bench::max_error(dw_dense, dw_sparse));
+        }
+    }
+
+    return 0;
+}
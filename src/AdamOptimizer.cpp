@@ -0,0 +1,65 @@
+#include "AdamOptimizer.h"
+#include <cmath>
+#include <stdexcept>
+
+namespace{
+
+struct AdamStep{
+    float beta1;
+    float beta2;
+    // Learning rate and epsilon with the bias corrections of this step folded in
+    float eta;
+    float epsilon;
+};
+
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void adam_update(float* params, float* gradients, float* moments, float* squared_moments, size_t count, AdamStep step){
+    float* __restrict p = static_cast<float*>(__builtin_assume_aligned(params, CACHE_LINE));
+    float* __restrict g = static_cast<float*>(__builtin_assume_aligned(gradients, CACHE_LINE));
+    float* __restrict m = static_cast<float*>(__builtin_assume_aligned(moments, CACHE_LINE));
+    float* __restrict v = static_cast<float*>(__builtin_assume_aligned(squared_moments, CACHE_LINE));
+    float one_minus_beta1 = float{1.0} - step.beta1;
+    float one_minus_beta2 = float{1.0} - step.beta2;
+    for(size_t i = 0; i != count; i++){
+        float gradient = g[i];
+        float moment = step.beta1 * m[i] + one_minus_beta1 * gradient;
+        float squared_moment = step.beta2 * v[i] + one_minus_beta2 * gradient * gradient;
+        m[i] = moment;
+        v[i] = squared_moment;
+        p[i] -= step.eta * moment / (__builtin_sqrtf(squared_moment) + step.epsilon);
+        g[i] = float{0.0};
+    }
+}
+
+} // namespace
+
+AdamOptimizer::AdamOptimizer(float eta, float beta1, float beta2, float epsilon)
+    : eta_{eta}, beta1_{beta1}, beta2_{beta2}, epsilon_{epsilon}{}
+
+void AdamOptimizer::train(float* params, float* gradients, size_t count){
+    state(count);
+
+    // m_hat = m / (1 - beta1^t) and v_hat = v / (1 - beta2^t). Rather than correcting every
+    // moment, the correction is applied once to the step size and epsilon:
+    // eta * m_hat / (sqrt(v_hat) + epsilon) = eta_t * m / (sqrt(v) + epsilon_t)
+    ++steps_;
+    double correction1 = 1.0 - std::pow(static_cast<double>(beta1_), static_cast<double>(steps_));
+    double correction2 = std::sqrt(1.0 - std::pow(static_cast<double>(beta2_), static_cast<double>(steps_)));
+    AdamStep step{
+        beta1_,
+        beta2_,
+        static_cast<float>(eta_ * correction2 / correction1),
+        static_cast<float>(epsilon_ * correction2)
+    };
+    adam_update(params, gradients, moments_.data(), squared_moments_.data(), count, step);
+}
+
+vector<FloatSpan> AdamOptimizer::state(size_t count){
+    if(moments_.empty()){
+        moments_.assign(count, float{0.0});
+        squared_moments_.assign(count, float{0.0});
+    }else if(moments_.size() != count){
+        throw runtime_error{"Adam optimizer used with models of different sizes"};
+    }
+    return {{moments_.data(), moments_.size()}, {squared_moments_.data(), squared_moments_.size()}};
+}
\ No newline at end of file
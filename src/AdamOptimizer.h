@@ -0,0 +1,44 @@
+#pragma once
+#include "Model.h"
+
+// Adam (adaptive moment estimation). Per parameter, exponentially decaying averages of the
+// gradient (first moment m) and of its square (second moment v) are kept, and every parameter
+// takes a step scaled by its own gradient history:
+//   m' = beta1 * m + (1 - beta1) * dL/dp
+//   v' = beta2 * v + (1 - beta2) * (dL/dp)^2
+//   p' = p - eta * m_hat / (sqrt(v_hat) + epsilon)
+// where m_hat and v_hat correct the bias of the averages towards their zero initialization.
+
+class AdamOptimizer : public Optimizer {
+public:
+    AdamOptimizer(float eta = 0.001, float beta1 = 0.9, float beta2 = 0.999, float epsilon = 1e-8);
+
+    // The moments are laid out like the parameters they belong to and are allocated on the first
+    // call, so an optimizer instance must always be used with the same model. Parameters,
+    // gradients and both moments are each read and written once per call
+    void train(float* params, float* gradients, size_t count) override;
+
+    char const* name() const noexcept override{
+        return "adam";
+    }
+
+    vector<FloatSpan> state(size_t count) override;
+
+    // Number of updates applied so far; the bias corrections depend on it
+    uint64_t steps() const noexcept override{
+        return steps_;
+    }
+
+    void set_steps(uint64_t steps) override{
+        steps_ = steps;
+    }
+
+private:
+    float eta_;
+    float beta1_;
+    float beta2_;
+    float epsilon_;
+    uint64_t steps_{0};
+    aligned_vector<float> moments_;
+    aligned_vector<float> squared_moments_;
+};
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Cache-line alignment used for every buffer touched by the SIMD kernels
+constexpr size_t CACHE_LINE = 64;
+
+// Minimal allocator that hands out storage aligned to Alignment bytes so that vectors
+// of parameters and activations can be loaded with aligned SIMD instructions
+template <typename T, size_t Alignment = CACHE_LINE>
+struct AlignedAllocator{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind{
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() noexcept = default;
+
+    template <typename U>
+    AlignedAllocator(AlignedAllocator<U, Alignment> const&) noexcept {}
+
+    T* allocate(size_t count){
+        // aligned_alloc requires the size to be a multiple of the alignment
+        size_t bytes = (count * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        void* ptr = std::aligned_alloc(Alignment, bytes);
+        if(ptr == nullptr){
+            throw std::bad_alloc{};
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) noexcept{
+        std::free(ptr);
+    }
+
+    template <typename U>
+    bool operator==(AlignedAllocator<U, Alignment> const&) const noexcept {return true;}
+
+    template <typename U>
+    bool operator!=(AlignedAllocator<U, Alignment> const&) const noexcept {return false;}
+};
+
+template <typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
@@ -0,0 +1,19 @@
+#include "BFloat16.h"
+
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void to_bfloat16(float const* src, bfloat16* dst, size_t count){
+    float const* __restrict s = src;
+    bfloat16* __restrict d = dst;
+    for(size_t i = 0; i != count; i++){
+        d[i] = to_bfloat16(s[i]);
+    }
+}
+
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void to_float(bfloat16 const* src, float* dst, size_t count){
+    bfloat16 const* __restrict s = src;
+    float* __restrict d = dst;
+    for(size_t i = 0; i != count; i++){
+        d[i] = to_float(s[i]);
+    }
+}
\ No newline at end of file
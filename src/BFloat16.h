@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Brain floating point: the upper half of an IEEE single. It keeps the 8-bit exponent, and so the
+// range, of a float with an 8-bit significand, which is enough to store weights and activations
+// while all arithmetic stays in float. Converting to float is exact; converting from float rounds
+// to the nearest value, ties to even.
+struct bfloat16{
+    uint16_t bits;
+};
+
+inline float to_float(bfloat16 x) noexcept{
+    uint32_t u = uint32_t{x.bits} << 16;
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+inline bfloat16 to_bfloat16(float x) noexcept{
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    // Adding 0x7fff plus the lowest kept bit rounds the dropped half to nearest even. NaNs are kept
+    // quiet instead, as rounding could carry them into infinity
+    uint32_t rounded = (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+    uint32_t nan = (u >> 16) | 0x40;
+    return bfloat16{static_cast<uint16_t>((u & 0x7fffffff) > 0x7f800000 ? nan : rounded)};
+}
+
+// dst[i] = to_bfloat16(src[i]) for count values
+void to_bfloat16(float const* src, bfloat16* dst, size_t count);
+
+// dst[i] = to_float(src[i]) for count values
+void to_float(bfloat16 const* src, float* dst, size_t count);
\ No newline at end of file
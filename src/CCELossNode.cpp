@@ -1,67 +1,153 @@
 #include "CCELossNode.h"
+#include <algorithm>
+#include <cmath>
 #include <limits>
+#include <stdexcept>
 
 CCELossNode::CCELossNode(Model& model, string name, uint16_t input_size, size_t batch_size): Node{model, std::move(name)}, input_size_{input_size}, inv_batch_size_{float{1.0} / static_cast<float>(batch_size)}{
     // When we deliver a gradient bach, we deliver just the loss gradient with respect
     // to any input and the index that was "hot" in the second argument.
-    gradients_.resize(input_size_);
+    // The gradient buffer is bound by the model's execution plan
 }
 
-void CCELossNode::forward(float* data){
+void CCELossNode::forward(float* data, size_t batch){
     // The cross-entropy categorical loss is defined as -\sum_i(q_i * log(p_i))
     // where p_i is the predicted prebability and q_i is the expected prebability
 
     // In information theory, by convention, lim_{x approaches 0}{x log(x)} = 0
 
-    float max{0.0};
-    size_t max_index;
+    // A model only making predictions has no target and nothing to score
+    if(inference_ && target_ == nullptr && labels_ == nullptr){
+        batch_ = batch;
+        return;
+    }
 
-    loss_ = float{0.0};
-    for(size_t i = 0; i != input_size_; i++){
-        if(data[i] > max){
-            max_index = i;
-            max = data[i];
+    for(size_t b = 0; b != batch; b++){
+        float const* sample = data + b * input_size_;
+        float const* target = target_ + b * input_size_;
+
+        size_t max_index = max_element(sample, sample + input_size_) - sample;
+
+        if(labels_ != nullptr){
+            // One-hot fast path: only the hot class contributes to the loss
+            active_ = labels_[b];
+        }else{
+            for(size_t i = 0; i != input_size_; i++){
+                if(target[i] != float{0.0}){
+                    active_ = i;
+                }
+            }
         }
 
-        // Because the target vector is one-hot encoded, most of these terms will be zero,
-        // but we leave the full calculation here to be explicit and in the event we want 
-        // to compute losses against probability distributions that arent one-hot. In practice,
-        // a faster code path should be employed if the targets are knoen to be one-hot distributions.
-
-        // Prevent undefined results when taking the log of zero
-        loss_ -= target_[i] * log(std::max(data[i], numeric_limits<float>::epsilon()));
+        if(fused_softmax_){
+            // The inputs are logits z and p_i = exp(z_i) / \sum_j exp(z_j), so
+            // -log(p_i) = log(\sum_j exp(z_j)) - z_i. The log-sum-exp is shifted by the largest
+            // logit so it neither overflows nor loses the small terms
+            float max_z = sample[max_index];
+            float sum_exp_z{0.0};
+            for(size_t i = 0; i != input_size_; i++){
+                sum_exp_z += exp(sample[i] - max_z);
+            }
+            float lse = max_z + log(sum_exp_z);
+            if(!inference_){
+                log_sum_exp_[b] = lse;
+            }
+
+            if(labels_ != nullptr){
+                loss_ = lse - sample[active_];
+            }else{
+                loss_ = float{0.0};
+                for(size_t i = 0; i != input_size_; i++){
+                    loss_ += target[i] * (lse - sample[i]);
+                }
+            }
+        }else if(labels_ != nullptr){
+            // Prevent undefined results when taking the log of zero
+            loss_ = -log(std::max(sample[active_], numeric_limits<float>::epsilon()));
+        }else{
+            // Because the target vector is one-hot encoded, most of these terms will be zero,
+            // but we leave the full calculation here to be explicit and in the event we want 
+            // to compute losses against probability distributions that arent one-hot.
+            loss_ = float{0.0};
+            for(size_t i = 0; i != input_size_; i++){
+                loss_ -= target[i] * log(std::max(sample[i], numeric_limits<float>::epsilon()));
+            }
+        }
 
-        if(target_[i] != float{0.0}){
-            active_ = i;
+        if(max_index == active_){
+            ++correct_;
+        }else{
+            ++incorrect_;
         }
-    }
 
-    if(max_index == active_){
-        ++correct_;
-    }else{
-        ++incorrect_;
+        cummulative_loss_ += loss_;
     }
 
-    cummulative_loss_ += loss_;
-
     // Store the data pointer to compute gradients later
-    last_input_ = data;
+    if(!inference_){
+        last_input_ = data;
+    }
+    batch_ = batch;
 }
 
 void CCELossNode::reverse(float* data){
+    if(inference_){
+        throw runtime_error{"Cannot backpropagate through " + name_ + " in inference mode"};
+    }
+
     // dJ/dq_i = d(-\sum_i(p_i log(q_i)))/dq_i = -1/q_j where j is the index of the correct
     // classification (loss gradient for single sample).
 
     // Note the normalization factor where we multiply by the inverse batch size. 
     // This ensures that losses cpmputed by the network are similar in scale irrespectie of the batch size.
 
-    for(size_t i = 0; i != input_size_; i++){
-        gradients_[i] = -inv_batch_size_ * target_[i] / last_input_[i];
+    for(size_t b = 0; b != batch_; b++){
+        float const* sample = last_input_ + b * input_size_;
+        float const* target = target_ + b * input_size_;
+        float* gradients = gradients_ + b * input_size_;
+
+        if(fused_softmax_){
+            // Through the fused softmax the gradient with respect to the logits is simply
+            // dJ/dz_i = p_i - q_i, which costs O(n) instead of the O(n^2) softmax Jacobian product
+            float lse = log_sum_exp_[b];
+            for(size_t i = 0; i != input_size_; i++){
+                gradients[i] = inv_batch_size_ * exp(sample[i] - lse);
+            }
+            if(labels_ != nullptr){
+                gradients[labels_[b]] -= inv_batch_size_;
+            }else{
+                for(size_t i = 0; i != input_size_; i++){
+                    gradients[i] -= inv_batch_size_ * target[i];
+                }
+            }
+        }else if(labels_ != nullptr){
+            fill(gradients, gradients + input_size_, float{0.0});
+            size_t label = labels_[b];
+            // Clamped as in the forward pass, so an underflowed probability gives a finite gradient
+            gradients[label] = -inv_batch_size_ / std::max(sample[label], numeric_limits<float>::epsilon());
+        }else{
+            for(size_t i = 0; i != input_size_; i++){
+                gradients[i] = -inv_batch_size_ * target[i] / std::max(sample[i], numeric_limits<float>::epsilon());
+            }
+        }
     }
+}
 
-    for(Node* node : antecedents_){
-        node->reverse(gradients_.data());
-    }
+void CCELossNode::set_inference(bool inference){
+    inference_ = inference;
+    last_input_ = nullptr;
+}
+
+vector<BufferRequest> CCELossNode::buffers() const{
+    return {
+        {BufferUse::InputGradients, input_size_},
+        {BufferUse::Saved, 1}
+    };
+}
+
+void CCELossNode::bind_buffers(vector<float*> const& buffers){
+    gradients_ = buffers[0];
+    log_sum_exp_ = buffers[1];
 }
 
 void CCELossNode::print() const {
@@ -80,4 +166,10 @@ void CCELossNode::reset_score() {
     cummulative_loss_ = 0.0;
     correct_ = 0;
     incorrect_ = 0;
+}
+
+void CCELossNode::merge_score(CCELossNode const& other) {
+    cummulative_loss_ += other.cummulative_loss_;
+    correct_ += other.correct_;
+    incorrect_ += other.incorrect_;
 }
\ No newline at end of file
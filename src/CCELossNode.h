@@ -5,6 +5,8 @@
 // Assumes input data is "one-hot encoded", with size equal to the number of possible classifications,
 // where the "answer" has a single "1" (aka hot value) in one of the classification 
 // positions and zero everywhere else.
+// When fed by a softmax node, the softmax is fused into this node: the loss is computed from the
+// logits with a log-sum-exp and the gradient sent back is dJ/dz = (p - q) / batch_size.
 
 class CCELossNode : public Node{
 public:
@@ -13,20 +15,48 @@ public:
     // No initialization is needed for this node
     void init(mt19937&) override {};
 
-    void forward(float* inputs) override;
+    void forward(float* inputs, size_t batch) override;
     // As a loss node, the argiment to this method is ignored (the gradient of the loss with respect to 
     // itself is unity)
     void reverse(float* gradients = nullptr) override;
 
+    float* input_gradients() override{
+        return gradients_;
+    }
+
+    vector<BufferRequest> buffers() const override;
+    void bind_buffers(vector<float*> const& buffers) override;
+
+    bool fuse_softmax() override{
+        fused_softmax_ = true;
+        return true;
+    }
+
+    void set_inference(bool inference) override;
+
     void print() const override;
 
-    void set_target(float const* target){
+    // The target is a [batch x input_size] matrix holding one one-hot encoded row per sample.
+    // If the index of the hot class of each sample is supplied as well, the loss and its gradient
+    // are computed from it directly instead of scanning the target rows. In inference mode the
+    // target may be null for a model that only makes predictions, which are then not scored
+    void set_target(float const* target, uint8_t const* labels = nullptr){
         target_ = target;
+        labels_ = labels;
+    }
+
+    // The gradients are averaged over the samples of the training step, by default the batch size
+    // given to the constructor. The last batch of an epoch may be smaller; a data-parallel shard
+    // passes the size of the whole step, not its own
+    void set_step_size(size_t samples){
+        inv_batch_size_ = float{1.0} / static_cast<float>(samples);
     }
 
     float accuracy() const;
     float avg_loss() const;
     void reset_score();
+    // Add the running loss and prediction counts of another loss node (e.g. of a model replica)
+    void merge_score(CCELossNode const& other);
 
 private:
     uint16_t input_size_;
@@ -36,13 +66,22 @@ private:
 
     float inv_batch_size_;
     float loss_;
-    float const* target_;
+    float const* target_{nullptr};
+    uint8_t const* labels_{nullptr};
     float* last_input_;
+    // Set in inference mode, where only the loss statistics are computed
+    bool inference_{false};
+    // Set when the antecedent softmax was fused into this node (the inputs are then logits)
+    bool fused_softmax_{false};
+    // log(\sum_i exp(z_i)) of each sample of the last batch, kept for the fused gradient
+    float* log_sum_exp_{nullptr};
+    // Number of samples in the last forward pass
+    size_t batch_{0};
     // Stores the last active classificatin in the target one-hot encoding
     size_t active_;
     float cummulative_loss_{0.0};
     // Store running counts of correct and incorrect predictions
     size_t correct_ = 0;
     size_t incorrect_ = 0;
-    vector<float> gradients_;
+    float* gradients_{nullptr};
 };
\ No newline at end of file
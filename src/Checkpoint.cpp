@@ -0,0 +1,13 @@
+#include "Checkpoint.h"
+
+namespace checkpoint{
+
+uint64_t checksum(void const* data, size_t bytes, uint64_t hash){
+    auto const* p = static_cast<unsigned char const*>(data);
+    for(size_t i = 0; i != bytes; i++){
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+} // namespace checkpoint
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// On-disk layout of a model checkpoint, written by Model::save and mapped by Model::load:
+//   Header
+//   Entry x node_count           one per node of the model, in the order they were added
+//   zero padding                 up to blob_offset, a multiple of PAGE_SIZE
+//   parameter blob               the model's parameter arena as it is laid out in memory, as
+//                                float or (for bfloat16 models) bfloat16 values
+//   optimizer state (version 2)  state_count float arrays laid out like the parameter arena,
+//                                starting at the page-aligned state_offset
+// All fields are in host byte order (little-endian on every supported target). Because a float
+// blob is page-aligned and identical to the in-memory arena, loading maps it and points the nodes
+// straight into the mapping; only the header and the table are read up front.
+namespace checkpoint{
+
+constexpr char MAGIC[8] = {'N', 'N', 'C', 'K', 'P', 'T', '\r', '\n'};
+constexpr uint32_t VERSION = 2;
+constexpr size_t PAGE_SIZE = 4096;
+constexpr size_t MAX_NAME = 64;
+constexpr size_t MAX_RANK = 4;
+
+// Type of the values of the parameter blob (see Model::set_precision). The optimizer state is
+// always Float32
+enum class DType : uint32_t{
+    Float32 = 0,
+    BFloat16 = 1
+};
+
+struct Header{
+    char magic[8];
+    uint32_t version;
+    DType dtype;
+    uint64_t node_count;
+    uint64_t blob_offset;
+    uint64_t blob_bytes;
+    // Checksum of the parameter blob
+    uint64_t blob_checksum;
+    // Checksum of the header (with this field zero) followed by the node table
+    uint64_t table_checksum;
+
+    // Version 2: the state of the training run, present if optimizer is not empty
+    char optimizer[16];
+    uint64_t optimizer_steps;
+    // Global index (see Sampler) of the first batch not yet trained on
+    uint64_t next_batch;
+    uint32_t seed;
+    uint32_t state_count;
+    uint64_t state_offset;
+    uint64_t state_checksum;
+};
+
+// Size of the header of each version
+constexpr size_t header_size(uint32_t version){
+    return version == 1 ? 56 : sizeof(Header);
+}
+
+struct Entry{
+    // Null-terminated node name
+    char name[MAX_NAME];
+    // Byte offset of the node's parameters within the blob and their number
+    uint64_t offset;
+    uint64_t count;
+    // Dimensions of the node's parameters (see Node::param_shape)
+    uint64_t rank;
+    uint64_t shape[MAX_RANK];
+};
+
+static_assert(sizeof(Header) == 112 && sizeof(Entry) == 120, "The checkpoint layout must not depend on padding");
+
+// 64-bit FNV-1a, continued from a previous result
+uint64_t checksum(void const* data, size_t bytes, uint64_t hash = 0xcbf29ce484222325ull);
+
+} // namespace checkpoint
+
+// The state of a training run saved along with the parameters, so that training can be resumed
+// exactly where the checkpoint was taken
+struct TrainingState{
+    std::string optimizer;
+    uint64_t optimizer_steps{0};
+    // The optimizer's arrays, each laid out like the parameters (see Optimizer::state)
+    std::vector<float const*> optimizer_state;
+    uint64_t next_batch{0};
+    uint32_t seed{0};
+};
\ No newline at end of file
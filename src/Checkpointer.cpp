@@ -0,0 +1,117 @@
+#include "Checkpointer.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <chrono>
+
+using profile::Clock;
+using profile::seconds_since;
+
+Checkpointer::Checkpointer(Model& model, Optimizer& optimizer, filesystem::path path)
+    : model_{model}, optimizer_{optimizer}, path_{move(path)}{
+    size_t count = model_.parameters().size;
+    size_t state_count = optimizer_.state(count).size();
+    for(Snapshot& snapshot : snapshots_){
+        snapshot.parameters.resize(count);
+        snapshot.state.resize(state_count);
+        for(aligned_vector<float>& state : snapshot.state){
+            state.resize(count);
+        }
+        snapshot.training.optimizer = optimizer_.name();
+        for(aligned_vector<float> const& state : snapshot.state){
+            snapshot.training.optimizer_state.push_back(state.data());
+        }
+    }
+
+    writer_ = thread{&Checkpointer::work, this};
+}
+
+Checkpointer::~Checkpointer(){
+    {
+        unique_lock<mutex> lock{mutex_};
+        written_.wait(lock, [&]{ return !pending_; });
+        stop_ = true;
+    }
+    pending_ready_.notify_all();
+    writer_.join();
+}
+
+void Checkpointer::save(size_t next_batch, uint32_t seed){
+    auto start = Clock::now();
+    size_t index;
+    {
+        // A snapshot still waiting for the writer cannot be overwritten; the other buffer is
+        // either free or being written
+        unique_lock<mutex> lock{mutex_};
+        written_.wait(lock, [&]{ return !pending_ || error_; });
+        if(error_){
+            rethrow_exception(error_);
+        }
+        index = writing_ ? 1 - *writing_ : 0;
+    }
+
+    // The writer never touches a buffer that is neither pending nor being written
+    Snapshot& snapshot = snapshots_[index];
+    FloatSpan parameters = model_.parameters();
+    copy(parameters.data, parameters.data + parameters.size, snapshot.parameters.data());
+    vector<FloatSpan> state = optimizer_.state(parameters.size);
+    for(size_t i = 0; i != state.size(); i++){
+        copy(state[i].data, state[i].data + state[i].size, snapshot.state[i].data());
+    }
+    snapshot.training.optimizer_steps = optimizer_.steps();
+    snapshot.training.next_batch = next_batch;
+    snapshot.training.seed = seed;
+
+    {
+        lock_guard<mutex> lock{mutex_};
+        pending_ = index;
+        stats_.stall_seconds += seconds_since(start);
+    }
+    pending_ready_.notify_one();
+}
+
+void Checkpointer::flush(){
+    unique_lock<mutex> lock{mutex_};
+    written_.wait(lock, [&]{ return (!pending_ && !writing_) || error_; });
+    if(error_){
+        rethrow_exception(error_);
+    }
+}
+
+CheckpointStats Checkpointer::stats() const{
+    lock_guard<mutex> lock{mutex_};
+    return stats_;
+}
+
+void Checkpointer::work(){
+    unique_lock<mutex> lock{mutex_};
+    while(true){
+        pending_ready_.wait(lock, [&]{ return pending_ || stop_; });
+        if(!pending_){
+            return;
+        }
+        writing_ = pending_;
+        pending_.reset();
+        written_.notify_all();
+
+        Snapshot const& snapshot = snapshots_[*writing_];
+        lock.unlock();
+        auto start = Clock::now();
+        exception_ptr error;
+        try{
+            model_.save(path_, snapshot.parameters.data(), snapshot.training);
+        }catch(...){
+            error = current_exception();
+        }
+        double elapsed = seconds_since(start);
+        lock.lock();
+
+        writing_.reset();
+        stats_.write_seconds += elapsed;
+        if(error){
+            error_ = error;
+        }else{
+            ++stats_.checkpoints;
+        }
+        written_.notify_all();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Aligned.h"
+#include "Model.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Counters describing the cost of checkpointing to the training loop
+struct CheckpointStats{
+    // Checkpoints written to disk
+    size_t checkpoints = 0;
+    // Total time the training thread spent in save(): copying the snapshot, plus waiting when
+    // the writer had not yet picked up the previous one (the disk is the bottleneck)
+    double stall_seconds = 0.0;
+    // Total time the writer spent writing and flushing checkpoints
+    double write_seconds = 0.0;
+};
+
+// Periodic checkpoints written in the background. save() snapshots the parameters and the
+// optimizer's state into one of two preallocated buffers and returns; a writer thread saves the
+// snapshot (see Model::save) while training continues on the live arrays. With two buffers a new
+// snapshot can be taken while the previous one is being written, so the training thread only
+// waits if it takes snapshots faster than the disk can absorb them.
+class Checkpointer{
+public:
+    // The model and optimizer must outlive the checkpointer
+    Checkpointer(Model& model, Optimizer& optimizer, filesystem::path path);
+    // Writes the pending snapshot, if any
+    ~Checkpointer();
+
+    Checkpointer(Checkpointer const&) = delete;
+    Checkpointer& operator=(Checkpointer const&) = delete;
+
+    // Snapshot the training run, to be resumed from batch next_batch of the sampler seeded
+    // with seed. Must not run concurrently with updates of the parameters.
+    void save(size_t next_batch, uint32_t seed);
+
+    // Blocks until every snapshot taken is on disk. Rethrows the error of a failed write.
+    void flush();
+
+    CheckpointStats stats() const;
+
+private:
+    struct Snapshot{
+        aligned_vector<float> parameters;
+        vector<aligned_vector<float>> state;
+        TrainingState training;
+    };
+
+    void work();
+
+    Model& model_;
+    Optimizer& optimizer_;
+    filesystem::path path_;
+    Snapshot snapshots_[2];
+
+    mutable mutex mutex_;
+    // Signaled when a snapshot is pending (wakes the writer)
+    condition_variable pending_ready_;
+    // Signaled when the writer picks up or finishes a snapshot (wakes save and flush)
+    condition_variable written_;
+    // Snapshot waiting to be written and snapshot being written, if any
+    optional<size_t> pending_;
+    optional<size_t> writing_;
+    exception_ptr error_;
+    bool stop_ = false;
+    CheckpointStats stats_;
+
+    thread writer_;
+};
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "DataParallelTrainer.h"
+#include "IDXDataset.h"
+#include <algorithm>
+#include <stdexcept>
+
+DataParallelTrainer::DataParallelTrainer(vector<Replica>& replicas, ThreadPool& pool, size_t sample_size)
+    : replicas_{replicas}, pool_{pool}, sample_size_{sample_size}{
+    if(replicas_.empty()){
+        throw runtime_error{"Data-parallel training needs at least one replica"};
+    }
+
+    for(size_t r = 1; r < replicas_.size(); r++){
+        replicas_[r].model.share_parameters(replicas_.front().model);
+    }
+
+    for(Replica& replica : replicas_){
+        gradients_.push_back(replica.model.gradients());
+    }
+}
+
+void DataParallelTrainer::step(Batch const& batch){
+    size_t shards = replicas_.size();
+
+    pool_.run(shards, [&](size_t r){
+        size_t begin = batch.size * r / shards;
+        size_t end = batch.size * (r + 1) / shards;
+        if(begin == end){
+            return;
+        }
+
+        Replica& replica = replicas_[r];
+        replica.loss->set_target(batch.labels + begin * IDXDataset::CLASSES, batch.label_index + begin);
+        replica.loss->set_step_size(batch.size);
+        replica.model.forward(batch.data + begin * sample_size_, end - begin);
+        replica.model.reverse();
+    });
+
+    if(shards > 1){
+        pool_.run(shards, [this](size_t chunk){ reduce(chunk); });
+    }
+}
+
+void DataParallelTrainer::reduce(size_t chunk){
+    // Each chunk owns a disjoint range of the parameters, so no locking is needed. Within the
+    // range the replicas are always added in the same order
+    size_t chunks = replicas_.size();
+    size_t size = gradients_.front().size;
+    // Chunk boundaries fall on cache lines so no two chunks write to the same line
+    constexpr size_t line = CACHE_LINE / sizeof(float);
+    size_t begin = size / line * chunk / chunks * line;
+    size_t end = chunk + 1 == chunks ? size : size / line * (chunk + 1) / chunks * line;
+
+    float* primary = gradients_.front().data;
+    for(size_t r = 1; r < replicas_.size(); r++){
+        float* replica = gradients_[r].data;
+        for(size_t i = begin; i != end; i++){
+            primary[i] += replica[i];
+        }
+        // Replica gradients start from zero again for the next batch
+        std::fill(replica + begin, replica + end, float{0.0});
+    }
+}
+
+void DataParallelTrainer::merge_scores(){
+    for(size_t r = 1; r < replicas_.size(); r++){
+        replicas_.front().loss->merge_score(*replicas_[r].loss);
+        replicas_[r].loss->reset_score();
+    }
+}
+
+void DataParallelTrainer::reset_scores(){
+    for(Replica& replica : replicas_){
+        replica.loss->reset_score();
+    }
+}
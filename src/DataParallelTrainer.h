@@ -0,0 +1,52 @@
+#pragma once
+
+#include "CCELossNode.h"
+#include "Model.h"
+#include "Prefetcher.h"
+#include "ThreadPool.h"
+
+// One copy of the model graph, with the node batches are fed into and its loss node
+struct Replica{
+    Model model;
+    Node* input;
+    CCELossNode* loss;
+};
+
+// Synchronous data-parallel training. Each batch is split into one contiguous shard per replica,
+// and the replicas run their forward and reverse passes concurrently on the thread pool. Only the
+// per-sample state (activations, gradients) is replicated: every replica uses the parameters of
+// the first (primary) replica. Afterwards the parameter gradients of all replicas are summed into
+// the primary by a parallel per-chunk reduction, so Model::train can be applied to the primary as
+// usual. Shard boundaries and the reduction order depend only on the replica count, which makes
+// results deterministic for a fixed number of threads.
+class DataParallelTrainer{
+public:
+    // sample_size is the number of floats per sample in the batches passed to step(). The replicas
+    // must outlive the trainer
+    DataParallelTrainer(vector<Replica>& replicas, ThreadPool& pool, size_t sample_size);
+
+    // Forward and reverse one batch, leaving the gradients summed over the batch in the primary
+    void step(Batch const& batch);
+
+    // Add the loss statistics of all other replicas to the primary's loss node and reset theirs
+    void merge_scores();
+
+    void reset_scores();
+
+    Replica& primary() noexcept{
+        return replicas_.front();
+    }
+
+    size_t replicas() const noexcept{
+        return replicas_.size();
+    }
+
+private:
+    void reduce(size_t chunk);
+
+    vector<Replica>& replicas_;
+    ThreadPool& pool_;
+    size_t sample_size_;
+    // Gradient arena of every replica; all have the same layout
+    vector<FloatSpan> gradients_;
+};
@@ -0,0 +1,81 @@
+#include "Evaluator.h"
+#include "Profiler.h"
+#include <numeric>
+#include <stdexcept>
+
+Evaluator::Evaluator(vector<Replica>& replicas, ThreadPool& pool, IDXDataset const& dataset, size_t batch_size)
+    : replicas_{replicas}, pool_{pool}, dataset_{dataset}, batch_size_{batch_size}{
+    if(replicas_.empty() || batch_size_ == 0){
+        throw runtime_error{"Evaluation needs at least one replica and a non-zero batch size"};
+    }
+
+    for(size_t r = 0; r != replicas_.size(); r++){
+        if(r != 0){
+            replicas_[r].model.share_parameters(replicas_.front().model);
+        }
+        replicas_[r].model.set_inference(true);
+    }
+
+    buffers_.assign(replicas_.size(), BatchBuffers{batch_size_, dataset_.image_size()});
+}
+
+void Evaluator::run(){
+    for(Replica& replica : replicas_){
+        replica.loss->reset_score();
+    }
+
+    pool_.run(replicas_.size(), [this](size_t r){ run(r); });
+
+    for(size_t r = 1; r < replicas_.size(); r++){
+        replicas_.front().loss->merge_score(*replicas_[r].loss);
+        replicas_[r].loss->reset_score();
+    }
+}
+
+void Evaluator::quantize(float* samples, size_t count){
+    pool_.run(replicas_.size(), [&](size_t r){
+        Replica& replica = replicas_[r];
+        // Calibration needs no loss; the target bound by run() is only sized for batch_size_ samples
+        replica.loss->set_target(nullptr, nullptr);
+        replica.model.quantize(samples, count);
+        if(!replica.input->feed_quantized(QuantizedView{})){
+            throw runtime_error{"The input node of " + replica.model.name() + " cannot read 8-bit samples"};
+        }
+    });
+    quantized_ = true;
+}
+
+void Evaluator::run(size_t r){
+    size_t batches = (dataset_.size() + batch_size_ - 1) / batch_size_;
+    size_t shards = replicas_.size();
+    size_t first = batches * r / shards;
+    size_t last = batches * (r + 1) / shards;
+
+    Replica& replica = replicas_[r];
+    BatchBuffers& buffers = buffers_[r];
+    replica.loss->set_target(buffers.labels.data(), buffers.label_index.data());
+
+    for(size_t k = first; k != last; k++){
+        size_t begin = k * batch_size_;
+        size_t size = std::min(batch_size_, dataset_.size() - begin);
+        NN_PROFILE_SCOPE("batch", profile::Category::Batch, size);
+        std::iota(buffers.indices.begin(), buffers.indices.begin() + size, begin);
+        if(quantized_){
+            // Batches are contiguous ranges of the dataset, so the pixels are read straight from the
+            // mapping. They are scaled by 1/255 like the samples gather normalizes
+            replica.input->feed_quantized(QuantizedView{dataset_.image(begin), float{1.0} / float{255.0}, 0});
+            {
+                NN_PROFILE_SCOPE("input", profile::Category::Input);
+                dataset_.gather(buffers.indices.data(), size, nullptr, buffers.labels.data(), buffers.label_index.data());
+            }
+            replica.model.forward(nullptr, size);
+        }else{
+            {
+                NN_PROFILE_SCOPE("input", profile::Category::Input);
+                dataset_.gather(buffers.indices.data(), size, buffers.data.data(), buffers.labels.data(),
+                                buffers.label_index.data());
+            }
+            replica.model.forward(buffers.data.data(), size);
+        }
+    }
+}
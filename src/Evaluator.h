@@ -0,0 +1,41 @@
+#pragma once
+
+#include "DataParallelTrainer.h"
+#include "IDXDataset.h"
+#include "ThreadPool.h"
+
+// Parallel inference-only evaluation of a model over a whole dataset. The replicas share the
+// parameters of the first (primary) one and are switched into inference mode, so no gradient
+// state is kept. The dataset is split into one contiguous range of batches per replica, each
+// replica runs its range in large batches on the thread pool, and the loss statistics are merged
+// into the primary's loss node at the end. The split depends only on the replica count, so the
+// results are deterministic for a fixed number of threads.
+class Evaluator{
+public:
+    // The replicas and the dataset must outlive the evaluator
+    Evaluator(vector<Replica>& replicas, ThreadPool& pool, IDXDataset const& dataset, size_t batch_size);
+
+    // Forward every sample of the dataset once. The primary's loss node holds the statistics of
+    // exactly this pass afterwards
+    void run();
+
+    // Switch every replica to 8-bit integer inference, calibrated on count samples (see
+    // Model::quantize). The following runs feed the raw pixels of the dataset to the input nodes
+    // without converting them to floats
+    void quantize(float* samples, size_t count);
+
+    Replica& primary() noexcept{
+        return replicas_.front();
+    }
+
+private:
+    void run(size_t r);
+
+    vector<Replica>& replicas_;
+    ThreadPool& pool_;
+    IDXDataset const& dataset_;
+    size_t batch_size_;
+    // One per replica
+    vector<BatchBuffers> buffers_;
+    bool quantized_{false};
+};
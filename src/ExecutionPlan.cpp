@@ -0,0 +1,199 @@
+#include "ExecutionPlan.h"
+#include "MemoryPlanner.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace{
+
+// dst = the sum over the nodes of the size floats that source(node) points to
+template <typename Source>
+void accumulate(float* dst, vector<Node*> const& nodes, size_t size, Source source){
+    float const* first = source(nodes.front());
+    std::copy(first, first + size, dst);
+    for(size_t n = 1; n < nodes.size(); n++){
+        float const* src = source(nodes[n]);
+        for(size_t i = 0; i != size; i++){
+            dst[i] += src[i];
+        }
+    }
+}
+
+} // namespace
+
+ExecutionPlan::ExecutionPlan(vector<unique_ptr<Node>> const& nodes, bool inference) : inference_{inference}{
+    // Kahn's algorithm. Ready nodes are taken in the order they were added to the model, so the
+    // plan of a sequential model is simply the order of add_node
+    std::unordered_map<Node const*, size_t> pending;
+    for(auto const& node : nodes){
+        pending[node.get()] = node->antecedents_.size();
+    }
+
+    vector<bool> done(nodes.size(), false);
+    while(order_.size() != nodes.size()){
+        size_t next = nodes.size();
+        for(size_t i = 0; i != nodes.size(); i++){
+            if(!done[i] && pending[nodes[i].get()] == 0){
+                next = i;
+                break;
+            }
+        }
+        if(next == nodes.size()){
+            throw runtime_error{"The model graph contains a cycle"};
+        }
+
+        Node* node = nodes[next].get();
+        done[next] = true;
+        order_.push_back(node);
+        for(Node* subsequent : node->subsequents_){
+            --pending[subsequent];
+        }
+    }
+
+    for(Node* node : order_){
+        for(Node* antecedent : node->antecedents_){
+            if(antecedent->output_size() != node->antecedents_.front()->output_size()){
+                throw runtime_error{"The inputs summed by " + node->name() + " differ in size"};
+            }
+        }
+        steps_.push_back(Step{node, !node->antecedents_.empty(), nullptr, nullptr});
+    }
+}
+
+void ExecutionPlan::reserve(size_t batch){
+    if(batch <= capacity_){
+        return;
+    }
+
+    // Step i runs its forward pass at time i and its reverse pass at time 2n - 1 - i
+    size_t n = steps_.size();
+    auto reverse_time = [n](size_t i){ return 2 * n - 1 - i; };
+    std::unordered_map<Node const*, size_t> index;
+    for(size_t i = 0; i != n; i++){
+        index[steps_[i].node] = i;
+    }
+
+    // Every buffer to place and the pointer it is bound to
+    vector<BufferLifetime> lifetimes;
+    vector<float**> targets;
+    vector<vector<float*>> bindings(n);
+    auto request = [&](float** target, size_t first, size_t last, size_t sample_size){
+        lifetimes.push_back(BufferLifetime{first, last, batch * sample_size * sizeof(float)});
+        targets.push_back(target);
+    };
+
+    for(size_t i = 0; i != n; i++){
+        Step& step = steps_[i];
+        Node* node = step.node;
+
+        // In training everything written in the forward pass is kept until the node's reverse
+        size_t saved_until = i;
+        if(!inference_){
+            saved_until = reverse_time(i);
+        }
+
+        vector<BufferRequest> requests = node->buffers();
+        bindings[i].assign(requests.size(), nullptr);
+        for(size_t r = 0; r != requests.size(); r++){
+            float** target = &bindings[i][r];
+            size_t sample_size = requests[r].sample_size;
+            switch(requests[r].use){
+                case BufferUse::Output:{
+                    size_t last = saved_until;
+                    for(Node* subsequent : node->subsequents_){
+                        last = std::max(last, index[subsequent]);
+                    }
+                    request(target, i, last, sample_size);
+                    break;
+                }
+                case BufferUse::Saved:
+                    request(target, i, saved_until, sample_size);
+                    break;
+                case BufferUse::InputGradients:{
+                    // Read by the reverse pass of the antecedents, the earliest of which runs last.
+                    // Nobody reads the input gradients of nodes fed only by input nodes
+                    size_t first_reader = n;
+                    for(Node* antecedent : node->antecedents_){
+                        if(steps_[index[antecedent]].reversed){
+                            first_reader = std::min(first_reader, index[antecedent]);
+                        }
+                    }
+                    if(!inference_ && first_reader != n){
+                        request(target, reverse_time(i), reverse_time(first_reader), sample_size);
+                    }
+                    break;
+                }
+                case BufferUse::ReverseScratch:
+                    if(!inference_ && step.reversed){
+                        request(target, reverse_time(i), reverse_time(i), sample_size);
+                    }
+                    break;
+                case BufferUse::ForwardScratch:
+                    request(target, i, i, sample_size);
+                    break;
+            }
+        }
+
+        if(node->antecedents_.size() > 1){
+            request(&step.inputs, i, saved_until, node->antecedents_.front()->output_size());
+        }
+        if(!inference_ && step.reversed && node->subsequents_.size() > 1){
+            request(&step.gradients, reverse_time(i), reverse_time(i), node->output_size());
+        }
+    }
+
+    MemoryPlan plan = plan_memory(lifetimes);
+    arena_ = {};
+    arena_.resize(plan.peak_bytes / sizeof(float));
+    for(size_t b = 0; b != targets.size(); b++){
+        *targets[b] = arena_.data() + plan.offsets[b] / sizeof(float);
+    }
+    for(size_t i = 0; i != n; i++){
+        steps_[i].node->bind_buffers(bindings[i]);
+    }
+
+    capacity_ = batch;
+    peak_bytes_ = plan.peak_bytes;
+    total_bytes_ = plan.total_bytes;
+}
+
+void ExecutionPlan::forward(float* inputs, size_t batch){
+    reserve(batch);
+    batch_ = batch;
+    for(Step& step : steps_){
+        NN_PROFILE_SCOPE(step.node->name().c_str(), profile::Category::Forward);
+        vector<Node*> const& antecedents = step.node->antecedents_;
+        if(antecedents.empty()){
+            step.node->forward(inputs, batch);
+        }else if(antecedents.size() == 1){
+            step.node->forward(antecedents.front()->output(), batch);
+        }else{
+            size_t size = batch * antecedents.front()->output_size();
+            accumulate(step.inputs, antecedents, size, [](Node* node){ return node->output(); });
+            step.node->forward(step.inputs, batch);
+        }
+    }
+}
+
+void ExecutionPlan::reverse(){
+    for(auto it = steps_.rbegin(); it != steps_.rend(); ++it){
+        Step& step = *it;
+        // Nodes without antecedents have nowhere to send gradients to
+        if(!step.reversed){
+            continue;
+        }
+        NN_PROFILE_SCOPE(step.node->name().c_str(), profile::Category::Reverse);
+
+        vector<Node*> const& subsequents = step.node->subsequents_;
+        if(subsequents.empty()){
+            step.node->reverse(nullptr);
+        }else if(subsequents.size() == 1){
+            step.node->reverse(subsequents.front()->input_gradients());
+        }else{
+            size_t size = batch_ * step.node->output_size();
+            accumulate(step.gradients, subsequents, size, [](Node* node){ return node->input_gradients(); });
+            step.node->reverse(step.gradients);
+        }
+    }
+}
\ No newline at end of file
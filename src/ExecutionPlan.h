@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Aligned.h"
+#include "Model.h"
+
+// Flat schedule of a model's graph, compiled once from the edges created with Model::create_edge.
+// The nodes are sorted topologically, so a forward pass is a single loop over the nodes and a
+// reverse pass the same loop backwards; no node calls another one. Nodes with several
+// antecedents receive the sum of their outputs (as in a residual connection), and nodes whose
+// output feeds several subsequents receive the sum of the gradients of all of them, so graphs
+// with skip connections are evaluated with every node visited exactly once per pass.
+//
+// The plan also owns the memory of all intermediate buffers of the nodes and of these sums. From
+// the schedule it derives when every buffer is live and places them all in one cache-line aligned
+// arena, where buffers with disjoint lifetimes share memory (see plan_memory). An inference plan
+// has no gradient buffers at all. The arena is planned again whenever a larger batch comes in.
+class ExecutionPlan{
+public:
+    // Throws if the graph has a cycle or a node sums antecedents of different output sizes
+    ExecutionPlan(vector<unique_ptr<Node>> const& nodes, bool inference);
+
+    // Inputs are fed to every node without antecedents
+    void forward(float* inputs, size_t batch);
+
+    // Reverse the last forward pass, starting at the nodes without subsequents
+    void reverse();
+
+    // The nodes in execution order
+    vector<Node*> const& order() const noexcept{
+        return order_;
+    }
+
+    MemoryStats memory() const noexcept{
+        return {capacity_, peak_bytes_, total_bytes_};
+    }
+
+private:
+    struct Step{
+        Node* node;
+        // Whether the reverse pass runs this node (it has antecedents to send gradients to)
+        bool reversed;
+        // Sum of the outputs of the antecedents, only used with more than one
+        float* inputs;
+        // Sum of the input gradients of the subsequents, only used with more than one
+        float* gradients;
+    };
+
+    // Plan the arena for batch samples and bind every node to its buffers
+    void reserve(size_t batch);
+
+    vector<Step> steps_;
+    vector<Node*> order_;
+    bool inference_;
+    // Number of samples in the last forward pass
+    size_t batch_{0};
+    // Batch size the arena is planned for
+    size_t capacity_{0};
+    aligned_vector<float> arena_;
+    size_t peak_bytes_{0};
+    size_t total_bytes_{0};
+};
\ No newline at end of file
@@ -1,4 +1,10 @@
 #include "FFNode.h"
+#include "GEMM.h"
+#include "QGEMM.h"
+#include "Sparse.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
 
 
 FFNode::FFNode(Model& model, 
@@ -13,19 +19,12 @@ FFNode::FFNode(Model& model,
 {
     printf("%s: %d -> %d\n", name_.c_str(), input_size_, output_size_);
 
-    // The weight parameters of a FF-layer are an NxM matrix
-    weights_.resize(output_size_ * input_size_);
+    // The weight parameters of a FF-layer are an NxM matrix, followed in memory by the biases.
+    // Each node in this layer is assigned a bias (so that zero is not necessarily mapped to zero).
+    // They live in the model's parameter arena and are bound once the model lays it out
 
-    // Each node in this layer is assigned a bias (so that zero is not necessarily mapped to zero)
-    biases_.resize(output_size_);
-
-    // The outputs of each neuron within the layer is an "activation" in neuroscience parlance
-    activations_.resize(output_size_);
-
-    activation_gradients_.resize(output_size_);
-    weight_gradients_.resize(output_size_ * input_size_);
-    bias_gradients_.resize(output_size_);
-    input_gradients_.resize(input_size_);
+    // The outputs of each neuron within the layer is an "activation" in neuroscience parlance.
+    // Activations and the per-sample gradients are sized for the batch on the first forward pass
 }
 
 
@@ -44,64 +43,188 @@ void FFNode::init(mt19937& rne){
 
     auto dist = normal_distribution<float>(0.0, sigma);
     
-    for(float& w : weights_){
-        w = dist(rne);
+    for(size_t i = 0; i != output_size_ * input_size_; i++){
+        weights_[i] = dist(rne);
     }
 
-    for(float& b : biases_){
-        b = 0.01;
+    for(size_t i = 0; i != output_size_; i++){
+        biases_[i] = 0.01;
     }
+    weights_t_current_ = false;
 }
 
-void FFNode::forward(float* inputs){
-    // Remember te last input data for backpropagation later
-    last_input_ = inputs;
+void FFNode::forward(float* inputs, size_t batch){
+    // In bfloat16 precision the inputs are read in bfloat16 if the antecedent provides them
+    bfloat16 const* inputs16 = bfloat16_inputs() ? antecedents_.front()->bfloat16_output() : nullptr;
 
-    for(size_t i = 0; i != output_size_; i++){
-        // For each output vector, compute the dot product of the input data with the weight vector add the bias
-        float z{0.0};
-
-        size_t offset = i * input_size_;
-
-        for(size_t j = 0; j != input_size_; j++){
-            z += weights_[offset + j] * inputs[j];
+    // Remember te last input data for backpropagation later
+    if(!inference_){
+        last_input_ = inputs;
+        last_input16_ = inputs16;
+    }
+    batch_ = batch;
+
+    // A softmax feeding a single node that computes the softmax itself (the cross-entropy loss) is
+    // skipped here. The fused node works from the logits and returns dJ/dz directly
+    logits_ = activation_ == Activation::Softmax
+        && subsequents_.size() == 1
+        && subsequents_.front()->fuse_softmax();
+
+    sparse_ = false;
+    if(quantized_){
+        // The biases are added (and the ReLU applied) while the integer product is dequantized
+        forward_quantized(inputs, batch);
+        if(activation_ == Activation::ReLU){
+            return;
+        }
+    }else if(weights16_ != nullptr){
+        // Mixed precision: the bfloat16 operands are widened as the GEMM packs them and the
+        // products accumulate in float
+        if(inputs16 != nullptr){
+            sgemm(Transpose::No, Transpose::Yes, batch, output_size_, input_size_,
+                  inputs16, input_size_,
+                  weights16_, input_size_,
+                  float{0.0}, activations_, output_size_);
+        }else{
+            sgemm(Transpose::No, Transpose::Yes, batch, output_size_, input_size_,
+                  inputs, input_size_,
+                  weights16_, input_size_,
+                  float{0.0}, activations_, output_size_);
+        }
+    }else if(compress_rows(inputs, batch, input_size_, sparse_forward_density(output_size_), sparse_inputs_)){
+        // Mostly-zero inputs (the background pixels of a digit) were compressed to their non-zero
+        // entries, and only the weight columns of those are read. W is transposed first so that
+        // each column is contiguous. In inference W does not change, so it is transposed once
+        sparse_ = true;
+        if(weights_t_.empty()){
+            stride_t_ = (output_size_ + SPARSE_ALIGN - 1) / SPARSE_ALIGN * SPARSE_ALIGN;
+            weights_t_.assign(input_size_ * stride_t_, float{0.0});
+        }
+        if(!weights_t_current_){
+            transpose(weights_, output_size_, input_size_, input_size_, weights_t_.data(), stride_t_, false);
+            weights_t_current_ = inference_;
         }
+        sparse_gemm(sparse_inputs_, weights_t_.data(), stride_t_, output_size_, activations_, output_size_);
+    }else{
+        // The whole batch is transformed as one matrix-matrix product Z = I * W^T + B, where I is the
+        // [batch x input_size] input matrix. For each output vector, this computes the dot product of
+        // the input data with the weight vector
+        sgemm(Transpose::No, Transpose::Yes, batch, output_size_, input_size_,
+              inputs, input_size_,
+              weights_, input_size_,
+              float{0.0}, activations_, output_size_);
+    }
+
+    for(size_t b = 0; b != batch; b++){
+        float* activations = activations_ + b * output_size_;
 
         // Add neuron bias
-        z += biases_[i];
+        if(!quantized_){
+            for(size_t i = 0; i != output_size_; i++){
+                activations[i] += biases_[i];
+            }
+        }
 
         switch(activation_){
             case Activation::ReLU:
-                activations_[i] = max(z, float{0.0});
+                for(size_t i = 0; i != output_size_; i++){
+                    activations[i] = max(activations[i], float{0.0});
+                }
                 break;
             case Activation::Softmax:
-            default:
-                activations_[i] = exp(z);
+            default:{
+                if(logits_){
+                    break;
+                }
+                // softmax(z)_i = exp(z_i) / sum_j exp(z_j) = exp(z_i - max(z)) / sum_j exp(z_j - max(z)).
+                // Shifting by the largest logit keeps exp from overflowing
+                float max_z = *max_element(activations, activations + output_size_);
+                float sum_exp_z{0.0};
+                for(size_t i = 0; i != output_size_; i++){
+                    activations[i] = exp(activations[i] - max_z);
+                    sum_exp_z += activations[i];
+                }
+                float inv_sum_exp_z = float{1.0} / sum_exp_z;
+                for(size_t i = 0; i != output_size_; i++){
+                    activations[i] *= inv_sum_exp_z;
+                }
                 break;
+            }
         }
     }
 
-    if (activation_ == Activation::Softmax){
-        // softmax(z)_i = exp(z_i) / sum_j exp(z_j)
-        float sum_exp_z{0.0};
-        for(size_t i = 0; i != output_size_; i++){
-            sum_exp_z += activations_[i];
+    if(activations16_ != nullptr){
+        to_bfloat16(activations_, activations16_, batch * output_size_);
+    }
+
+    if(calibrating_ && batch != 0){
+        auto range = minmax_element(inputs, inputs + batch * input_size_);
+        input_min_ = min(input_min_, *range.first);
+        input_max_ = max(input_max_, *range.second);
+        if(activation_ == Activation::ReLU){
+            output_max_ = max(output_max_, *max_element(activations_, activations_ + batch * output_size_));
         }
-        float inv_sum_exp_z = float{1.0} / sum_exp_z;
-        for(size_t i = 0; i != output_size_; i++){
-            activations_[i] *= inv_sum_exp_z;
+    }
+}
+
+void FFNode::forward_quantized(float const* inputs, size_t batch){
+    // The 8-bit output of the antecedent is used as is; float inputs are quantized first
+    QuantizedView input = antecedents_.size() == 1 ? antecedents_.front()->quantized_output() : QuantizedView{};
+    if(input.data == nullptr){
+        if(inputs == nullptr){
+            throw runtime_error{"Node " + name_ + " received neither float nor quantized inputs"};
+        }
+        inputs_q_.resize(max(inputs_q_.size(), batch * input_size_));
+        float inv_scale = float{1.0} / input_scale_;
+        for(size_t i = 0; i != batch * input_size_; i++){
+            float q = nearbyint(inputs[i] * inv_scale) + static_cast<float>(input_zero_point_);
+            inputs_q_[i] = static_cast<uint8_t>(min(max(q, float{0.0}), float{255.0}));
         }
+        input = {inputs_q_.data(), input_scale_, input_zero_point_};
     }
 
-    // Forward activation data to all subsequent nodes in the computational graph
-    for(Node* subsequents : subsequents_){
-        // pass a pointer to the first element of the vector inputs
-        subsequents->forward(activations_.data());
+    accumulators_.resize(max(accumulators_.size(), batch * output_size_));
+    qgemm(batch, output_size_, input_size_,
+          input.data, input_size_,
+          weights_q_.data(), stride_q_,
+          accumulators_.data(), output_size_);
+
+    // x = s_x * (q_x - z_x) and w = s_w * q_w, so z = s_x * s_w * (q_x . q_w - z_x * sum(q_w)) + b.
+    // The float activations are skipped when every subsequent reads the requantized output
+    auto reads_quantized = [](Node* node){ return node->quantized(); };
+    requantized_ = activation_ == Activation::ReLU && any_of(subsequents_.begin(), subsequents_.end(), reads_quantized);
+    bool floats = !all_of(subsequents_.begin(), subsequents_.end(), reads_quantized) || subsequents_.empty();
+    if(requantized_){
+        outputs_.resize(max(outputs_.size(), batch * output_size_));
+    }
+    float inv_output_scale = float{1.0} / output_scale_;
+
+    for(size_t b = 0; b != batch; b++){
+        int32_t const* accumulators = accumulators_.data() + b * output_size_;
+        float* activations = activations_ + b * output_size_;
+        uint8_t* outputs = outputs_.data() + b * output_size_;
+        for(size_t i = 0; i != output_size_; i++){
+            int32_t dot = accumulators[i] - input.zero_point * weight_sums_[i];
+            float z = static_cast<float>(dot) * (input.scale * weight_scales_[i]) + biases_[i];
+            if(activation_ == Activation::ReLU){
+                z = max(z, float{0.0});
+            }
+            if(floats){
+                activations[i] = z;
+            }
+            if(requantized_){
+                outputs[i] = static_cast<uint8_t>(min(nearbyint(z * inv_output_scale), float{255.0}));
+            }
+        }
     }
 }
 
 void FFNode::reverse(float* gradients){
-    // We receive a vector of output_size_ gradients of the loss function with respect to the activations of this node.
+    if(inference_){
+        throw runtime_error{"Cannot backpropagate through " + name_ + " in inference mode"};
+    }
+
+    // We receive a [batch x output_size_] matrix of gradients of the loss function with respect to the activations of this node.
     // We need to compute the gradients of the loss function with respect to each parameter in the node (all weights and biases).
     // In addition, we need to compute the gradients with respect to the inputs in order to propagate the gradients further.
 
@@ -117,78 +240,226 @@ void FFNode::reverse(float* gradients){
     // The gradient we receive from the subsequent is dJ/dg(Z) which we can use to compute dJ/dW_{i,j}, dJ/dB_i, and dJ/dI_i
 
     // First, we compute dJ/dz as dJ/dg(z) * dg(z)/dz and store it in out activations array
-    for(size_t i = 0; i != output_size_; i++){
-        // dg(z)/dz
-        float activation_grad{0.0};
+    for(size_t b = 0; b != batch_; b++){
+        float const* activations = activations_ + b * output_size_;
+        bfloat16 const* activations16 = activations16_ == nullptr ? nullptr : activations16_ + b * output_size_;
+        float const* sample_gradients = gradients + b * output_size_;
+        float* activation_gradients = activation_gradients_ + b * output_size_;
+
         switch(activation_){
             case Activation::ReLU:
-                if(activations_[i] > float(0.0)){
-                    activation_grad = float{0.0};
-                }else{
-                    activation_grad = float{1.0};
+                for(size_t i = 0; i != output_size_; i++){
+                    // dg(z)/dz. A bfloat16 output has the sign of the float one
+                    float activation = activations16_ != nullptr ? to_float(activations16[i]) : activations[i];
+                    float activation_grad{0.0};
+                    if(activation > float(0.0)){
+                        activation_grad = float{1.0};
+                    }else{
+                        activation_grad = float{0.0};
+                    }
+                    // dJ/dz = dJ/dg(z) * dg(z)/dz
+                    activation_gradients[i] = sample_gradients[i] * activation_grad;
                 }
-                // dJ/dz = dJ/dg(z) * dg(z)/dz
-                activation_gradients_[i] = gradients[i] * activation_grad;
                 break;
             case Activation::Softmax:
-            default:
+            default:{
+                if(logits_){
+                    // The fused loss node already delivered dJ/dz
+                    copy(sample_gradients, sample_gradients + output_size_, activation_gradients);
+                    break;
+                }
+                // The softmax Jacobian is dg(z)_i/dz_j = g_i * (delta_ij - g_j), so
+                // dJ/dz_i = \sum_j dJ/dg_j * g_j * (delta_ij - g_i) = g_i * (dJ/dg_i - \sum_j dJ/dg_j * g_j)
+                // which only needs one dot product per sample instead of the full Jacobian
+                float dot{0.0};
                 for(size_t j = 0; j != output_size_; j++){
-                    if (i == j){
-                        activation_grad += activations_[i] * (float{1.0} - activations_[i]) * gradients[j];
-                    }else{
-                        activation_grad += -activations_[i] * activations_[j] * gradients[j];
-                    }
+                    dot += sample_gradients[j] * activations[j];
+                }
+                for(size_t i = 0; i != output_size_; i++){
+                    activation_gradients[i] = activations[i] * (sample_gradients[i] - dot);
                 }
-                activation_gradients_[i] = activation_grad;
                 break;
+            }
         }
     }
 
-    for(size_t i = 0; i != output_size_; i++){
-        // Next, let's cumpute the partial dJ/db_i. If we hold all the weights and imputs
-        // constant, it's clear that dz/db_i is just 1 (consider differentiating the line
-        // mx + b with respect to b). Thus, dJ/db_i = dJ/dg(z_i) * dg(z_i)/dz_i * 1
-        bias_gradients_[i] += activation_gradients_[i];
+    for(size_t b = 0; b != batch_; b++){
+        for(size_t i = 0; i != output_size_; i++){
+            // Next, let's cumpute the partial dJ/db_i. If we hold all the weights and imputs
+            // constant, it's clear that dz/db_i is just 1 (consider differentiating the line
+            // mx + b with respect to b). Thus, dJ/db_i = dJ/dg(z_i) * dg(z_i)/dz_i * 1
+            bias_gradients_[i] += activation_gradients_[b * output_size_ + i];
+        }
     }
 
-    fill(input_gradients_.begin(), input_gradients_.end(), 0.0);
-
     // To compute dz/dI_i, recall that z_i = \sum_i W_i * I_i + B_i. That is, the precursor to each activation is
     // a dot-product between a weight vector and the input plus a bias. Thus, dz/dI_i must be the sum of all
-    // weights that were scaled by I_i during the forward pass.
-    for(size_t i = 0; i != output_size_; i++){
-        size_t offset = i * input_size_;
-        for(size_t j = 0; j != input_size_; j++){
-            input_gradients_[j] += weights_[offset + j] * activation_gradients_[i];
+    // weights that were scaled by I_i during the forward pass. For the batch this is dJ/dI = dJ/dZ * W
+
+    // Each individual weight shows up in the equation for z once and is scaled by the corresponding input.
+    // Thus, dJ/dw_ij = dJ/dg(z_i) * dg(z_i)/dz_i * dz_i/dw_ij where the last factor is equal to the input scaled by w_ij.
+    // Over the batch the per-sample contributions sum to dJ/dW = (dJ/dZ)^T * I, a rank-batch outer-product update
+
+    // Both products are computed in one sweep so that each tile of W is loaded once and the weight
+    // gradients are updated row-major and contiguously. When nothing upstream needs dJ/dI (the
+    // inputs come straight from an input node) only the weight gradients are computed
+    if(weights16_ != nullptr){
+        // The fused kernel reads float weights. In bfloat16 precision the two products are separate
+        // GEMMs that widen W and the inputs as they pack them
+        if(input_gradients_ != nullptr){
+            sgemm(Transpose::No, Transpose::No, batch_, input_size_, output_size_,
+                  activation_gradients_, output_size_,
+                  weights16_, input_size_,
+                  float{0.0}, input_gradients_, input_size_);
         }
+        if(last_input16_ != nullptr){
+            sgemm(Transpose::Yes, Transpose::No, output_size_, input_size_, batch_,
+                  activation_gradients_, output_size_,
+                  last_input16_, input_size_,
+                  float{1.0}, weight_gradients_, input_size_);
+        }else{
+            sgemm(Transpose::Yes, Transpose::No, output_size_, input_size_, batch_,
+                  activation_gradients_, output_size_,
+                  last_input_, input_size_,
+                  float{1.0}, weight_gradients_, input_size_);
+        }
+    }else if(sparse_ && sparse_inputs_.starts.back()
+             <= sparse_gradient_density(output_size_) * static_cast<float>(batch_ * input_size_)){
+        // Only the weight columns of the non-zero inputs receive gradients. They are accumulated
+        // transposed, where each column is contiguous, and then added to dW
+        if(input_gradients_ != nullptr){
+            sgemm(Transpose::No, Transpose::No, batch_, input_size_, output_size_,
+                  activation_gradients_, output_size_,
+                  weights_, input_size_,
+                  float{0.0}, input_gradients_, input_size_);
+        }
+        weight_gradients_t_.assign(input_size_ * stride_t_, float{0.0});
+        sparse_outer(sparse_inputs_, activation_gradients_, output_size_, output_size_,
+                     weight_gradients_t_.data(), stride_t_);
+        transpose(weight_gradients_t_.data(), input_size_, output_size_, stride_t_,
+                  weight_gradients_, input_size_, true);
+    }else if(input_gradients_ != nullptr){
+        dense_backward(batch_, input_size_, output_size_,
+                       activation_gradients_,
+                       last_input_,
+                       weights_,
+                       input_gradients_,
+                       weight_gradients_);
+    }else{
+        sgemm(Transpose::Yes, Transpose::No, output_size_, input_size_, batch_,
+              activation_gradients_, output_size_,
+              last_input_, input_size_,
+              float{1.0}, weight_gradients_, input_size_);
     }
+}
 
-    for(size_t i = 0; i != input_size_; i++){
-        for(size_t j = 0; j != output_size_; j++){
-            // Each individual weight shows up in the equation for z once and is scaled by the corresponding input.
-            // Thus, dJ/dw_i = dJ/dg(z_i) * dg(z_i)/dz_i * dz_i/dw_ij where the last factor is equal to the input scaled by w_ij
-            weight_gradients_[j * input_size_ + i] += last_input_[i] * activation_gradients_[j];
-        }
+bool FFNode::narrow_output() const{
+    // In inference the output only lives until the subsequents have read it, so storing it in
+    // bfloat16 would save nothing over the float scratch buffer it needs
+    if(weights16_ == nullptr || inference_ || activation_ != Activation::ReLU || subsequents_.empty()){
+        return false;
     }
+    return all_of(subsequents_.begin(), subsequents_.end(), [](Node* node){ return node->bfloat16_inputs(); });
+}
 
-    for(Node* node : antecedents_){
-        // Forward loss gradients with respect to the inputs to the previous node
-        node->reverse(input_gradients_.data());
+vector<BufferRequest> FFNode::buffers() const{
+    if(narrow_output()){
+        // The bfloat16 output takes half the floats. The float results it is rounded from are only
+        // needed during the forward pass
+        return {
+            {BufferUse::Output, (output_size_ + 1u) / 2},
+            {BufferUse::ReverseScratch, output_size_},
+            {BufferUse::InputGradients, input_size_},
+            {BufferUse::ForwardScratch, output_size_}
+        };
     }
+    return {
+        {BufferUse::Output, output_size_},
+        {BufferUse::ReverseScratch, output_size_},
+        {BufferUse::InputGradients, input_size_}
+    };
 }
 
-float* FFNode::param(size_t index){
-    if(index < weights_.size()){
-        return &weights_[index];
+void FFNode::bind_buffers(vector<float*> const& buffers){
+    if(buffers.size() == 4){
+        activations16_ = reinterpret_cast<bfloat16*>(buffers[0]);
+        activations_ = buffers[3];
+    }else{
+        activations16_ = nullptr;
+        activations_ = buffers[0];
     }
-    return &biases_[index - weights_.size()];
+    activation_gradients_ = buffers[1];
+    input_gradients_ = buffers[2];
+}
+
+void FFNode::bind(float* params, float* gradients){
+    weights_ = params;
+    biases_ = params + output_size_ * input_size_;
+    weight_gradients_ = gradients;
+    bias_gradients_ = gradients == nullptr ? nullptr : gradients + output_size_ * input_size_;
+    weights_t_current_ = false;
+}
+
+void FFNode::bind_bfloat16(bfloat16 const* params){
+    weights16_ = params;
 }
 
-float* FFNode::gradient(size_t index){
-    if(index < weights_.size()){
-        return &weight_gradients_[index];
+void FFNode::set_inference(bool inference){
+    inference_ = inference;
+    weights_t_current_ = false;
+    last_input_ = nullptr;
+    last_input16_ = nullptr;
+    // Training updates the float weights, which the quantized ones would no longer match
+    if(!inference){
+        quantized_ = false;
+        requantized_ = false;
     }
-    return &bias_gradients_[index - weights_.size()];
+}
+
+void FFNode::calibrate(bool calibrating){
+    calibrating_ = calibrating;
+    if(calibrating){
+        // The ranges are recorded by the float path
+        quantized_ = false;
+        requantized_ = false;
+        input_min_ = numeric_limits<float>::max();
+        input_max_ = numeric_limits<float>::lowest();
+        output_max_ = float{0.0};
+    }
+}
+
+void FFNode::quantize(){
+    // Weights are quantized symmetrically per row, w = scale * q with q in [-127, 127], so every
+    // output neuron uses the full 8 bits whatever the magnitude of its weights
+    stride_q_ = (input_size_ + QGEMM_ALIGN - 1) / QGEMM_ALIGN * QGEMM_ALIGN;
+    weights_q_.assign(output_size_ * stride_q_, 0);
+    weight_scales_.resize(output_size_);
+    weight_sums_.resize(output_size_);
+    for(size_t i = 0; i != output_size_; i++){
+        float const* row = weights_ + i * input_size_;
+        float max_abs{0.0};
+        for(size_t j = 0; j != input_size_; j++){
+            max_abs = max(max_abs, abs(row[j]));
+        }
+        float scale = max_abs > float{0.0} ? max_abs / float{127.0} : float{1.0};
+        int32_t sum = 0;
+        for(size_t j = 0; j != input_size_; j++){
+            int8_t q = static_cast<int8_t>(nearbyint(row[j] / scale));
+            weights_q_[i * stride_q_ + j] = q;
+            sum += q;
+        }
+        weight_scales_[i] = scale;
+        weight_sums_[i] = sum;
+    }
+
+    // Inputs are quantized asymmetrically over the calibrated range, widened to include zero so
+    // that zero is exact. A ReLU output only needs [0, max]
+    float low = min(input_min_, float{0.0});
+    float high = max(input_max_, float{0.0});
+    input_scale_ = high > low ? (high - low) / float{255.0} : float{1.0};
+    input_zero_point_ = static_cast<int32_t>(nearbyint(-low / input_scale_));
+    output_scale_ = output_max_ > float{0.0} ? output_max_ / float{255.0} : float{1.0};
+    quantized_ = true;
 }
 
 void FFNode::print() const{
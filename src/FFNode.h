@@ -1,5 +1,7 @@
 #pragma once
 #include "Model.h"
+#include "Aligned.h"
+#include "Sparse.h"
 
 enum class Activation{
     ReLU,
@@ -12,37 +14,146 @@ public:
 
     void init(mt19937& rne) override;
 
-    // The input data should have size input_size
-    void forward(float* inputs) override;
+    // The input data should have size batch * input_size. Mostly-zero inputs take the sparse path
+    // of Sparse.h, which only reads the weight columns of the non-zero entries
+    void forward(float* inputs, size_t batch) override;
 
-    // The gradient data should have size output_size
+    // The gradient data should have size batch * output_size
     void reverse(float* gradients) override;
 
+    size_t output_size() const noexcept override{
+        return output_size_;
+    }
+
+    // Null when the output is only kept in bfloat16
+    float* output() override{
+        return activations16_ == nullptr ? activations_ : nullptr;
+    }
+
+    float* input_gradients() override{
+        return input_gradients_;
+    }
+
+    vector<BufferRequest> buffers() const override;
+    void bind_buffers(vector<float*> const& buffers) override;
+
     size_t param_count() const noexcept{
         // Weight matrix entries + bias entries
         return (input_size_ + 1) * output_size_;
     }
 
-    float* param(size_t index);
-    float* gradient(size_t index);
+    vector<size_t> param_shape() const override{
+        return {output_size_, input_size_};
+    }
+
+    void bind(float* params, float* gradients) override;
+    void set_inference(bool inference) override;
+
+    // In bfloat16 precision the products use the bfloat16 weights, widened to float by the GEMM.
+    // While training, the ReLU output of a layer feeding only such layers, which is kept for the
+    // reverse pass, is stored in bfloat16 as well
+    void bind_bfloat16(bfloat16 const* params) override;
+
+    bool bfloat16_inputs() const noexcept override{
+        return weights16_ != nullptr && antecedents_.size() == 1;
+    }
+
+    bfloat16 const* bfloat16_output() const override{
+        return activations16_;
+    }
+
+    // Weights are rounded to int8 with one scale per row, inputs to uint8 with one scale for the
+    // whole layer. The integer product is dequantized, biased and (for ReLU) requantized to the
+    // uint8 output read by quantized subsequents in a single pass over the accumulators
+    void calibrate(bool calibrating) override;
+    void quantize() override;
+
+    // Only a single antecedent's output is read quantized; sums of several are formed in floats
+    bool quantized() const noexcept override{
+        return quantized_ && antecedents_.size() == 1;
+    }
+
+    QuantizedView quantized_output() const override{
+        return requantized_ ? QuantizedView{outputs_.data(), output_scale_, 0} : QuantizedView{};
+    }
 
     void print() const override;
 
 private:
+    void forward_quantized(float const* inputs, size_t batch);
+
+    // Whether the output is only stored in bfloat16
+    bool narrow_output() const;
+
     Activation activation_;
     uint16_t output_size_;
     uint16_t input_size_;
 
     // Node parameters ------>
-    vector<float> weights_;
-    vector<float> biases_;
-    vector<float> activations_;
+    // Views into the parameter arena of the model: the [output_size x input_size] weight matrix
+    // followed by the biases
+    float* weights_{nullptr};
+    float* biases_{nullptr};
+    // The bfloat16 copy of the weights in bfloat16 precision, null otherwise
+    bfloat16 const* weights16_{nullptr};
+    // Intermediate buffers, bound by the model's execution plan ------>
+    // With a bfloat16 output, activations_ is scratch space for the float results of the forward pass
+    float* activations_{nullptr};
+    bfloat16* activations16_{nullptr};
 
     // Loss gradients ------>
-    vector<float> weight_gradients_;
-    vector<float> bias_gradients_;
-    vector<float> activation_gradients_;
+    // Views into the gradient arena of the model, laid out like the parameters
+    float* weight_gradients_{nullptr};
+    float* bias_gradients_{nullptr};
+    // dJ/dz of the batch during reverse
+    float* activation_gradients_{nullptr};
+
+    // Null when no antecedent needs them
+    float* input_gradients_{nullptr};
+    float* last_input_{nullptr};
+    bfloat16 const* last_input16_{nullptr};
+    // Number of samples in the last forward pass
+    size_t batch_{0};
+    // Set in inference mode, where no gradient buffers exist and the input is not remembered
+    bool inference_{false};
+    // Set when the softmax was fused into the subsequent node so the activations are raw logits
+    bool logits_{false};
+
+    // Sparse inputs ------>
+    // Set when the inputs of the last forward pass were sparse enough to be compressed
+    bool sparse_{false};
+    SparseRows sparse_inputs_;
+    // [input_size x stride] transposed weights and weight gradients, rows zero-padded to the stride
+    size_t stride_t_{0};
+    aligned_vector<float> weights_t_;
+    // Set while weights_t_ holds the current weights. Only kept in inference mode, where the
+    // weights change only by binding or initializing them; in training the optimizer updates them
+    // after every batch
+    bool weights_t_current_{false};
+    aligned_vector<float> weight_gradients_t_;
 
-    vector<float> input_gradients_;
-    float* last_input_;
+    // Quantized inference ------>
+    // Ranges of the inputs and of the activations seen while calibrating
+    bool calibrating_{false};
+    float input_min_{0.0};
+    float input_max_{0.0};
+    float output_max_{0.0};
+    bool quantized_{false};
+    // [output_size x stride] int8 weights, rows zero-padded to the stride, and per row the scale
+    // and the sum of the weights (to correct for the zero point of the inputs)
+    aligned_vector<int8_t> weights_q_;
+    size_t stride_q_{0};
+    vector<float> weight_scales_;
+    vector<int32_t> weight_sums_;
+    // Quantization of float inputs (used when the antecedent has no quantized output)
+    float input_scale_{0.0};
+    int32_t input_zero_point_{0};
+    // Scale of the uint8 output of a ReLU layer
+    float output_scale_{0.0};
+    // Per-batch buffers, grown to the largest batch
+    aligned_vector<uint8_t> inputs_q_;
+    aligned_vector<int32_t> accumulators_;
+    aligned_vector<uint8_t> outputs_;
+    // Set when the last forward pass produced outputs_
+    bool requantized_{false};
 };
\ No newline at end of file
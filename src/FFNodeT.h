@@ -0,0 +1,371 @@
+#pragma once
+#include "FFNode.h"
+#include "GEMM.h"
+#include "Sparse.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+// Feedforward layer whose sizes and activation are compile-time constants, added to a model like
+// any other node:
+//
+//     auto& hidden = model.add_node<FFNodeT<784, 32, Activation::ReLU>>("hidden");
+//
+// It computes the same function as FFNode with the same parameter layout, so the two can replace
+// each other in a model and in its checkpoints. With the sizes fixed, every per-sample loop has
+// a constant trip count, the activation is chosen at compile time and the transposed weights
+// live in fixed-size aligned storage inside the node. Layers small enough for their weight
+// gradients to stay in vector registers (such as 32 -> 10) are computed by the fixed-size kernels
+// below, which the blocked GEMM cannot match at these sizes because of its packing; larger
+// layers use the GEMM and sparse kernels of FFNode. The layer always computes in float, it has
+// no bfloat16 or int8 path.
+template <size_t In, size_t Out, Activation Act>
+class FFNodeT : public Node {
+    static_assert(In != 0 && Out != 0 && In <= UINT16_MAX && Out <= UINT16_MAX, "Layer sizes must fit in 16 bits");
+
+public:
+    FFNodeT(Model& model, string name) : Node{model, std::move(name)}{
+        printf("%s: %zu -> %zu\n", name_.c_str(), In, Out);
+    }
+
+    void init(mt19937& rne) override{
+        // The same distributions, drawn in the same order, as FFNode
+        float sigma = Act == Activation::ReLU
+            ? sqrt(2.0 / static_cast<float>(In))
+            : sqrt(1.0 / static_cast<float>(In));
+        auto dist = normal_distribution<float>(0.0, sigma);
+        for(size_t i = 0; i != Out * In; i++){
+            weights_[i] = dist(rne);
+        }
+        for(size_t i = 0; i != Out; i++){
+            biases_[i] = 0.01;
+        }
+        weights_t_current_ = false;
+    }
+
+    void forward(float* inputs, size_t batch) override{
+        if(!inference_){
+            last_input_ = inputs;
+        }
+        batch_ = batch;
+        if constexpr(Act == Activation::Softmax){
+            logits_ = subsequents_.size() == 1 && subsequents_.front()->fuse_softmax();
+        }
+
+        sparse_ = false;
+        if constexpr(DIRECT){
+            transpose_weights();
+            forward_direct(batch, inputs, weights_t_, biases_, activations_);
+        }else{
+            if(compress_rows(inputs, batch, In, sparse_forward_density(Out), sparse_inputs_)){
+                sparse_ = true;
+                transpose_weights();
+                sparse_gemm(sparse_inputs_, weights_t_, STRIDE, Out, activations_, Out);
+            }else{
+                sgemm(Transpose::No, Transpose::Yes, batch, Out, In,
+                      inputs, In,
+                      weights_, In,
+                      float{0.0}, activations_, Out);
+            }
+            for(size_t b = 0; b != batch; b++){
+                float* activations = activations_ + b * Out;
+                for(size_t i = 0; i != Out; i++){
+                    activations[i] += biases_[i];
+                }
+            }
+        }
+
+        for(size_t b = 0; b != batch; b++){
+            float* activations = activations_ + b * Out;
+            if constexpr(Act == Activation::ReLU){
+                for(size_t i = 0; i != Out; i++){
+                    activations[i] = max(activations[i], float{0.0});
+                }
+            }else if(!logits_){
+                float max_z = *max_element(activations, activations + Out);
+                float sum_exp_z{0.0};
+                for(size_t i = 0; i != Out; i++){
+                    activations[i] = exp(activations[i] - max_z);
+                    sum_exp_z += activations[i];
+                }
+                float inv_sum_exp_z = float{1.0} / sum_exp_z;
+                for(size_t i = 0; i != Out; i++){
+                    activations[i] *= inv_sum_exp_z;
+                }
+            }
+        }
+    }
+
+    void reverse(float* gradients) override{
+        if(inference_){
+            throw runtime_error{"Cannot backpropagate through " + name_ + " in inference mode"};
+        }
+
+        // dJ/dz and dJ/db as in FFNode::reverse
+        for(size_t b = 0; b != batch_; b++){
+            float const* activations = activations_ + b * Out;
+            float const* sample_gradients = gradients + b * Out;
+            float* activation_gradients = activation_gradients_ + b * Out;
+            if constexpr(Act == Activation::ReLU){
+                for(size_t i = 0; i != Out; i++){
+                    activation_gradients[i] = activations[i] > float{0.0} ? sample_gradients[i] : float{0.0};
+                }
+            }else if(logits_){
+                copy(sample_gradients, sample_gradients + Out, activation_gradients);
+            }else{
+                float dot{0.0};
+                for(size_t j = 0; j != Out; j++){
+                    dot += sample_gradients[j] * activations[j];
+                }
+                for(size_t i = 0; i != Out; i++){
+                    activation_gradients[i] = activations[i] * (sample_gradients[i] - dot);
+                }
+            }
+            for(size_t i = 0; i != Out; i++){
+                bias_gradients_[i] += activation_gradients[i];
+            }
+        }
+
+        if constexpr(DIRECT){
+            if(input_gradients_ != nullptr){
+                backward_direct<true>(batch_, activation_gradients_, last_input_, weights_, input_gradients_, weight_gradients_);
+            }else{
+                backward_direct<false>(batch_, activation_gradients_, last_input_, weights_, input_gradients_, weight_gradients_);
+            }
+        }else if(sparse_ && sparse_inputs_.starts.back() <= sparse_gradient_density(Out) * static_cast<float>(batch_ * In)){
+            if(input_gradients_ != nullptr){
+                sgemm(Transpose::No, Transpose::No, batch_, In, Out,
+                      activation_gradients_, Out,
+                      weights_, In,
+                      float{0.0}, input_gradients_, In);
+            }
+            fill(begin(weight_gradients_t_), end(weight_gradients_t_), float{0.0});
+            sparse_outer(sparse_inputs_, activation_gradients_, Out, Out, weight_gradients_t_, STRIDE);
+            transpose(weight_gradients_t_, In, Out, STRIDE, weight_gradients_, In, true);
+        }else if(input_gradients_ != nullptr){
+            dense_backward(batch_, In, Out, activation_gradients_, last_input_, weights_, input_gradients_, weight_gradients_);
+        }else{
+            sgemm(Transpose::Yes, Transpose::No, Out, In, batch_,
+                  activation_gradients_, Out,
+                  last_input_, In,
+                  float{1.0}, weight_gradients_, In);
+        }
+    }
+
+    size_t output_size() const noexcept override{
+        return Out;
+    }
+
+    float* output() override{
+        return activations_;
+    }
+
+    float* input_gradients() override{
+        return input_gradients_;
+    }
+
+    vector<BufferRequest> buffers() const override{
+        return {
+            {BufferUse::Output, Out},
+            {BufferUse::ReverseScratch, Out},
+            {BufferUse::InputGradients, In}
+        };
+    }
+
+    void bind_buffers(vector<float*> const& buffers) override{
+        activations_ = buffers[0];
+        activation_gradients_ = buffers[1];
+        input_gradients_ = buffers[2];
+    }
+
+    size_t param_count() const noexcept override{
+        return (In + 1) * Out;
+    }
+
+    vector<size_t> param_shape() const override{
+        return {Out, In};
+    }
+
+    void bind(float* params, float* gradients) override{
+        weights_ = params;
+        biases_ = params + Out * In;
+        weight_gradients_ = gradients;
+        bias_gradients_ = gradients == nullptr ? nullptr : gradients + Out * In;
+        weights_t_current_ = false;
+    }
+
+    void set_inference(bool inference) override{
+        inference_ = inference;
+        weights_t_current_ = false;
+        last_input_ = nullptr;
+    }
+
+    void print() const override{
+        printf("%s\n", name_.c_str());
+        printf("Weights (%zu X %zu)\n", Out, In);
+        for(size_t i = 0; i != Out; i++){
+            for(size_t j = 0; j != In; j++){
+                printf("\t[%zu]%f", i * In + j, weights_[i * In + j]);
+            }
+            printf("\n");
+        }
+        printf("Biases (%zu x 1)\n", Out);
+        for(size_t i = 0; i != Out; i++){
+            printf("\t%f\n", biases_[i]);
+        }
+        printf("\n");
+    }
+
+private:
+    // The fixed-size kernels work on vectors of 16 floats. GCC lowers them to one AVX-512 register,
+    // two AVX2 registers or four SSE registers in the respective clones
+    static constexpr size_t LANES = 16;
+    typedef float Vec __attribute__((vector_size(LANES * sizeof(float))));
+
+    // Full vectors and remaining floats of an input row
+    static constexpr size_t IN_VECTORS = In / LANES;
+    static constexpr size_t IN_TAIL = In % LANES;
+
+    // Rows of the transposed weights are padded to whole vectors
+    static constexpr size_t STRIDE = (Out + SPARSE_ALIGN - 1) / SPARSE_ALIGN * SPARSE_ALIGN;
+    static constexpr size_t OUT_VECTORS = STRIDE / LANES;
+    static_assert(STRIDE % LANES == 0, "Transposed rows must hold whole vectors");
+
+    // Whether the weight gradients (and, in the forward pass, the outputs of a sample) fit in the
+    // 32 AVX-512 registers with room to spare
+    static constexpr bool DIRECT = Out * (IN_VECTORS + (IN_TAIL != 0)) <= 24;
+
+    // Unaligned vector accesses. The vectors are passed by reference, as passing them by value
+    // would depend on the instruction set of the clone
+    static void load(Vec& v, float const* data){
+        memcpy(&v, data, sizeof(v));
+    }
+
+    static void store(float* data, Vec const& v){
+        memcpy(data, &v, sizeof(v));
+    }
+
+    // Refresh weights_t_ unless it holds the weights of an earlier inference pass
+    void transpose_weights(){
+        if(!weights_t_current_){
+            transpose(weights_, Out, In, In, weights_t_, STRIDE, false);
+            weights_t_current_ = inference_;
+        }
+    }
+
+    // Z = I * W^T + B from the transposed weights: the outputs of a sample are accumulated in
+    // registers, adding one row of W^T per input
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+    static void forward_direct(size_t batch, float const* inputs, float const* weights_t, float const* biases, float* z){
+        alignas(CACHE_LINE) float padded[STRIDE] = {};
+        copy(biases, biases + Out, padded);
+        Vec bias[OUT_VECTORS];
+        for(size_t k = 0; k != OUT_VECTORS; k++){
+            load(bias[k], padded + k * LANES);
+        }
+
+        for(size_t b = 0; b != batch; b++){
+            float const* input = inputs + b * In;
+            Vec acc[OUT_VECTORS];
+            for(size_t k = 0; k != OUT_VECTORS; k++){
+                acc[k] = bias[k];
+            }
+            for(size_t j = 0; j != In; j++){
+                float x = input[j];
+                for(size_t k = 0; k != OUT_VECTORS; k++){
+                    Vec w;
+                    load(w, weights_t + j * STRIDE + k * LANES);
+                    acc[k] += x * w;
+                }
+            }
+            for(size_t k = 0; k != OUT_VECTORS; k++){
+                store(padded + k * LANES, acc[k]);
+            }
+            copy(padded, padded + Out, z + b * Out);
+        }
+    }
+
+    // dI = dZ * W and dW += dZ^T * I with the whole of dW held in registers while the batch
+    // streams past it
+    template <bool InputGradients>
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+    static void backward_direct(size_t batch, float const* dz, float const* inputs, float const* weights,
+                                float* input_gradients, float* weight_gradients){
+        Vec dw[Out][IN_VECTORS == 0 ? 1 : IN_VECTORS];
+        for(size_t o = 0; o != Out; o++){
+            for(size_t k = 0; k != IN_VECTORS; k++){
+                load(dw[o][k], weight_gradients + o * In + k * LANES);
+            }
+        }
+
+        for(size_t b = 0; b != batch; b++){
+            float const* input = inputs + b * In;
+            float const* g = dz + b * Out;
+            Vec x[IN_VECTORS == 0 ? 1 : IN_VECTORS];
+            Vec di[IN_VECTORS == 0 ? 1 : IN_VECTORS];
+            float di_tail[IN_TAIL == 0 ? 1 : IN_TAIL] = {};
+            for(size_t k = 0; k != IN_VECTORS; k++){
+                load(x[k], input + k * LANES);
+                di[k] = Vec{};
+            }
+            for(size_t o = 0; o != Out; o++){
+                float go = g[o];
+                float const* w = weights + o * In;
+                for(size_t k = 0; k != IN_VECTORS; k++){
+                    if constexpr(InputGradients){
+                        Vec wk;
+                        load(wk, w + k * LANES);
+                        di[k] += go * wk;
+                    }
+                    dw[o][k] += go * x[k];
+                }
+                for(size_t j = IN_VECTORS * LANES; j != In; j++){
+                    if constexpr(InputGradients){
+                        di_tail[j - IN_VECTORS * LANES] += go * w[j];
+                    }
+                    weight_gradients[o * In + j] += go * input[j];
+                }
+            }
+            if constexpr(InputGradients){
+                float* dx = input_gradients + b * In;
+                for(size_t k = 0; k != IN_VECTORS; k++){
+                    store(dx + k * LANES, di[k]);
+                }
+                copy(di_tail, di_tail + IN_TAIL, dx + IN_VECTORS * LANES);
+            }
+        }
+
+        for(size_t o = 0; o != Out; o++){
+            for(size_t k = 0; k != IN_VECTORS; k++){
+                store(weight_gradients + o * In + k * LANES, dw[o][k]);
+            }
+        }
+    }
+
+    // Views into the parameter and gradient arenas of the model, laid out as in FFNode
+    float* weights_{nullptr};
+    float* biases_{nullptr};
+    float* weight_gradients_{nullptr};
+    float* bias_gradients_{nullptr};
+
+    // Intermediate buffers, bound by the model's execution plan
+    float* activations_{nullptr};
+    float* activation_gradients_{nullptr};
+    float* input_gradients_{nullptr};
+    float* last_input_{nullptr};
+    size_t batch_{0};
+    bool inference_{false};
+    bool logits_{false};
+
+    // The [In x STRIDE] transposed weights, rows zero-padded, read by the fixed-size forward kernel
+    // and the sparse kernels
+    alignas(CACHE_LINE) float weights_t_[In * STRIDE] = {};
+    // Set while weights_t_ holds the current weights, in inference mode only (see FFNode)
+    bool weights_t_current_{false};
+
+    // Sparse inputs of a layer too large for the fixed-size kernels (see FFNode)
+    bool sparse_{false};
+    SparseRows sparse_inputs_;
+    alignas(CACHE_LINE) float weight_gradients_t_[DIRECT ? 1 : In * STRIDE] = {};
+};
@@ -2,15 +2,24 @@
 #include "Model.h"
 #include <cmath>
 
-GDOptimizer::GDOptimizer(float eta): eta_{eta}{}
+namespace{
 
-void GDOptimizer::train(Node& node){
-    size_t param_count = node.param_count();
-    for(size_t i = 0; i != param_count; i++){
-        float& params = *node.param(i);
-        float& gradient = *node.gradient(i);
-        params -= eta_ * gradient;
+// p -= eta * g and g = 0 in one pass
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void sgd_update(float* params, float* gradients, size_t count, float eta){
+    float* __restrict p = static_cast<float*>(__builtin_assume_aligned(params, CACHE_LINE));
+    float* __restrict g = static_cast<float*>(__builtin_assume_aligned(gradients, CACHE_LINE));
+    for(size_t i = 0; i != count; i++){
+        p[i] -= eta * g[i];
         // Rest the gradient which will be accumulated again in the next training epoch
-        gradient = float{0.0};
+        g[i] = float{0.0};
     }
+}
+
+} // namespace
+
+GDOptimizer::GDOptimizer(float eta): eta_{eta}{}
+
+void GDOptimizer::train(float* params, float* gradients, size_t count){
+    sgd_update(params, gradients, count, eta_);
 }
\ No newline at end of file
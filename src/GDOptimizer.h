@@ -13,9 +13,12 @@ public:
     GDOptimizer(float eta);
 
     // This should be invoked at the end of each batch's evaluation.
-    // The interface technically permits the use of different optimizers for
-    // different segments of the computational graph.
-    void train(Node& node) override;
+    // The update and the reset of the gradients are one vectorized pass over both arrays
+    void train(float* params, float* gradients, size_t count) override;
+
+    char const* name() const noexcept override{
+        return "sgd";
+    }
 
 private:
     float eta_;
@@ -0,0 +1,501 @@
+#include "GEMM.h"
+#include "Aligned.h"
+#include "BFloat16.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define NN_GEMM_X86 1
+#endif
+
+namespace{
+
+// Blocking parameters. A KC x NR panel of B stays in L1 while it is multiplied against
+// every MR-row panel of an MC x KC block of A, which itself stays in L2. MC is a multiple
+// of every micro-kernel's MR and NC a multiple of every NR.
+constexpr size_t KC = 256;
+constexpr size_t MC = 96;
+constexpr size_t NC = 1024;
+
+// Operands stored in bfloat16 are widened to float as they are packed, so the micro-kernels only
+// ever see float panels
+inline float widen(float x){
+    return x;
+}
+
+inline float widen(bfloat16 x){
+    return to_float(x);
+}
+
+// Pack an mc x kc block of op(A) starting at (i0, p0) into panels of MR rows. Within a panel
+// the data is k-major so the micro-kernel reads MR consecutive values per step. Rows past the
+// edge of the matrix are zero-padded.
+template <size_t MR, typename T>
+void pack_a(bool trans, T const* a, size_t lda, size_t i0, size_t p0, size_t mc, size_t kc, float* out){
+    for(size_t ir = 0; ir < mc; ir += MR){
+        size_t mr = std::min(MR, mc - ir);
+        if(trans){
+            // op(A)(i, p) = A(p, i): rows of the panel are contiguous in memory
+            for(size_t p = 0; p != kc; p++){
+                T const* src = a + (p0 + p) * lda + i0 + ir;
+                for(size_t r = 0; r != mr; r++){
+                    out[p * MR + r] = widen(src[r]);
+                }
+                for(size_t r = mr; r != MR; r++){
+                    out[p * MR + r] = 0.0f;
+                }
+            }
+        }else{
+            for(size_t r = 0; r != MR; r++){
+                if(r < mr){
+                    T const* src = a + (i0 + ir + r) * lda + p0;
+                    for(size_t p = 0; p != kc; p++){
+                        out[p * MR + r] = widen(src[p]);
+                    }
+                }else{
+                    for(size_t p = 0; p != kc; p++){
+                        out[p * MR + r] = 0.0f;
+                    }
+                }
+            }
+        }
+        out += MR * kc;
+    }
+}
+
+// Pack a kc x nc block of op(B) starting at (p0, j0) into panels of NR columns, k-major,
+// zero-padding columns past the edge of the matrix.
+template <size_t NR, typename T>
+void pack_b(bool trans, T const* b, size_t ldb, size_t p0, size_t j0, size_t kc, size_t nc, float* out){
+    for(size_t jr = 0; jr < nc; jr += NR){
+        size_t nr = std::min(NR, nc - jr);
+        if(trans){
+            // op(B)(p, j) = B(j, p): each column of the panel is a contiguous row of B
+            for(size_t c = 0; c != NR; c++){
+                if(c < nr){
+                    T const* src = b + (j0 + jr + c) * ldb + p0;
+                    for(size_t p = 0; p != kc; p++){
+                        out[p * NR + c] = widen(src[p]);
+                    }
+                }else{
+                    for(size_t p = 0; p != kc; p++){
+                        out[p * NR + c] = 0.0f;
+                    }
+                }
+            }
+        }else{
+            for(size_t p = 0; p != kc; p++){
+                T const* src = b + (p0 + p) * ldb + j0 + jr;
+                for(size_t c = 0; c != nr; c++){
+                    out[p * NR + c] = widen(src[c]);
+                }
+                for(size_t c = nr; c != NR; c++){
+                    out[p * NR + c] = 0.0f;
+                }
+            }
+        }
+        out += NR * kc;
+    }
+}
+
+// Fused backward pass for OT rows of W starting at o0 and VW columns starting at j0 (see
+// dense_backward). The W and dW tiles are small enough to stay in L1 (or registers) while the
+// batch streams past them.
+template <size_t OT, size_t VW>
+void backward_tile_generic(size_t batch, size_t in, size_t out, size_t o0, size_t j0,
+                           float const* __restrict dz, float const* __restrict x, float const* __restrict w,
+                           float* __restrict dx, float* __restrict dw, bool first){
+    if(first){
+        for(size_t b = 0; b != batch; b++){
+            float* __restrict dxb = dx + b * in + j0;
+            for(size_t j = 0; j != VW; j++){
+                dxb[j] = 0.0f;
+            }
+        }
+    }
+    for(size_t b = 0; b != batch; b++){
+        float const* __restrict xb = x + b * in + j0;
+        float* __restrict dxb = dx + b * in + j0;
+        float const* g = dz + b * out + o0;
+        for(size_t o = 0; o != OT; o++){
+            float const* __restrict wo = w + (o0 + o) * in + j0;
+            float* __restrict dwo = dw + (o0 + o) * in + j0;
+            float go = g[o];
+            for(size_t j = 0; j != VW; j++){
+                dxb[j] += go * wo[j];
+                dwo[j] += go * xb[j];
+            }
+        }
+    }
+}
+
+// Portable micro-kernel. The fixed-size accumulator lets the compiler keep the tile in
+// registers and vectorize across the NR columns with whatever SIMD the baseline target has.
+struct GenericKernel{
+    static constexpr size_t MR = 4;
+    static constexpr size_t NR = 16;
+    // Rows and columns of the W tile held in registers by the fused backward pass
+    static constexpr size_t OT = 4;
+    static constexpr size_t VW = 16;
+    static constexpr char const* name = "generic";
+
+    template <size_t Rows>
+    static void backward(size_t batch, size_t in, size_t out, size_t o0, size_t j0,
+                         float const* dz, float const* x, float const* w, float* dx, float* dw, bool first){
+        backward_tile_generic<Rows, VW>(batch, in, out, o0, j0, dz, x, w, dx, dw, first);
+    }
+
+    static void compute(size_t kc, float const* __restrict a, float const* __restrict b, float* c, size_t ldc){
+        float acc[MR][NR] = {};
+        for(size_t p = 0; p != kc; p++){
+#pragma GCC unroll 4
+            for(size_t r = 0; r != MR; r++){
+                float ar = a[r];
+                for(size_t j = 0; j != NR; j++){
+                    acc[r][j] += ar * b[j];
+                }
+            }
+            a += MR;
+            b += NR;
+        }
+        for(size_t r = 0; r != MR; r++){
+            for(size_t j = 0; j != NR; j++){
+                c[r * ldc + j] += acc[r][j];
+            }
+        }
+    }
+};
+
+#ifdef NN_GEMM_X86
+// 6 x 16 tile: 12 ymm accumulators, 2 for the B row and 1 for the broadcast A value
+struct Avx2Kernel{
+    static constexpr size_t MR = 6;
+    static constexpr size_t NR = 16;
+    static constexpr size_t OT = 6;
+    static constexpr size_t VW = 8;
+    static constexpr char const* name = "avx2";
+
+    template <size_t Rows>
+    __attribute__((target("avx2,fma")))
+    static void backward(size_t batch, size_t in, size_t out, size_t o0, size_t j0,
+                         float const* dz, float const* x, float const* w, float* dx, float* dw, bool first){
+        __m256 wt[Rows];
+        __m256 gt[Rows];
+#pragma GCC unroll 6
+        for(size_t o = 0; o != Rows; o++){
+            wt[o] = _mm256_loadu_ps(w + (o0 + o) * in + j0);
+            gt[o] = _mm256_loadu_ps(dw + (o0 + o) * in + j0);
+        }
+        for(size_t b = 0; b != batch; b++){
+            __m256 xb = _mm256_loadu_ps(x + b * in + j0);
+            float* dxb = dx + b * in + j0;
+            float const* g = dz + b * out + o0;
+            __m256 d = first ? _mm256_setzero_ps() : _mm256_loadu_ps(dxb);
+#pragma GCC unroll 6
+            for(size_t o = 0; o != Rows; o++){
+                __m256 go = _mm256_broadcast_ss(g + o);
+                d = _mm256_fmadd_ps(go, wt[o], d);
+                gt[o] = _mm256_fmadd_ps(go, xb, gt[o]);
+            }
+            _mm256_storeu_ps(dxb, d);
+        }
+#pragma GCC unroll 6
+        for(size_t o = 0; o != Rows; o++){
+            _mm256_storeu_ps(dw + (o0 + o) * in + j0, gt[o]);
+        }
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void compute(size_t kc, float const* a, float const* b, float* c, size_t ldc){
+        __m256 acc[MR][2];
+#pragma GCC unroll 6
+        for(size_t r = 0; r != MR; r++){
+            acc[r][0] = _mm256_setzero_ps();
+            acc[r][1] = _mm256_setzero_ps();
+        }
+        for(size_t p = 0; p != kc; p++){
+            __m256 b0 = _mm256_load_ps(b);
+            __m256 b1 = _mm256_load_ps(b + 8);
+#pragma GCC unroll 6
+            for(size_t r = 0; r != MR; r++){
+                __m256 ar = _mm256_broadcast_ss(a + r);
+                acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+                acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+            }
+            a += MR;
+            b += NR;
+        }
+#pragma GCC unroll 6
+        for(size_t r = 0; r != MR; r++){
+            float* row = c + r * ldc;
+            _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), acc[r][0]));
+            _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), acc[r][1]));
+        }
+    }
+};
+
+// 8 x 32 tile: 16 zmm accumulators out of the 32 architectural registers
+struct Avx512Kernel{
+    static constexpr size_t MR = 8;
+    static constexpr size_t NR = 32;
+    static constexpr size_t OT = 8;
+    static constexpr size_t VW = 16;
+    static constexpr char const* name = "avx512";
+
+    template <size_t Rows>
+    __attribute__((target("avx512f")))
+    static void backward(size_t batch, size_t in, size_t out, size_t o0, size_t j0,
+                         float const* dz, float const* x, float const* w, float* dx, float* dw, bool first){
+        __m512 wt[Rows];
+        __m512 gt[Rows];
+#pragma GCC unroll 8
+        for(size_t o = 0; o != Rows; o++){
+            wt[o] = _mm512_loadu_ps(w + (o0 + o) * in + j0);
+            gt[o] = _mm512_loadu_ps(dw + (o0 + o) * in + j0);
+        }
+        for(size_t b = 0; b != batch; b++){
+            __m512 xb = _mm512_loadu_ps(x + b * in + j0);
+            float* dxb = dx + b * in + j0;
+            float const* g = dz + b * out + o0;
+            __m512 d = first ? _mm512_setzero_ps() : _mm512_loadu_ps(dxb);
+#pragma GCC unroll 8
+            for(size_t o = 0; o != Rows; o++){
+                __m512 go = _mm512_set1_ps(g[o]);
+                d = _mm512_fmadd_ps(go, wt[o], d);
+                gt[o] = _mm512_fmadd_ps(go, xb, gt[o]);
+            }
+            _mm512_storeu_ps(dxb, d);
+        }
+#pragma GCC unroll 8
+        for(size_t o = 0; o != Rows; o++){
+            _mm512_storeu_ps(dw + (o0 + o) * in + j0, gt[o]);
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    static void compute(size_t kc, float const* a, float const* b, float* c, size_t ldc){
+        __m512 acc[MR][2];
+#pragma GCC unroll 8
+        for(size_t r = 0; r != MR; r++){
+            acc[r][0] = _mm512_setzero_ps();
+            acc[r][1] = _mm512_setzero_ps();
+        }
+        for(size_t p = 0; p != kc; p++){
+            __m512 b0 = _mm512_load_ps(b);
+            __m512 b1 = _mm512_load_ps(b + 16);
+#pragma GCC unroll 8
+            for(size_t r = 0; r != MR; r++){
+                __m512 ar = _mm512_set1_ps(a[r]);
+                acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+                acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+            }
+            a += MR;
+            b += NR;
+        }
+#pragma GCC unroll 8
+        for(size_t r = 0; r != MR; r++){
+            float* row = c + r * ldc;
+            _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), acc[r][0]));
+            _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), acc[r][1]));
+        }
+    }
+};
+#endif
+
+template <typename Kernel, typename TA, typename TB>
+void gemm_blocked(bool trans_a, bool trans_b,
+                  size_t m, size_t n, size_t k,
+                  TA const* a, size_t lda,
+                  TB const* b, size_t ldb,
+                  float* c, size_t ldc){
+    constexpr size_t MR = Kernel::MR;
+    constexpr size_t NR = Kernel::NR;
+
+    // Packing buffers are reused across calls (and are private to each thread)
+    thread_local aligned_vector<float> a_pack(MC * KC);
+    thread_local aligned_vector<float> b_pack(KC * NC);
+
+    for(size_t jc = 0; jc < n; jc += NC){
+        size_t nc = std::min(NC, n - jc);
+        for(size_t pc = 0; pc < k; pc += KC){
+            size_t kc = std::min(KC, k - pc);
+            pack_b<NR>(trans_b, b, ldb, pc, jc, kc, nc, b_pack.data());
+
+            for(size_t ic = 0; ic < m; ic += MC){
+                size_t mc = std::min(MC, m - ic);
+                pack_a<MR>(trans_a, a, lda, ic, pc, mc, kc, a_pack.data());
+
+                for(size_t jr = 0; jr < nc; jr += NR){
+                    size_t nr = std::min(NR, nc - jr);
+                    float const* b_panel = b_pack.data() + jr * kc;
+
+                    for(size_t ir = 0; ir < mc; ir += MR){
+                        size_t mr = std::min(MR, mc - ir);
+                        float const* a_panel = a_pack.data() + ir * kc;
+                        float* c_tile = c + (ic + ir) * ldc + jc + jr;
+
+                        if(mr == MR && nr == NR){
+                            Kernel::compute(kc, a_panel, b_panel, c_tile, ldc);
+                        }else{
+                            // Edge tiles are computed into a scratch tile and only the valid
+                            // region is added to C
+                            alignas(CACHE_LINE) float tile[MR * NR] = {};
+                            Kernel::compute(kc, a_panel, b_panel, tile, NR);
+                            for(size_t r = 0; r != mr; r++){
+                                for(size_t j = 0; j != nr; j++){
+                                    c_tile[r * ldc + j] += tile[r * NR + j];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <typename Kernel>
+void backward_fused(size_t batch, size_t in, size_t out,
+                    float const* dz, float const* x, float const* w, float* dx, float* dw){
+    constexpr size_t OT = Kernel::OT;
+    constexpr size_t VW = Kernel::VW;
+
+    // Columns are the outer loop so that the VW-wide slices of the inputs and input gradients
+    // for the whole batch stay in L1 while every row tile of W visits them
+    size_t in_vec = in / VW * VW;
+    for(size_t j0 = 0; j0 != in_vec; j0 += VW){
+        size_t o = 0;
+        for(; o + OT <= out; o += OT){
+            Kernel::template backward<OT>(batch, in, out, o, j0, dz, x, w, dx, dw, o == 0);
+        }
+        for(; o != out; o++){
+            Kernel::template backward<1>(batch, in, out, o, j0, dz, x, w, dx, dw, o == 0);
+        }
+    }
+    for(size_t j0 = in_vec; j0 != in; j0++){
+        for(size_t o = 0; o != out; o++){
+            backward_tile_generic<1, 1>(batch, in, out, o, j0, dz, x, w, dx, dw, o == 0);
+        }
+    }
+}
+
+template <typename TA, typename TB>
+using GemmFn = void (*)(bool, bool, size_t, size_t, size_t, TA const*, size_t, TB const*, size_t, float*, size_t);
+using BackwardFn = void (*)(size_t, size_t, size_t, float const*, float const*, float const*, float*, float*);
+
+struct GemmKernel{
+    GemmFn<float, float> fn;
+    // Mixed precision: B or both operands in bfloat16
+    GemmFn<float, bfloat16> fn_mixed;
+    GemmFn<bfloat16, bfloat16> fn_bfloat16;
+    BackwardFn backward;
+    char const* name;
+};
+
+template <typename Kernel>
+GemmKernel make_kernel(){
+    return {&gemm_blocked<Kernel, float, float>, &gemm_blocked<Kernel, float, bfloat16>,
+            &gemm_blocked<Kernel, bfloat16, bfloat16>, &backward_fused<Kernel>, Kernel::name};
+}
+
+GemmKernel select_kernel(){
+    // NN_SGEMM=generic|avx2|avx512 restricts the choice, e.g. to compare kernels on one machine
+    char const* requested = std::getenv("NN_SGEMM");
+    auto allowed = [requested](char const* name){
+        return requested == nullptr || std::strcmp(requested, name) == 0;
+    };
+
+#ifdef NN_GEMM_X86
+    __builtin_cpu_init();
+    if(allowed(Avx512Kernel::name) && __builtin_cpu_supports("avx512f")){
+        return make_kernel<Avx512Kernel>();
+    }
+    if(allowed(Avx2Kernel::name) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        return make_kernel<Avx2Kernel>();
+    }
+#endif
+    (void)allowed;
+    return make_kernel<GenericKernel>();
+}
+
+GemmKernel const& kernel(){
+    static GemmKernel const selected = select_kernel();
+    return selected;
+}
+
+template <typename TA, typename TB>
+void gemm(GemmFn<TA, TB> fn, Transpose trans_a, Transpose trans_b,
+          size_t m, size_t n, size_t k,
+          TA const* a, size_t lda,
+          TB const* b, size_t ldb,
+          float beta,
+          float* c, size_t ldc){
+    // The micro-kernels always accumulate, so apply beta to C up front
+    if(beta != 1.0f){
+        for(size_t i = 0; i != m; i++){
+            float* row = c + i * ldc;
+            if(beta == 0.0f){
+                std::fill(row, row + n, 0.0f);
+            }else{
+                for(size_t j = 0; j != n; j++){
+                    row[j] *= beta;
+                }
+            }
+        }
+    }
+
+    if(m == 0 || n == 0 || k == 0){
+        return;
+    }
+
+    fn(trans_a == Transpose::Yes, trans_b == Transpose::Yes, m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+} // namespace
+
+void sgemm(Transpose trans_a, Transpose trans_b,
+           size_t m, size_t n, size_t k,
+           float const* a, size_t lda,
+           float const* b, size_t ldb,
+           float beta,
+           float* c, size_t ldc){
+    gemm(kernel().fn, trans_a, trans_b, m, n, k, a, lda, b, ldb, beta, c, ldc);
+}
+
+void sgemm(Transpose trans_a, Transpose trans_b,
+           size_t m, size_t n, size_t k,
+           float const* a, size_t lda,
+           bfloat16 const* b, size_t ldb,
+           float beta,
+           float* c, size_t ldc){
+    gemm(kernel().fn_mixed, trans_a, trans_b, m, n, k, a, lda, b, ldb, beta, c, ldc);
+}
+
+void sgemm(Transpose trans_a, Transpose trans_b,
+           size_t m, size_t n, size_t k,
+           bfloat16 const* a, size_t lda,
+           bfloat16 const* b, size_t ldb,
+           float beta,
+           float* c, size_t ldc){
+    gemm(kernel().fn_bfloat16, trans_a, trans_b, m, n, k, a, lda, b, ldb, beta, c, ldc);
+}
+
+void dense_backward(size_t batch, size_t in, size_t out,
+                    float const* output_gradients,
+                    float const* inputs,
+                    float const* weights,
+                    float* input_gradients,
+                    float* weight_gradients){
+    if(out == 0){
+        std::fill(input_gradients, input_gradients + batch * in, 0.0f);
+        return;
+    }
+
+    kernel().backward(batch, in, out, output_gradients, inputs, weights, input_gradients, weight_gradients);
+}
+
+char const* sgemm_kernel_name() noexcept{
+    return kernel().name;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "BFloat16.h"
+#include <cstddef>
+
+// Dense single-precision matrix multiplication used by the feedforward nodes.
+// All matrices are row-major. The product is cache-blocked (panels of A and B are packed
+// into contiguous buffers that fit in L1/L2) and computed by a register-tiled micro-kernel.
+// The micro-kernel is selected once at runtime from the features of the host CPU:
+// AVX-512, AVX2 + FMA, or a portable fallback.
+
+enum class Transpose{
+    No,
+    Yes
+};
+
+// C = op(A) * op(B) + beta * C, where op(A) is m x k, op(B) is k x n and C is m x n.
+// lda, ldb and ldc are the row strides of A, B and C as they are stored (before op is applied).
+// beta = 0 overwrites C (which may then be uninitialized), beta = 1 accumulates into C.
+void sgemm(Transpose trans_a, Transpose trans_b,
+           size_t m, size_t n, size_t k,
+           float const* a, size_t lda,
+           float const* b, size_t ldb,
+           float beta,
+           float* c, size_t ldc);
+
+// Mixed-precision variants with B, or both operands, stored in bfloat16. The operands are widened
+// to float as they are packed into the cache blocks, so the products accumulate in float and C
+// is float as well
+void sgemm(Transpose trans_a, Transpose trans_b,
+           size_t m, size_t n, size_t k,
+           float const* a, size_t lda,
+           bfloat16 const* b, size_t ldb,
+           float beta,
+           float* c, size_t ldc);
+void sgemm(Transpose trans_a, Transpose trans_b,
+           size_t m, size_t n, size_t k,
+           bfloat16 const* a, size_t lda,
+           bfloat16 const* b, size_t ldb,
+           float beta,
+           float* c, size_t ldc);
+
+// Fused backward pass of a dense layer Z = I * W^T with I a [batch x in] input matrix and W
+// the [out x in] weight matrix. Given dZ ([batch x out]) this computes
+//   dI  = dZ * W      (input_gradients is overwritten)
+//   dW += dZ^T * I    (weight_gradients is accumulated, a rank-batch update)
+// in a single sweep: each register tile of W and dW is loaded once, updated with contiguous
+// row-major accesses for every sample of the batch, and written back once.
+void dense_backward(size_t batch, size_t in, size_t out,
+                    float const* output_gradients,
+                    float const* inputs,
+                    float const* weights,
+                    float* input_gradients,
+                    float* weight_gradients);
+
+// Name of the micro-kernel selected for this CPU (for diagnostics and benchmarks)
+char const* sgemm_kernel_name() noexcept;
@@ -0,0 +1,62 @@
+#include "HogwildTrainer.h"
+#include "Profiler.h"
+#include <stdexcept>
+
+HogwildTrainer::HogwildTrainer(vector<Replica>& replicas, ThreadPool& pool, IDXDataset const& dataset,
+                               Sampler const& sampler)
+    : replicas_{replicas}, pool_{pool}, dataset_{dataset}, sampler_{sampler}{
+    if(replicas_.empty()){
+        throw runtime_error{"Hogwild training needs at least one replica"};
+    }
+
+    for(size_t r = 1; r < replicas_.size(); r++){
+        replicas_[r].model.share_parameters(replicas_.front().model);
+    }
+
+    buffers_.assign(replicas_.size(), BatchBuffers{sampler_.batch_size(), dataset_.image_size()});
+}
+
+void HogwildTrainer::train(size_t first, size_t count, Optimizer& optimizer){
+    next_.store(first, std::memory_order_relaxed);
+    size_t end = first + count;
+    pool_.run(replicas_.size(), [&](size_t r){ run(r, end, optimizer); });
+}
+
+void HogwildTrainer::run(size_t r, size_t end, Optimizer& optimizer){
+    Replica& replica = replicas_[r];
+    BatchBuffers& buffers = buffers_[r];
+
+    // Batches are handed out one at a time, so faster threads simply process more of them
+    for(size_t sequence = next_.fetch_add(1, std::memory_order_relaxed); sequence < end;
+        sequence = next_.fetch_add(1, std::memory_order_relaxed)){
+        size_t size = sampler_.batch(sequence, buffers.indices.data());
+        NN_PROFILE_SCOPE("batch", profile::Category::Batch, size);
+        {
+            NN_PROFILE_SCOPE("input", profile::Category::Input);
+            dataset_.gather(buffers.indices.data(), size, buffers.data.data(), buffers.labels.data(),
+                            buffers.label_index.data());
+        }
+
+        replica.loss->set_target(buffers.labels.data(), buffers.label_index.data());
+        replica.loss->set_step_size(size);
+        replica.model.forward(buffers.data.data(), size);
+        replica.model.reverse();
+
+        // The optimizer reads this replica's gradients and writes the shared parameters while the
+        // other replicas read them in their own passes. These races are the point of Hogwild!
+        replica.model.train(optimizer);
+    }
+}
+
+void HogwildTrainer::merge_scores(){
+    for(size_t r = 1; r < replicas_.size(); r++){
+        replicas_.front().loss->merge_score(*replicas_[r].loss);
+        replicas_[r].loss->reset_score();
+    }
+}
+
+void HogwildTrainer::reset_scores(){
+    for(Replica& replica : replicas_){
+        replica.loss->reset_score();
+    }
+}
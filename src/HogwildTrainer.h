@@ -0,0 +1,50 @@
+#pragma once
+
+#include "DataParallelTrainer.h"
+#include "IDXDataset.h"
+#include "Sampler.h"
+#include "ThreadPool.h"
+#include <atomic>
+
+// Asynchronous lock-free training in the style of Hogwild!. Every replica runs on its own thread
+// and repeatedly claims the next batch of the sampler's order, assembles it, runs the forward
+// and reverse passes, and applies the optimizer directly to the parameters shared by all replicas
+// (see Model::share_parameters). Gradients are kept per replica, but the parameter updates are
+// not synchronized: concurrent read-modify-writes of the same weight may lose an update. For
+// the sparse, small updates of SGD this costs little accuracy and removes every barrier between
+// the threads. Unlike DataParallelTrainer the results are not reproducible with more than one
+// thread.
+class HogwildTrainer{
+public:
+    // The replicas must outlive the trainer; the optimizer passed to train() is invoked
+    // concurrently from every thread and therefore must not keep per-call state
+    HogwildTrainer(vector<Replica>& replicas, ThreadPool& pool, IDXDataset const& dataset, Sampler const& sampler);
+
+    // Train on the batches [first, first + count) of the sampler's order and return once all of
+    // them have been applied. Each batch is a full step: the optimizer is applied after it.
+    void train(size_t first, size_t count, Optimizer& optimizer);
+
+    // Add the loss statistics of all other replicas to the primary's loss node and reset theirs
+    void merge_scores();
+
+    void reset_scores();
+
+    Replica& primary() noexcept{
+        return replicas_.front();
+    }
+
+    size_t replicas() const noexcept{
+        return replicas_.size();
+    }
+
+private:
+    void run(size_t r, size_t end, Optimizer& optimizer);
+
+    vector<Replica>& replicas_;
+    ThreadPool& pool_;
+    IDXDataset const& dataset_;
+    Sampler const& sampler_;
+    // One per replica, so batches are assembled without any shared state
+    vector<BatchBuffers> buffers_;
+    std::atomic<size_t> next_{0};
+};
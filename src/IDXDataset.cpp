@@ -0,0 +1,79 @@
+#include "IDXDataset.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace{
+// IDX headers store unsigned integers big-endian
+uint32_t read_be(uint8_t const* in){
+    return (uint32_t{in[0]} << 24) | (uint32_t{in[1]} << 16) | (uint32_t{in[2]} << 8) | uint32_t{in[3]};
+}
+} // namespace
+
+IDXDataset::IDXDataset(std::filesystem::path const& images, std::filesystem::path const& labels)
+    : images_{images}, labels_{labels}{
+    // Confirm that the mapped files are well-formed MNIST data sets
+    if(images_.size() < IMAGES_HEADER || read_be(images_.data()) != 2051){
+        throw std::runtime_error{"Images file appears to be malformed"};
+    }
+    count_ = read_be(images_.data() + 4);
+
+    if(labels_.size() < LABELS_HEADER || read_be(labels_.data()) != 2049){
+        throw std::runtime_error{"Labels file appears to be malformed"};
+    }
+
+    if(read_be(labels_.data() + 4) != count_){
+        throw std::runtime_error(
+            "Label count did not match the number of images supplied");
+    }
+
+    // Readers cycle through the samples modulo the count
+    if(count_ == 0){
+        throw std::runtime_error{"The dataset contains no samples"};
+    }
+
+    rows_ = read_be(images_.data() + 8);
+    columns_ = read_be(images_.data() + 12);
+    if(rows_ != 28 || columns_ != 28){
+        throw std::runtime_error{
+            "Expected 28x28 images, non-MNIST data supplied"};
+    }
+
+    // Samples are accessed without bounds checks, so the files must hold every advertised sample
+    if(images_.size() < IMAGES_HEADER + count_ * image_size()
+        || labels_.size() < LABELS_HEADER + count_){
+        throw std::runtime_error{"Dataset files are truncated"};
+    }
+
+    uint8_t const* first_label = labels_.data() + LABELS_HEADER;
+    if(std::any_of(first_label, first_label + count_, [](uint8_t l){ return l >= CLASSES; })){
+        throw std::runtime_error{"Labels file contains an out of range label"};
+    }
+}
+
+void IDXDataset::gather(size_t const* indices, size_t count, float* data, float* labels, uint8_t* label_index) const{
+    size_t dim = image_size();
+    float inv = float{1.0} / float{255.0};
+
+    for(size_t row = 0; row != count; row++){
+        size_t i = indices[row];
+
+        // Normalization happens here, directly from the mapped pages into the batch
+        if(data != nullptr){
+            uint8_t const* pixels = image(i);
+            float* out = data + row * dim;
+            for(size_t j = 0; j != dim; j++){
+                out[j] = pixels[j] * inv;
+            }
+        }
+
+        uint8_t l = label(i);
+        if(labels != nullptr){
+            float* one_hot = labels + row * CLASSES;
+            std::fill(one_hot, one_hot + CLASSES, float{0.0});
+            one_hot[l] = float{1.0};
+        }
+        if(label_index != nullptr){
+            label_index[row] = l;
+        }
+    }
+}
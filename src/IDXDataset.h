@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Aligned.h"
+#include "MappedFile.h"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+// A labeled dataset of 8-bit images in the IDX format used by MNIST. The image and label files
+// are memory mapped once and samples are read in place, so the OS page cache holds the only copy
+// of the dataset and accessing a sample costs neither a syscall nor a copy.
+class IDXDataset{
+public:
+    constexpr static size_t CLASSES = 10;
+
+    IDXDataset(std::filesystem::path const& images, std::filesystem::path const& labels);
+
+    size_t size() const noexcept{
+        return count_;
+    }
+
+    // Number of pixels of each image
+    size_t image_size() const noexcept{
+        return rows_ * columns_;
+    }
+
+    size_t rows() const noexcept{
+        return rows_;
+    }
+
+    size_t columns() const noexcept{
+        return columns_;
+    }
+
+    // The image_size() pixels of sample i as a row-major raster
+    uint8_t const* image(size_t i) const noexcept{
+        return images_.data() + IMAGES_HEADER + i * image_size();
+    }
+
+    uint8_t label(size_t i) const noexcept{
+        return labels_.data()[LABELS_HEADER + i];
+    }
+
+    // Assemble the samples at the given indices into a batch: a [count x image_size()] matrix
+    // of pixels normalized to [0, 1], a [count x CLASSES] matrix of one-hot encoded labels and
+    // the index of the hot class of every sample. Any of the outputs may be null.
+    void gather(size_t const* indices, size_t count, float* data, float* labels, uint8_t* label_index) const;
+
+private:
+    constexpr static size_t IMAGES_HEADER = 16;
+    constexpr static size_t LABELS_HEADER = 8;
+
+    MappedFile images_;
+    MappedFile labels_;
+    size_t count_;
+    size_t rows_;
+    size_t columns_;
+};
+
+// Buffers of a batch of up to batch_size samples: the indices of its samples and the outputs of
+// IDXDataset::gather. A thread that assembles batches of its own owns one
+struct BatchBuffers{
+    BatchBuffers(size_t batch_size, size_t image_size)
+        : indices(batch_size), data(batch_size * image_size), labels(batch_size * IDXDataset::CLASSES),
+          label_index(batch_size){}
+
+    std::vector<size_t> indices;
+    aligned_vector<float> data;
+    aligned_vector<float> labels;
+    std::vector<uint8_t> label_index;
+};
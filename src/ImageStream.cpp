@@ -0,0 +1,156 @@
+#include "ImageStream.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace{
+
+constexpr uint8_t IDX_IMAGES_MAGIC[4] = {0x00, 0x00, 0x08, 0x03};
+
+uint32_t big_endian(uint8_t const* bytes){
+    return static_cast<uint32_t>(bytes[0]) << 24 | static_cast<uint32_t>(bytes[1]) << 16
+        | static_cast<uint32_t>(bytes[2]) << 8 | static_cast<uint32_t>(bytes[3]);
+}
+
+} // namespace
+
+ImageStream::ImageStream(int fd, Format format, size_t image_size, size_t chunk_images)
+    : fd_{fd}, image_size_{image_size}, chunk_images_{chunk_images}, remaining_{std::numeric_limits<size_t>::max()}{
+    if(image_size_ == 0 || chunk_images_ == 0){
+        throw std::runtime_error{"ImageStream requires a non-zero image size and chunk size"};
+    }
+
+    if(format != Format::Raw){
+        uint8_t magic[4];
+        size_t bytes = read_fully(magic, sizeof(magic));
+        idx_ = bytes == sizeof(magic) && std::equal(magic, magic + 4, IDX_IMAGES_MAGIC);
+        if(format == Format::IDX && !idx_){
+            throw std::runtime_error{"The stream is not an IDX image file"};
+        }
+        if(!idx_){
+            prefix_.assign(magic, magic + bytes);
+        }
+    }
+    if(idx_){
+        uint8_t header[12];
+        if(read_fully(header, sizeof(header)) != sizeof(header)){
+            throw std::runtime_error{"Truncated IDX header"};
+        }
+        remaining_ = big_endian(header);
+        size_t pixels = static_cast<size_t>(big_endian(header + 4)) * big_endian(header + 8);
+        if(pixels != image_size_){
+            throw std::runtime_error{"Expected images of " + std::to_string(image_size_) + " pixels, the stream has "
+                                     + std::to_string(pixels)};
+        }
+    }
+
+    for(Buffer& buffer : buffers_){
+        buffer.pixels.resize(chunk_images_ * image_size_);
+    }
+    reader_ = std::thread{&ImageStream::read, this};
+}
+
+ImageStream::~ImageStream(){
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stop_ = true;
+    }
+    released_.notify_all();
+    reader_.join();
+}
+
+ImageChunk ImageStream::next(){
+    std::unique_lock<std::mutex> lock{mutex_};
+
+    // The previously returned chunk is no longer referenced by the consumer
+    if(consuming_ != nullptr){
+        consuming_->ready = false;
+        consuming_ = nullptr;
+        consume_ ^= 1;
+        released_.notify_all();
+    }
+
+    Buffer& buffer = buffers_[consume_];
+    filled_.wait(lock, [&]{ return buffer.ready || error_ != nullptr; });
+    if(!buffer.ready){
+        std::rethrow_exception(error_);
+    }
+    consuming_ = &buffer;
+    return {buffer.pixels.data(), buffer.count};
+}
+
+void ImageStream::read(){
+    try{
+        for(size_t fill = 0;; fill ^= 1){
+            Buffer& buffer = buffers_[fill];
+            {
+                std::unique_lock<std::mutex> lock{mutex_};
+                released_.wait(lock, [&]{ return stop_ || !buffer.ready; });
+                if(stop_){
+                    return;
+                }
+            }
+
+            // The consumer does not touch a buffer that is not ready
+            size_t images = std::min(chunk_images_, remaining_);
+            size_t bytes = std::min(prefix_.size(), images * image_size_);
+            std::copy(prefix_.begin(), prefix_.begin() + static_cast<ptrdiff_t>(bytes), buffer.pixels.begin());
+            prefix_.clear();
+            bytes += read_fully(buffer.pixels.data() + bytes, images * image_size_ - bytes);
+            size_t count = bytes / image_size_;
+            std::string error;
+            if(bytes % image_size_ != 0){
+                error = "The stream ends within an image";
+            }else if(count < images && idx_){
+                error = "The stream ends before the " + std::to_string(remaining_ - count)
+                    + " images left of its IDX header";
+            }
+            remaining_ -= count;
+
+            // The complete images of a truncated stream are delivered before the error
+            if(count != 0 || error.empty()){
+                {
+                    std::lock_guard<std::mutex> lock{mutex_};
+                    buffer.count = count;
+                    buffer.ready = true;
+                }
+                filled_.notify_all();
+            }
+            if(!error.empty()){
+                throw std::runtime_error{error};
+            }
+            // An empty chunk marks the end
+            if(count == 0){
+                return;
+            }
+        }
+    }catch(...){
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            error_ = std::current_exception();
+        }
+        filled_.notify_all();
+    }
+}
+
+size_t ImageStream::read_fully(uint8_t* data, size_t bytes){
+    size_t total = 0;
+    while(total != bytes){
+        ssize_t count = ::read(fd_, data + total, bytes - total);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count < 0){
+            throw std::runtime_error{std::string{"Cannot read the image stream: "} + strerror(errno)};
+        }
+        if(count == 0){
+            break;
+        }
+        total += static_cast<size_t>(count);
+    }
+    return total;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A block of consecutive images of a stream
+struct ImageChunk{
+    // [count x image size] 8-bit pixels, row-major
+    uint8_t const* pixels;
+    size_t count;
+};
+
+// Unlabeled 8-bit images read from a file descriptor that need not be seekable, such as a pipe
+// on stdin. The stream is either an IDX image file (the format of the MNIST image files) or a
+// sequence of raw records of image_size bytes. A reader thread fills one of two chunk buffers
+// with large reads while the consumer works on the other, so reading overlaps with compute and
+// memory stays at two chunks however long the stream is.
+class ImageStream{
+public:
+    enum class Format{
+        // IDX if the stream starts with the magic number of an IDX image file, raw otherwise
+        Auto,
+        IDX,
+        Raw
+    };
+
+    // Reads the IDX header, if any, before returning. Throws if the images of an IDX stream are
+    // not of image_size pixels. The descriptor must outlive the stream
+    ImageStream(int fd, Format format, size_t image_size, size_t chunk_images);
+    ~ImageStream();
+
+    ImageStream(ImageStream const&) = delete;
+    ImageStream& operator=(ImageStream const&) = delete;
+
+    // Blocks until the next chunk of up to chunk_images images has been read. The chunk stays
+    // valid until the next call; an empty chunk marks the end of the stream. Rethrows read errors
+    // and throws if the stream ends within an image or before the count of its IDX header, after
+    // returning the complete images read before that point
+    ImageChunk next();
+
+    bool idx() const noexcept{
+        return idx_;
+    }
+
+private:
+    struct Buffer{
+        std::vector<uint8_t> pixels;
+        size_t count = 0;
+        // Filled and not yet released by the consumer
+        bool ready = false;
+    };
+
+    void read();
+    // Reads up to bytes bytes, fewer only at the end of the stream
+    size_t read_fully(uint8_t* data, size_t bytes);
+
+    int fd_;
+    size_t image_size_;
+    size_t chunk_images_;
+    bool idx_ = false;
+    // Images left to read: the count of an IDX header, unbounded for raw records
+    size_t remaining_;
+    // Bytes read while detecting the format that belong to the first image
+    std::vector<uint8_t> prefix_;
+
+    std::mutex mutex_;
+    std::condition_variable filled_;
+    std::condition_variable released_;
+    Buffer buffers_[2];
+    // Buffer handed out by the last call to next, if any
+    Buffer* consuming_ = nullptr;
+    size_t consume_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::thread reader_;
+};
@@ -0,0 +1,349 @@
+#include "InferenceServer.h"
+#include "Aligned.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace{
+
+using Clock = std::chrono::steady_clock;
+
+constexpr double BUCKET_WIDTH = 1.02;
+
+// Reads exactly bytes bytes unless the peer closes the connection or fails first
+bool read_exactly(int fd, void* data, size_t bytes){
+    auto* position = static_cast<char*>(data);
+    while(bytes != 0){
+        ssize_t count = ::read(fd, position, bytes);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return false;
+        }
+        position += count;
+        bytes -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+bool write_all(int fd, void const* data, size_t bytes){
+    auto const* position = static_cast<char const*>(data);
+    while(bytes != 0){
+        ssize_t count = ::send(fd, position, bytes, MSG_NOSIGNAL);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return false;
+        }
+        position += count;
+        bytes -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+} // namespace
+
+void serving::predict(float const* logits, size_t count, Prediction* predictions){
+    for(size_t b = 0; b != count; b++){
+        float const* z = logits + b * CLASSES;
+        Prediction& prediction = predictions[b];
+        prediction.label = static_cast<uint32_t>(max_element(z, z + CLASSES) - z);
+        float max_z = z[prediction.label];
+        float sum{0.0};
+        for(size_t k = 0; k != CLASSES; k++){
+            prediction.probabilities[k] = exp(z[k] - max_z);
+            sum += prediction.probabilities[k];
+        }
+        for(float& probability : prediction.probabilities){
+            probability /= sum;
+        }
+    }
+}
+
+void InferenceServer::Latencies::add(double microseconds){
+    double scaled = std::log(std::max(microseconds, 1.0)) / std::log(BUCKET_WIDTH);
+    counts[std::min(static_cast<size_t>(scaled), BUCKETS - 1)]++;
+    requests++;
+}
+
+double InferenceServer::Latencies::percentile(double p) const{
+    // The upper bound of the bucket holding the p-th percentile
+    size_t rank = static_cast<size_t>(std::ceil(p * static_cast<double>(requests)));
+    size_t seen = 0;
+    for(size_t bucket = 0; bucket != BUCKETS; bucket++){
+        seen += counts[bucket];
+        if(seen >= std::max<size_t>(rank, 1)){
+            return std::pow(BUCKET_WIDTH, static_cast<double>(bucket + 1));
+        }
+    }
+    return 0.0;
+}
+
+InferenceServer::Connection::~Connection(){
+    ::close(fd);
+}
+
+InferenceServer::InferenceServer(Model& model, Node& logits, std::string socket_path, ServerOptions const& options)
+    : model_{model}, logits_{logits}, socket_path_{std::move(socket_path)}, options_{options}{
+    if(options_.max_batch == 0 || options_.max_pending == 0){
+        throw runtime_error{"The server needs a non-zero batch size and number of pending requests"};
+    }
+    if(logits_.output_size() != serving::CLASSES){
+        throw runtime_error{"The served model must predict " + to_string(serving::CLASSES) + " classes"};
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(socket_path_.size() >= sizeof(address.sun_path)){
+        throw runtime_error{"Socket path too long: " + socket_path_};
+    }
+    strcpy(address.sun_path, socket_path_.c_str());
+
+    listener_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener_ < 0){
+        throw runtime_error{string{"Cannot create a socket: "} + strerror(errno)};
+    }
+    ::unlink(socket_path_.c_str());
+    if(::bind(listener_, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0
+       || ::listen(listener_, SOMAXCONN) != 0){
+        int error = errno;
+        ::close(listener_);
+        throw runtime_error{"Cannot listen on " + socket_path_ + ": " + strerror(error)};
+    }
+
+    batcher_ = std::thread{[this]{ batch_requests(); }};
+}
+
+InferenceServer::~InferenceServer(){
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stopping_ = true;
+    }
+    arrived_.notify_all();
+    batcher_.join();
+
+    // Wake the readers and writers waiting for each other or blocked on their connections
+    for(Client& client : clients_){
+        Connection& connection = *client.connection;
+        {
+            std::lock_guard<std::mutex> lock{connection.mutex};
+            connection.open = false;
+        }
+        connection.changed.notify_all();
+        ::shutdown(connection.fd, SHUT_RDWR);
+        client.reader.join();
+        client.writer.join();
+    }
+    clients_.clear();
+    ::close(listener_);
+    ::unlink(socket_path_.c_str());
+}
+
+void InferenceServer::run(std::atomic<bool> const& stop){
+    printf("Serving on %s (batches of up to %zu, waiting up to %lld us)\n", socket_path_.c_str(),
+           options_.max_batch, static_cast<long long>(options_.max_delay.count()));
+    fflush(stdout);
+
+    pollfd listener{listener_, POLLIN, 0};
+    while(!stop.load()){
+        // The timeout bounds how long a stop request, or the threads of a client that left, go
+        // unnoticed
+        int ready = ::poll(&listener, 1, 100);
+        reap_clients();
+        if(ready <= 0 || (listener.revents & POLLIN) == 0){
+            continue;
+        }
+        int fd = ::accept(listener_, nullptr, nullptr);
+        if(fd < 0){
+            continue;
+        }
+
+        auto connection = std::make_shared<Connection>();
+        connection->fd = fd;
+        clients_.push_back({std::thread{[this, connection]{ read_requests(connection); }},
+                            std::thread{[this, connection]{ write_replies(connection); }}, connection});
+    }
+}
+
+void InferenceServer::reap_clients(){
+    // Join the threads of the clients that left
+    auto done = partition(clients_.begin(), clients_.end(), [](Client const& client){
+        return client.connection->finished.load() != 2;
+    });
+    for(auto client = done; client != clients_.end(); ++client){
+        client->reader.join();
+        client->writer.join();
+    }
+    clients_.erase(done, clients_.end());
+}
+
+void InferenceServer::read_requests(std::shared_ptr<Connection> connection){
+    Request request;
+    request.connection = connection;
+    while(true){
+        {
+            // Backpressure: with max_pending requests unanswered the client is not read
+            std::unique_lock<std::mutex> lock{connection->mutex};
+            connection->changed.wait(lock, [&]{
+                return !connection->open || connection->pending < options_.max_pending;
+            });
+            if(!connection->open){
+                break;
+            }
+        }
+        if(!read_exactly(connection->fd, request.pixels, sizeof(request.pixels))){
+            break;
+        }
+        request.arrival = Clock::now();
+        {
+            std::lock_guard<std::mutex> lock{connection->mutex};
+            connection->pending++;
+        }
+
+        bool notify;
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            queue_.push_back(request);
+            // The batcher waits for either the first request or a full batch
+            notify = queue_.size() == 1 || queue_.size() == options_.max_batch;
+        }
+        if(notify){
+            arrived_.notify_one();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{connection->mutex};
+        connection->reading_done = true;
+    }
+    connection->changed.notify_all();
+    connection->finished++;
+}
+
+void InferenceServer::write_replies(std::shared_ptr<Connection> connection){
+    vector<serving::Prediction> replies;
+    while(true){
+        {
+            // Done once every request read has been answered
+            std::unique_lock<std::mutex> lock{connection->mutex};
+            connection->changed.wait(lock, [&]{
+                return !connection->open || !connection->replies.empty()
+                    || (connection->reading_done && connection->pending == 0);
+            });
+            if(!connection->open || connection->replies.empty()){
+                break;
+            }
+            replies.swap(connection->replies);
+        }
+
+        // All answers that are ready go out in one write; only this thread blocks if the client
+        // does not read them
+        bool written = write_all(connection->fd, replies.data(), replies.size() * sizeof(serving::Prediction));
+        {
+            std::lock_guard<std::mutex> lock{connection->mutex};
+            connection->pending -= replies.size();
+            if(!written){
+                connection->open = false;
+            }
+        }
+        connection->changed.notify_all();
+        replies.clear();
+        if(!written){
+            break;
+        }
+    }
+    // The client sees the end of its answers, and a reader still blocked on the connection wakes
+    // up. The descriptor itself is closed once the batcher holds no more requests of it
+    ::shutdown(connection->fd, SHUT_RDWR);
+    connection->finished++;
+}
+
+void InferenceServer::batch_requests(){
+    size_t max_batch = options_.max_batch;
+    aligned_vector<float> inputs(max_batch * serving::REQUEST_BYTES);
+    vector<Request> batch;
+    batch.reserve(max_batch);
+    vector<serving::Prediction> predictions(max_batch);
+
+    Latencies total;
+    Latencies interval;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock{mutex_};
+            // Wake up for reports even when idle
+            arrived_.wait_for(lock, options_.report_interval, [this]{ return stopping_ || !queue_.empty(); });
+            if(stopping_){
+                break;
+            }
+            if(!queue_.empty()){
+                // Wait for the batch to fill up, at most until the oldest request is due
+                Clock::time_point due = queue_.front().arrival + options_.max_delay;
+                arrived_.wait_until(lock, due, [&]{ return stopping_ || queue_.size() >= max_batch; });
+                size_t size = min(queue_.size(), max_batch);
+                move(queue_.begin(), queue_.begin() + static_cast<ptrdiff_t>(size), back_inserter(batch));
+                queue_.erase(queue_.begin(), queue_.begin() + static_cast<ptrdiff_t>(size));
+            }
+        }
+
+        if(!batch.empty()){
+            size_t size = batch.size();
+            for(size_t b = 0; b != size; b++){
+                float* input = inputs.data() + b * serving::REQUEST_BYTES;
+                for(size_t i = 0; i != serving::REQUEST_BYTES; i++){
+                    input[i] = static_cast<float>(batch[b].pixels[i]) * (float{1.0} / float{255.0});
+                }
+            }
+            model_.forward(inputs.data(), size);
+
+            serving::predict(logits_.output(), size, predictions.data());
+
+            for(size_t b = 0; b != size; b++){
+                Connection& connection = *batch[b].connection;
+                {
+                    std::lock_guard<std::mutex> lock{connection.mutex};
+                    connection.replies.push_back(predictions[b]);
+                }
+                connection.changed.notify_all();
+                double latency = std::chrono::duration<double, std::micro>(Clock::now() - batch[b].arrival).count();
+                total.add(latency);
+                interval.add(latency);
+            }
+            if(total.requests == size){
+                // Throughput counts from the first request
+                total.start = batch.front().arrival;
+            }
+            total.batches++;
+            interval.batches++;
+            batch.clear();
+        }
+
+        if(Clock::now() - interval.start >= options_.report_interval){
+            if(interval.requests != 0){
+                report("Last interval", interval);
+            }
+            interval = Latencies{};
+        }
+    }
+
+    if(total.requests != 0){
+        report("Total", total);
+    }
+}
+
+void InferenceServer::report(char const* what, Latencies const& latencies) const{
+    double seconds = std::chrono::duration<double>(Clock::now() - latencies.start).count();
+    printf("%s: %zu requests in %.1f s, %.0f requests/s, %.1f per batch, latency p50 %.3f ms p99 %.3f ms\n",
+           what, latencies.requests, seconds, static_cast<double>(latencies.requests) / seconds,
+           static_cast<double>(latencies.requests) / static_cast<double>(latencies.batches),
+           latencies.percentile(0.5) * 1e-3, latencies.percentile(0.99) * 1e-3);
+    fflush(stdout);
+}
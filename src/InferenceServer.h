@@ -0,0 +1,137 @@
+#pragma once
+
+#include "Model.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Wire format of `nn serve` over a Unix domain stream socket. A client sends any number of
+// requests, each the REQUEST_BYTES pixels of one 28 x 28 image (row-major, 8 bits, as stored
+// in the IDX files), and receives one Prediction per request, in the order of its requests. Both
+// sides run on the same host, so the fields are in host byte order.
+namespace serving{
+
+constexpr size_t REQUEST_BYTES = 28 * 28;
+constexpr size_t CLASSES = 10;
+
+struct Prediction{
+    uint32_t label;
+    float probabilities[CLASSES];
+};
+
+static_assert(sizeof(Prediction) == 44, "The response layout must not depend on padding");
+
+// The class and the softmax probabilities of each row of the [count x CLASSES] logits
+void predict(float const* logits, size_t count, Prediction* predictions);
+
+} // namespace serving
+
+struct ServerOptions{
+    // Most requests run as one batch
+    size_t max_batch{64};
+    // Longest a request waits for others to fill its batch
+    std::chrono::microseconds max_delay{1000};
+    // Most requests of one connection read but not yet answered. Beyond that the connection is
+    // not read until answers have been written, so a client that sends without reading is held
+    // back by its socket buffers instead of filling the server's memory
+    size_t max_pending{256};
+    // Interval of the latency and throughput reports
+    std::chrono::milliseconds report_interval{5000};
+};
+
+// Inference server with dynamic batching. Every connection has a thread reading its requests
+// into one queue and a thread writing its answers. A single batching thread takes the queue in
+// batches of up to max_batch requests, as soon as that many have arrived or the oldest has waited
+// max_delay, runs each batch through the model's batched forward pass and hands the predictions
+// to the writers of their connections, so a client that is slow to read its answers delays no
+// other. Under light load requests are answered after at most max_delay; under heavy load the
+// batches fill up and the cost of a pass is shared by many requests. Latencies (from a request's
+// arrival to its answer being handed to the writer) and throughput are reported every
+// report_interval and on shutdown.
+class InferenceServer{
+public:
+    // The model must be in inference mode and take [batch x REQUEST_BYTES] normalized images;
+    // logits is the node whose output holds the [batch x CLASSES] logits of a forward pass. The
+    // socket file is replaced if it exists and removed on destruction
+    InferenceServer(Model& model, Node& logits, std::string socket_path, ServerOptions const& options);
+    ~InferenceServer();
+
+    InferenceServer(InferenceServer const&) = delete;
+    InferenceServer& operator=(InferenceServer const&) = delete;
+
+    // Accept connections and serve them until stop is set
+    void run(std::atomic<bool> const& stop);
+
+private:
+    // A client connection. Its writer shuts it down when the last request read from it has been
+    // answered (or it cannot be written to), and the descriptor is closed with the last reference
+    struct Connection{
+        int fd;
+        // Guards the fields below; changed is notified whenever one of them changes
+        std::mutex mutex;
+        std::condition_variable changed;
+        // Cleared when the client cannot be written to or the server stops
+        bool open{true};
+        // Set when the reader has seen the end of the requests
+        bool reading_done{false};
+        // Requests read but not written back yet, at most max_pending
+        size_t pending{0};
+        // Answers handed over by the batcher, in the order of the requests
+        vector<serving::Prediction> replies;
+        // Reader and writer threads that have returned
+        std::atomic<size_t> finished{0};
+
+        ~Connection();
+    };
+
+    struct Client{
+        std::thread reader;
+        std::thread writer;
+        std::shared_ptr<Connection> connection;
+    };
+
+    struct Request{
+        std::shared_ptr<Connection> connection;
+        uint8_t pixels[serving::REQUEST_BYTES];
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    // Latencies counted in buckets 2% wide, so that percentiles over any number of requests are
+    // accurate to 2% in constant memory
+    struct Latencies{
+        static constexpr size_t BUCKETS = 1024;
+        vector<size_t> counts = vector<size_t>(BUCKETS);
+        size_t requests{0};
+        size_t batches{0};
+        std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+
+        void add(double microseconds);
+        double percentile(double p) const;
+    };
+
+    void reap_clients();
+    void read_requests(std::shared_ptr<Connection> connection);
+    void write_replies(std::shared_ptr<Connection> connection);
+    void batch_requests();
+    void report(char const* what, Latencies const& latencies) const;
+
+    Model& model_;
+    Node& logits_;
+    std::string socket_path_;
+    ServerOptions options_;
+    int listener_{-1};
+
+    std::mutex mutex_;
+    std::condition_variable arrived_;
+    std::deque<Request> queue_;
+    bool stopping_{false};
+
+    // Only touched by the thread in run()
+    vector<Client> clients_;
+
+    std::thread batcher_;
+};
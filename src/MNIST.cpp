@@ -1,77 +1,44 @@
 #include "MNIST.h"
-#include <fstream>
+#include <algorithm>
 #include <cstdio>
 #include <stdexcept>
-#include <iostream>
-// Read 4 bytes and reverse them to return an unsigned integer on LE
-// architectures
-void read_be(std::ifstream& in, uint32_t* out)
-{
-    char* buf = reinterpret_cast<char*>(out);
-    in.read(buf, 4);
-
-    std::swap(buf[0], buf[3]);
-    std::swap(buf[1], buf[2]);
-}
 
-MNIST::MNIST(Model& model, std::ifstream& images, std::ifstream& labels) : Node{model, "MNIST input"}, images_{images}, labels_{labels}
+MNIST::MNIST(Model& model, IDXDataset const& dataset, size_t batch_size) : MNIST{model, batch_size}
 {
-    // Confirm that passed input file streams are well-formed MNIST data sets
-    uint32_t image_magic;
-    read_be(images, &image_magic);
-    if (image_magic != 2051)
-    {
-        throw std::runtime_error{"Images file appears to be malformed"};
-    }
-    read_be(images, &image_count_);
-
-    uint32_t labels_magic;
-    read_be(labels, &labels_magic);
-    if (labels_magic != 2049)
-    {
-        throw std::runtime_error{"Images file appears to be malformed"};
-    }
-
-    uint32_t label_count;
-    read_be(labels, &label_count);
-    if (label_count != image_count_)
-    {
-        throw std::runtime_error(
-            "Label count did not match the number of images supplied");
-    }
-
-    uint32_t rows;
-    uint32_t columns;
-    read_be(images, &rows);
-    read_be(images, &columns);
-    if (rows != 28 || columns != 28)
+    dataset_ = &dataset;
+    if (dataset_->image_size() != DIM)
     {
         throw std::runtime_error{
             "Expected 28x28 images, non-MNIST data supplied"};
     }
+}
 
-    printf("Loaded images file with %d entriesn", image_count_);
+MNIST::MNIST(Model& model, size_t batch_size) : Node{model, "MNIST input"}, dataset_{nullptr}, batch_size_{batch_size}
+{
+    data_.resize(batch_size_ * DIM);
+    label_.resize(batch_size_ * 10);
+    label_index_.resize(batch_size_);
+    indices_.resize(batch_size_);
 }
 
-void MNIST::read_next(){
-    images_.read(buf_, DIM);
-    float inv = float{1.0} / float{255.0};
-    for(size_t i = 0; i != DIM; i++){
-        data_[i] = static_cast<uint8_t>(buf_[i]) * inv;
+void MNIST::read_next(size_t row){
+    if(dataset_ == nullptr){
+        throw std::runtime_error{"The MNIST input node has no dataset to read from"};
     }
+    indices_[row] = cursor_;
+    cursor_ = (cursor_ + 1) % dataset_->size();
 
-    char label;
-    labels_.read(&label, 1);
+    dataset_->gather(&indices_[row], 1, data_.data() + row * DIM, label_.data() + row * 10, label_index_.data() + row);
 
-    for(size_t i = 0; i != 10; i++){
-        label_[i] = float{0.0};
-    }
-    label_[static_cast<uint8_t>(label)] = float{1.0};
+    last_ = row;
 }
 
 void MNIST::print_last(){
+    float const* data = data_.data() + last_ * DIM;
+    float const* label = label_.data() + last_ * 10;
+
     for(size_t i = 0; i != 10; i++){
-        if(label_[i] == float{1.0}){
+        if(label[i] == float{1.0}){
             printf("This is a %zu:n", i);
             break;
         }
@@ -80,10 +47,10 @@ void MNIST::print_last(){
     for(size_t i = 0; i != 28; i++){
         size_t offset = i * 28;
         for(size_t j = 0; j != 28; j++){
-            if(data_[offset + j] > float{0.5}){
-                if(data_[offset + j] > float{0.9}){
+            if(data[offset + j] > float{0.5}){
+                if(data[offset + j] > float{0.9}){
                     printf("#");
-                }else if(data_[offset + j] > float{0.7}){
+                }else if(data[offset + j] > float{0.7}){
                     printf("*");
                 }else{
                     printf(".");
@@ -97,11 +64,44 @@ void MNIST::print_last(){
     printf("\n");
 }
 
-void MNIST::forward(float* data){
-    read_next();
-    for(Node* node : subsequents_){
-        node->forward(data_);
+void MNIST::forward(float* data, size_t batch){
+    if(pixels_.data != nullptr){
+        bool floats = subsequents_.empty();
+        for(Node* node : subsequents_){
+            floats = floats || !node->quantized();
+        }
+        output_ = nullptr;
+        if(floats){
+            data_.resize(max(data_.size(), batch * DIM));
+            for(size_t i = 0; i != batch * DIM; i++){
+                data_[i] = pixels_.scale * static_cast<float>(pixels_.data[i] - pixels_.zero_point);
+            }
+            output_ = data_.data();
+        }
+        return;
+    }
+
+    if(data != nullptr){
+        output_ = data;
+        return;
+    }
+
+    if(batch > batch_size_){
+        throw std::runtime_error{"Batch exceeds the batch size of the MNIST input node"};
+    }
+    if(dataset_ == nullptr){
+        throw std::runtime_error{"The MNIST input node has no dataset to read from"};
+    }
+
+    for(size_t row = 0; row != batch; row++){
+        indices_[row] = cursor_;
+        cursor_ = (cursor_ + 1) % dataset_->size();
+    }
+    dataset_->gather(indices_.data(), batch, data_.data(), label_.data(), label_index_.data());
+    if(batch != 0){
+        last_ = batch - 1;
     }
+    output_ = data_.data();
 }
 
 void MNIST::print() const{
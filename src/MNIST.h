@@ -1,53 +1,97 @@
 #pragma once
 
+#include "IDXDataset.h"
 #include "Model.h"
-#include <fstream>
 
 class MNIST : public Node
 {
 public:
     constexpr static size_t DIM = 28 * 28;
 
-    MNIST(Model& model, std::ifstream& images, std::ifstream& labels);
+    // Up to batch_size samples are read for each forward pass. Samples are read in order
+    // from the dataset, wrapping around at its end. The dataset must outlive the node.
+    MNIST(Model& model, IDXDataset const& dataset, size_t batch_size = 1);
+
+    // An input node without a dataset, for models that are only fed batches assembled elsewhere
+    // (e.g. images received by a server). Its size() is zero and it has no batch of its own
+    MNIST(Model& model, size_t batch_size = 1);
 
     void init(mt19937&) override
     {}
 
-    // As this is an input node, the argument to this function is ignored
-    void forward(float* data = nullptr) override;
+    // As this is an input node, a null data argument reads the next batch samples from the
+    // dataset and forwards them as a [batch x DIM] matrix. A non-null data argument is a batch
+    // already assembled elsewhere (e.g. by a Prefetcher) and is forwarded as is; the loss
+    // target must then be pointed at that batch's labels.
+    void forward(float* data, size_t batch) override;
     // Backpropagation is a no-op for input nodes as there are no parameters to
     // update
     void reverse(float* data = nullptr) override
     {}
 
-    // Parse the next image and label into memory
-    void read_next();
+    size_t output_size() const noexcept override
+    {
+        return DIM;
+    }
+
+    float* output() override
+    {
+        return output_;
+    }
+
+    // Raw 8-bit pixels (e.g. a range of the mapped dataset) fed to the node are handed to
+    // quantized subsequents in place. They are only converted to floats if another subsequent
+    // reads them
+    bool feed_quantized(QuantizedView input) override
+    {
+        pixels_ = input;
+        return true;
+    }
+
+    QuantizedView quantized_output() const override
+    {
+        return pixels_;
+    }
+
+    // Gather the next image and label into memory at the given row of the batch
+    void read_next(size_t row = 0);
 
     void print() const override;
 
     [[nodiscard]] size_t size() const noexcept
     {
-        return image_count_;
+        return dataset_ == nullptr ? 0 : dataset_->size();
+    }
+
+    [[nodiscard]] size_t batch_size() const noexcept
+    {
+        return batch_size_;
     }
 
     [[nodiscard]] float const* data() const noexcept
     {
-        return data_;
+        return data_.data();
     }
 
     [[nodiscard]] float* data() noexcept
     {
-        return data_;
+        return data_.data();
     }
 
     [[nodiscard]] float* label() noexcept
     {
-        return label_;
+        return label_.data();
     }
 
     [[nodiscard]] float const* label() const noexcept
     {
-        return label_;
+        return label_.data();
+    }
+
+    // Index of the hot class of each row of label()
+    [[nodiscard]] uint8_t const* label_index() const noexcept
+    {
+        return label_index_.data();
     }
 
     // Quick ASCII visualization of the last read image. For best results,
@@ -55,14 +99,24 @@ public:
     void print_last();
 
 private:
-    std::ifstream& images_;
-    std::ifstream& labels_;
-    uint32_t image_count_;
-    // Data from the images file is read as one-byte unsigned values which are
-    // converted to num_t after
-    char buf_[DIM];
-    // All images are resized (with antialiasing) to a 28 x 28 row-major raster
-    float data_[DIM];
-    // One-hot encoded label
-    float label_[10];
+    // Null if the node is only fed
+    IDXDataset const* dataset_;
+    size_t batch_size_;
+    // Index of the next sample to read
+    size_t cursor_{0};
+    // Row of the batch that was read last
+    size_t last_{0};
+    // Dataset indices of the samples of the current batch
+    vector<size_t> indices_;
+    // All images are resized (with antialiasing) to a 28 x 28 row-major raster,
+    // one image per row of the [batch_size x DIM] matrix
+    vector<float> data_;
+    // One-hot encoded labels, one per row of the [batch_size x 10] matrix. The
+    // storage never moves so the pointer can be handed to the loss node once
+    vector<float> label_;
+    vector<uint8_t> label_index_;
+    // The batch of the last forward pass: data_ or the batch passed in
+    float* output_{nullptr};
+    // 8-bit pixels forwarded instead of the float batch, if not null
+    QuantizedView pixels_;
 };
\ No newline at end of file
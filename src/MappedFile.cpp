@@ -0,0 +1,60 @@
+#include "MappedFile.h"
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+MappedFile::MappedFile(std::filesystem::path const& path, Access access){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0){
+        throw std::runtime_error{"Unable to open " + path.string()};
+    }
+
+    struct stat st;
+    if(::fstat(fd, &st) != 0){
+        ::close(fd);
+        throw std::runtime_error{"Unable to stat " + path.string()};
+    }
+    size_ = static_cast<size_t>(st.st_size);
+
+    // Empty files cannot be mapped; they are left as a null view of size zero
+    if(size_ != 0){
+        void* data = access == Access::CopyOnWrite
+            ? ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+            : ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED){
+            ::close(fd);
+            throw std::runtime_error{"Unable to map " + path.string()};
+        }
+        data_ = static_cast<uint8_t const*>(data);
+
+        // Start reading the file in ahead of the first accesses
+        ::madvise(data, size_, MADV_WILLNEED);
+    }
+
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+}
+
+MappedFile::~MappedFile(){
+    if(data_ != nullptr){
+        ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : data_{std::exchange(other.data_, nullptr)}, size_{std::exchange(other.size_, 0)}{}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept{
+    if(this != &other){
+        if(data_ != nullptr){
+            ::munmap(const_cast<uint8_t*>(data_), size_);
+        }
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// Read-only memory mapping of a whole file. The pages are shared with the OS page cache,
+// so mapping a file costs no copies and reads after the first touch cost no syscalls.
+// A copy-on-write mapping may also be written to: modified pages become private copies and
+// the file itself is never changed.
+class MappedFile{
+public:
+    enum class Access{
+        ReadOnly,
+        CopyOnWrite
+    };
+
+    explicit MappedFile(std::filesystem::path const& path, Access access = Access::ReadOnly);
+    ~MappedFile();
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    uint8_t const* data() const noexcept{
+        return data_;
+    }
+
+    // Only for copy-on-write mappings
+    uint8_t* mutable_data() noexcept{
+        return const_cast<uint8_t*>(data_);
+    }
+
+    size_t size() const noexcept{
+        return size_;
+    }
+
+private:
+    uint8_t const* data_ = nullptr;
+    size_t size_ = 0;
+};
@@ -0,0 +1,50 @@
+#include "MemoryPlanner.h"
+#include "Aligned.h"
+#include <algorithm>
+#include <numeric>
+
+MemoryPlan plan_memory(std::vector<BufferLifetime> const& buffers){
+    MemoryPlan plan;
+    plan.offsets.assign(buffers.size(), 0);
+
+    std::vector<size_t> bytes(buffers.size());
+    for(size_t i = 0; i != buffers.size(); ++i){
+        bytes[i] = (buffers[i].bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        plan.total_bytes += bytes[i];
+    }
+
+    std::vector<size_t> order(buffers.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){ return bytes[a] > bytes[b]; });
+
+    // Buffers placed so far, as (offset, end) ranges
+    std::vector<size_t> placed;
+    std::vector<std::pair<size_t, size_t>> conflicts;
+    for(size_t i : order){
+        if(bytes[i] == 0){
+            continue;
+        }
+
+        conflicts.clear();
+        for(size_t j : placed){
+            if(buffers[j].first <= buffers[i].last && buffers[i].first <= buffers[j].last){
+                conflicts.emplace_back(plan.offsets[j], plan.offsets[j] + bytes[j]);
+            }
+        }
+        std::sort(conflicts.begin(), conflicts.end());
+
+        // Lowest gap between the live buffers that is large enough
+        size_t offset = 0;
+        for(auto [begin, end] : conflicts){
+            if(offset + bytes[i] <= begin){
+                break;
+            }
+            offset = std::max(offset, end);
+        }
+
+        plan.offsets[i] = offset;
+        plan.peak_bytes = std::max(plan.peak_bytes, offset + bytes[i]);
+        placed.push_back(i);
+    }
+    return plan;
+}
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// A buffer to be placed in an arena: it is live from step first to step last (inclusive)
+struct BufferLifetime{
+    size_t first;
+    size_t last;
+    size_t bytes;
+};
+
+struct MemoryPlan{
+    // Byte offset of every buffer in the arena, in the order they were passed in
+    std::vector<size_t> offsets;
+    // Size of the arena
+    size_t peak_bytes{0};
+    // Size the buffers would take without any reuse
+    size_t total_bytes{0};
+};
+
+// Assign arena offsets to the buffers such that buffers whose lifetimes overlap never overlap in
+// memory, while buffers that are never live at the same time may share it. Every buffer starts
+// on a cache line. The buffers are placed greedily from the largest to the smallest, each at the
+// lowest offset where it fits between the buffers already placed that are live at the same time.
+MemoryPlan plan_memory(std::vector<BufferLifetime> const& buffers);
\ No newline at end of file
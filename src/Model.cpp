@@ -1,13 +1,46 @@
 #include "Model.h"
+#include "Checkpoint.h"
+#include "ExecutionPlan.h"
+#include "MappedFile.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
 
 Node::Node(Model& model, string name) : model_{model}, name_{std::move(name)}{}
 
 Model::Model(string name) : name_{std::move(name)}{}
 
+Model::Model(Model&&) noexcept = default;
+Model& Model::operator=(Model&&) noexcept = default;
+Model::~Model() = default;
+
 void Model::create_edge(Node& dst, Node& src){
     // No validation is done to ensure the edge doesn't already exist
     dst.antecedents_.push_back(&src);
     src.subsequents_.push_back(&dst);
+    invalidate_plan();
+}
+
+ExecutionPlan& Model::plan(){
+    if(!plan_){
+        plan_ = make_unique<ExecutionPlan>(nodes_, inference_);
+    }
+    return *plan_;
+}
+
+void Model::invalidate_plan(){
+    plan_.reset();
+}
+
+void Model::forward(float* inputs, size_t batch){
+    plan().forward(inputs, batch);
+}
+
+void Model::reverse(){
+    plan().reverse();
 }
 
 mt19937::result_type Model::init(mt19937::result_type seed)
@@ -22,18 +55,149 @@ mt19937::result_type Model::init(mt19937::result_type seed)
 
     mt19937 rne{seed};
 
+    layout();
     for (auto& node : nodes_)
     {
         node->init(rne);
     }
+    round_parameters();
 
     return seed;
 }
 
+void Model::layout(){
+    if(offsets_.size() == nodes_.size()){
+        return;
+    }
+
+    // Every node starts on a cache line so the kernels can use aligned loads on its parameters
+    constexpr size_t line = CACHE_LINE / sizeof(float);
+    offsets_.clear();
+    size_t offset = 0;
+    for(auto& node : nodes_){
+        offsets_.push_back(offset);
+        offset += (node->param_count() + line - 1) / line * line;
+    }
+    arena_size_ = offset;
+
+    params_.assign(arena_size_, float{0.0});
+    parameters_ = params_.data();
+    if(!inference_){
+        gradients_.assign(arena_size_, float{0.0});
+    }
+    bind();
+}
+
+void Model::bind(){
+    for(size_t i = 0; i != nodes_.size(); i++){
+        float* gradients = gradients_.empty() ? nullptr : gradients_.data() + offsets_[i];
+        nodes_[i]->bind(parameters_ + offsets_[i], gradients);
+        nodes_[i]->bind_bfloat16(parameters16_ == nullptr ? nullptr : parameters16_ + offsets_[i]);
+    }
+}
+
+void Model::round_parameters(){
+    if(parameters16_ != nullptr){
+        to_bfloat16(parameters_, parameters16_, arena_size_);
+    }
+}
+
+void Model::set_precision(Precision precision){
+    layout();
+    precision_ = precision;
+    if(precision == Precision::BFloat16){
+        params16_.resize(arena_size_);
+        parameters16_ = params16_.data();
+        round_parameters();
+    }else{
+        params16_ = {};
+        parameters16_ = nullptr;
+    }
+    bind();
+    // Nodes exchange activations in the new precision
+    invalidate_plan();
+}
+
+void Model::share_parameters(Model& source){
+    source.layout();
+    layout();
+    bool same = source.nodes_.size() == nodes_.size();
+    for(size_t i = 0; same && i != nodes_.size(); i++){
+        same = source.nodes_[i]->param_count() == nodes_[i]->param_count();
+    }
+    if(!same){
+        throw runtime_error{"Cannot share parameters between models of different topology"};
+    }
+    if(source.precision_ != precision_){
+        throw runtime_error{"Cannot share parameters between models of different precision"};
+    }
+
+    parameters_ = source.parameters_;
+    parameters16_ = source.parameters16_;
+    // The private copies are no longer referenced
+    params_ = {};
+    params16_ = {};
+    bind();
+}
+
+void Model::set_inference(bool inference){
+    layout();
+    inference_ = inference;
+    if(inference){
+        gradients_ = {};
+    }else if(gradients_.empty()){
+        gradients_.assign(arena_size_, float{0.0});
+    }
+    bind();
+
+    for(auto& node : nodes_){
+        node->set_inference(inference);
+    }
+    // The next plan lays out the intermediate buffers for this mode
+    invalidate_plan();
+}
+
+void Model::quantize(float* samples, size_t count){
+    if(!inference_){
+        throw runtime_error{"Model " + name_ + " must be in inference mode to be quantized"};
+    }
+    if(precision_ != Precision::Float32){
+        throw runtime_error{"Model " + name_ + " must be in float precision to be quantized"};
+    }
+
+    for(auto& node : nodes_){
+        node->calibrate(true);
+    }
+    forward(samples, count);
+    for(auto& node : nodes_){
+        node->calibrate(false);
+        node->quantize();
+    }
+}
+
+MemoryStats Model::memory(){
+    return plan().memory();
+}
+
+FloatSpan Model::parameters(){
+    layout();
+    return {parameters_, arena_size_};
+}
+
+FloatSpan Model::gradients(){
+    layout();
+    return {gradients_.data(), gradients_.size()};
+}
+
 void Model::train(Optimizer& optimizer){
-    for(auto&& node : nodes_){
-        optimizer.train(*node);
+    layout();
+    if(inference_){
+        throw runtime_error{"Cannot train model " + name_ + " in inference mode"};
     }
+    // One pass over all parameters of the model
+    NN_PROFILE_SCOPE("optimizer", profile::Category::Optimizer);
+    optimizer.train(parameters_, gradients_.data(), arena_size_);
+    round_parameters();
 }
 
 void Model::print() const {
@@ -43,30 +207,239 @@ void Model::print() const {
     }
 }
 
-void Model::save(ofstream& out){
-    // To save the model to disk, we emplay a very simple scheme. All nodes are looped through in the order they
-    // were added to the model. Then, all advertised learnable parameters are serialized in host byte-order to the 
-    // supplied output stream
+void Model::save(filesystem::path const& path){
+    layout();
+    if(precision_ == Precision::BFloat16){
+        write_checkpoint(path, parameters16_, checkpoint::DType::BFloat16, nullptr);
+    }else{
+        write_checkpoint(path, parameters_, checkpoint::DType::Float32, nullptr);
+    }
+}
 
-    // This simplistic method of saving the model to disk isn't very robust or practical in the real world.
-    // For one thing, it contains no reflection data about the topology of the model. Loading the data relies
-    // on the model being constructed in the same mabber in was trained on.
-    // Furthermore, the data will be parsed incorrectly if the program is recompiled to operate with a 
-    // different precision. Adopting a more sibseble serialization scheme is left as an exercise.
+void Model::save(filesystem::path const& path, float const* parameters, TrainingState const& training){
+    // Resuming needs the float master parameters, whatever the precision
+    layout();
+    write_checkpoint(path, parameters, checkpoint::DType::Float32, &training);
+}
 
-    for(auto& node : nodes_){
-        size_t param_count = node->param_count();
-        for(size_t i = 0; i != param_count; i++){
-            out.write(reinterpret_cast<char const*>(node->param(i)), sizeof(float));
+void Model::write_checkpoint(filesystem::path const& path, void const* parameters, checkpoint::DType dtype,
+                             TrainingState const* training){
+    // All nodes are looped through in the order they were added to the model and described in a
+    // table (name, shape, position of the parameters) that lets load() reject a checkpoint of a
+    // different topology. The parameters follow as one page-aligned blob in host byte-order,
+    // exactly as they are laid out in memory
+    auto page_align = [](size_t offset){
+        return (offset + checkpoint::PAGE_SIZE - 1) / checkpoint::PAGE_SIZE * checkpoint::PAGE_SIZE;
+    };
+
+    checkpoint::Header header{};
+    copy(begin(checkpoint::MAGIC), end(checkpoint::MAGIC), header.magic);
+    header.version = checkpoint::VERSION;
+    header.dtype = dtype;
+    size_t value_size = dtype == checkpoint::DType::BFloat16 ? sizeof(bfloat16) : sizeof(float);
+    header.node_count = nodes_.size();
+
+    vector<checkpoint::Entry> table(nodes_.size());
+    for(size_t i = 0; i != nodes_.size(); i++){
+        Node const& node = *nodes_[i];
+        checkpoint::Entry& entry = table[i];
+        vector<size_t> shape = node.param_shape();
+        if(node.name().size() >= checkpoint::MAX_NAME || shape.size() > checkpoint::MAX_RANK){
+            throw runtime_error{"Node " + node.name() + " cannot be described in a checkpoint"};
+        }
+        copy(node.name().begin(), node.name().end(), entry.name);
+        entry.offset = offsets_[i] * value_size;
+        entry.count = node.param_count();
+        entry.rank = shape.size();
+        copy(shape.begin(), shape.end(), entry.shape);
+    }
+
+    size_t table_end = sizeof(header) + table.size() * sizeof(checkpoint::Entry);
+    header.blob_offset = page_align(table_end);
+    header.blob_bytes = arena_size_ * value_size;
+    header.blob_checksum = checkpoint::checksum(parameters, header.blob_bytes);
+
+    if(training != nullptr){
+        if(training->optimizer.empty() || training->optimizer.size() >= sizeof(header.optimizer)){
+            throw runtime_error{"Invalid optimizer name " + training->optimizer};
+        }
+        copy(training->optimizer.begin(), training->optimizer.end(), header.optimizer);
+        header.optimizer_steps = training->optimizer_steps;
+        header.next_batch = training->next_batch;
+        header.seed = training->seed;
+        header.state_count = training->optimizer_state.size();
+        header.state_offset = page_align(header.blob_offset + header.blob_bytes);
+        header.state_checksum = checkpoint::checksum(nullptr, 0);
+        for(float const* state : training->optimizer_state){
+            header.state_checksum = checkpoint::checksum(state, arena_size_ * sizeof(float), header.state_checksum);
+        }
+    }
+
+    header.table_checksum = checkpoint::checksum(table.data(), table.size() * sizeof(checkpoint::Entry),
+                                                 checkpoint::checksum(&header, sizeof(header)));
+
+    // Written under a temporary name and flushed to disk before it replaces the previous file, so
+    // a crash never leaves a partially written checkpoint behind
+    filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        ofstream out{temporary, std::ios::binary};
+        vector<char> padding(checkpoint::PAGE_SIZE);
+        auto pad_to = [&](size_t offset){
+            out.write(padding.data(), offset - static_cast<size_t>(out.tellp()));
+        };
+        out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        out.write(reinterpret_cast<char const*>(table.data()), table.size() * sizeof(checkpoint::Entry));
+        pad_to(header.blob_offset);
+        out.write(reinterpret_cast<char const*>(parameters), header.blob_bytes);
+        if(training != nullptr){
+            pad_to(header.state_offset);
+            for(float const* state : training->optimizer_state){
+                out.write(reinterpret_cast<char const*>(state), arena_size_ * sizeof(float));
+            }
+        }
+        if(!out.flush()){
+            throw runtime_error{"Unable to write " + temporary.string()};
         }
     }
+    int fd = ::open(temporary.c_str(), O_RDONLY);
+    if(fd < 0 || ::fsync(fd) != 0){
+        if(fd >= 0){
+            ::close(fd);
+        }
+        throw runtime_error{"Unable to flush " + temporary.string()};
+    }
+    ::close(fd);
+    filesystem::rename(temporary, path);
 }
 
-void Model::load(ifstream& in){
-    for(auto& node : nodes_){
-        size_t param_count = node->param_count();
-        for(size_t i = 0; i != param_count; i++){
-            in.read(reinterpret_cast<char*>(node->param(i)), sizeof(float));
+void Model::load(filesystem::path const& path, bool verify){
+    layout();
+    auto mapping = make_unique<MappedFile>(path, MappedFile::Access::CopyOnWrite);
+    auto fail = [&](string const& reason){
+        throw runtime_error{"Cannot load " + path.string() + " into model " + name_ + ": " + reason};
+    };
+
+    // Version 1 files end the header before the training state, which then reads as zero
+    checkpoint::Header header{};
+    size_t header_bytes = checkpoint::header_size(1);
+    if(mapping->size() < header_bytes){
+        fail("not a checkpoint");
+    }
+    memcpy(&header, mapping->data(), header_bytes);
+    if(!equal(begin(checkpoint::MAGIC), end(checkpoint::MAGIC), header.magic)){
+        fail("not a checkpoint");
+    }
+    if(header.version != 1 && header.version != checkpoint::VERSION){
+        fail("unsupported version " + to_string(header.version));
+    }
+    header_bytes = checkpoint::header_size(header.version);
+    if(mapping->size() < header_bytes){
+        fail("truncated file");
+    }
+    memcpy(&header, mapping->data(), header_bytes);
+    if(header.dtype != checkpoint::DType::Float32 && header.dtype != checkpoint::DType::BFloat16){
+        fail("unsupported parameter type");
+    }
+    size_t value_size = header.dtype == checkpoint::DType::BFloat16 ? sizeof(bfloat16) : sizeof(float);
+    if(header.node_count != nodes_.size()){
+        fail(to_string(header.node_count) + " nodes instead of " + to_string(nodes_.size()));
+    }
+    size_t table_bytes = header.node_count * sizeof(checkpoint::Entry);
+    if(mapping->size() < header_bytes + table_bytes){
+        fail("truncated file");
+    }
+
+    vector<checkpoint::Entry> table(header.node_count);
+    memcpy(table.data(), mapping->data() + header_bytes, table_bytes);
+    uint64_t table_checksum = header.table_checksum;
+    header.table_checksum = 0;
+    if(checkpoint::checksum(table.data(), table_bytes, checkpoint::checksum(&header, header_bytes)) != table_checksum){
+        fail("corrupted header");
+    }
+
+    for(size_t i = 0; i != nodes_.size(); i++){
+        Node const& node = *nodes_[i];
+        checkpoint::Entry const& entry = table[i];
+        vector<size_t> shape = node.param_shape();
+        bool same = string{entry.name, strnlen(entry.name, checkpoint::MAX_NAME)} == node.name()
+            && entry.offset == offsets_[i] * value_size
+            && entry.count == node.param_count()
+            && entry.rank == shape.size()
+            && equal(shape.begin(), shape.end(), entry.shape);
+        if(!same){
+            fail("node " + to_string(i) + " (" + node.name() + ") differs");
         }
     }
+
+    if(header.blob_bytes != arena_size_ * value_size || header.blob_offset % checkpoint::PAGE_SIZE != 0){
+        fail("parameter layout differs");
+    }
+    // The offset is read from the file, so the bounds are checked without summing it up
+    if(header.blob_offset > mapping->size() || header.blob_bytes > mapping->size() - header.blob_offset){
+        fail("truncated file");
+    }
+    uint8_t* blob = mapping->mutable_data() + header.blob_offset;
+    if(verify && checkpoint::checksum(blob, header.blob_bytes) != header.blob_checksum){
+        fail("corrupted parameters");
+    }
+
+    // The nodes use the mapped parameters in place; pages are only copied if they are written to.
+    // bfloat16 parameters are widened into float master parameters instead
+    checkpoint_ = std::move(mapping);
+    checkpoint_header_ = header;
+    if(header.dtype == checkpoint::DType::BFloat16){
+        params_.resize(arena_size_);
+        to_float(reinterpret_cast<bfloat16 const*>(blob), params_.data(), arena_size_);
+        parameters_ = params_.data();
+    }else{
+        parameters_ = reinterpret_cast<float*>(blob);
+        params_ = {};
+    }
+    if(precision_ == Precision::BFloat16){
+        // Models that shared the parameters share them again after the load
+        params16_.resize(arena_size_);
+        parameters16_ = params16_.data();
+        round_parameters();
+    }
+    bind();
+}
+
+TrainingState Model::resume(filesystem::path const& path, Optimizer& optimizer, bool verify){
+    load(path, verify);
+    checkpoint::Header const& header = checkpoint_header_;
+    auto fail = [&](string const& reason){
+        throw runtime_error{"Cannot resume from " + path.string() + ": " + reason};
+    };
+
+    string name{header.optimizer, strnlen(header.optimizer, sizeof(header.optimizer))};
+    if(name.empty()){
+        fail("no training state");
+    }
+    if(name != optimizer.name()){
+        fail("saved with optimizer " + name + " instead of " + optimizer.name());
+    }
+    vector<FloatSpan> state = optimizer.state(arena_size_);
+    if(header.state_count != state.size()){
+        fail(to_string(header.state_count) + " optimizer arrays instead of " + to_string(state.size()));
+    }
+    // As for the parameters, the offset read from the file is not summed up (state_count is
+    // already known to be small)
+    if(header.state_offset % checkpoint::PAGE_SIZE != 0 || header.state_offset > checkpoint_->size()
+       || header.state_count * arena_size_ * sizeof(float) > checkpoint_->size() - header.state_offset){
+        fail("truncated file");
+    }
+
+    size_t state_bytes = arena_size_ * sizeof(float);
+    uint8_t const* data = checkpoint_->data() + header.state_offset;
+    if(verify && checkpoint::checksum(data, header.state_count * state_bytes) != header.state_checksum){
+        fail("corrupted optimizer state");
+    }
+    for(FloatSpan span : state){
+        memcpy(span.data, data, state_bytes);
+        data += state_bytes;
+    }
+    optimizer.set_steps(header.optimizer_steps);
+
+    return TrainingState{name, header.optimizer_steps, {}, header.next_batch, header.seed};
 }
\ No newline at end of file
@@ -1,5 +1,9 @@
 #pragma once
+#include "Aligned.h"
+#include "BFloat16.h"
+#include "Checkpoint.h"
 #include <cstdint>
+#include <filesystem>
 #include <vector>
 #include <string>
 #include <random>
@@ -8,31 +12,154 @@
 
 using namespace std;
 
-// To be defined later. This class encapsulates all the nodes in our graph
-// TODO implement this in the cpp file
+// Contiguous run of floats
+struct FloatSpan{
+    float* data;
+    size_t size;
+};
+
+// A [batch x size] matrix of 8-bit values standing for the floats scale * (q - zero_point), as
+// passed between nodes in quantized inference. A null data pointer means no such matrix exists
+struct QuantizedView{
+    uint8_t const* data{nullptr};
+    float scale{0.0};
+    int32_t zero_point{0};
+};
+
+// How an intermediate buffer of a node is used during a forward and reverse pass, which
+// determines how long it has to live
+enum class BufferUse{
+    // output(): written by forward, read by the subsequents and by the node's own reverse
+    Output,
+    // Written by forward and read by the node's own reverse
+    Saved,
+    // input_gradients(): written by reverse and read by the reverse of the antecedents
+    InputGradients,
+    // Only used within reverse
+    ReverseScratch,
+    // Only used within forward
+    ForwardScratch
+};
+
+// An intermediate buffer holding sample_size floats for every sample of a batch
+struct BufferRequest{
+    BufferUse use;
+    size_t sample_size;
+};
+
+// Storage precision of the parameters and activations used by the forward and reverse passes.
+// Arithmetic, gradients and the master parameters updated by the optimizer are always float
+enum class Precision{
+    Float32,
+    BFloat16
+};
+
+// Peak memory of the intermediate buffers of a model
+struct MemoryStats{
+    // Largest batch the arena has been planned for
+    size_t batch;
+    // Size of the arena
+    size_t peak_bytes;
+    // Size the buffers would take without reusing memory between them
+    size_t total_bytes;
+};
+
+// Defined below. This class encapsulates all the nodes in our graph
 class Model;
+class ExecutionPlan;
+class MappedFile;
 
 class Node{
 public:
     Node(Model& model, string name);
+    // Nodes are owned and destroyed through unique_ptr<Node>
+    virtual ~Node() = default;
 
     // Nodes must describe how they should be initialized
     virtual void init(mt19937& rne) = 0;
 
-    // During forward propagation, nodes transform input data and feed results to all subsequent nodes
-    virtual void forward(float* inputs) = 0;
+    // During forward propagation, nodes transform a batch of input data into their output().
+    // The inputs are a row-major [batch x input size] matrix, one sample per row. The model's
+    // execution plan calls this once per node in topological order, with the output of the
+    // antecedent (or the sum of the outputs when there are several) as the inputs
+    virtual void forward(float* inputs, size_t batch) = 0;
 
-    // During reverse propagation, nodes receive loss gradients to its previous outputs and compute gradients with respect to each tunable parameter
+    // During reverse propagation, nodes receive loss gradients to its previous outputs and compute gradients with respect to each tunable parameter.
+    // The gradients have the same [batch x output size] layout as the outputs of the last forward pass.
+    // When the output feeds several nodes, the gradients are the sum of their input_gradients()
     virtual void reverse(float* gradients) = 0; 
 
+    // Number of features of each output sample
+    virtual size_t output_size() const noexcept {return 0;}
+
+    // The [batch x output_size()] output of the last forward pass
+    virtual float* output() {return nullptr;}
+
+    // The loss gradients with respect to the inputs of the last forward pass, computed by reverse()
+    virtual float* input_gradients() {return nullptr;}
+
+    // The intermediate buffers (activations, gradients) the node needs. The execution plan places
+    // all of them in one arena shared by the whole model, reusing memory between buffers that are
+    // never live at the same time, and binds them before a forward pass.
+    virtual vector<BufferRequest> buffers() const {return {};}
+
+    // Receives one pointer per requested buffer, sized for at least the batch of the coming
+    // forward pass. Gradient buffers are null in inference mode, and input gradients are null
+    // when no antecedent reads them
+    virtual void bind_buffers(vector<float*> const& buffers) {}
+
+    // A node with a softmax activation calls this on its only subsequent before each forward pass.
+    // A node that can compute the softmax itself, fused with its own computation (e.g. the cross-entropy
+    // loss), returns true and then receives the raw logits; the gradient it sends back is with respect
+    // to the logits as well.
+    virtual bool fuse_softmax() {return false;}
+
     // If the node has tunable parameters, this method should be overridden to reflect the quantity of tunable parameters
     virtual size_t param_count() const noexcept {return 0;}
 
-    // Accessor for parameter by index
-    virtual float* param(size_t index) {return nullptr;}
+    // Dimensions that determine the layout of the parameters (at most 4), recorded in checkpoints
+    // so that loading them into a differently shaped node fails
+    virtual vector<size_t> param_shape() const {return {};}
+
+    // The model owns the storage of all parameters and their loss-gradients. Once it has laid
+    // them out it hands every node with parameters a view of its param_count() parameters and
+    // gradients, each starting on a cache line. gradients is null in inference mode
+    virtual void bind(float* params, float* gradients) {}
+
+    // In inference mode a node only runs forward passes: it keeps nothing for reverse() and
+    // releases its gradient buffers. Leaving inference mode allocates them again
+    virtual void set_inference(bool inference) {}
+
+    // Mixed precision (see Model::set_precision). In bfloat16 precision the model hands every
+    // node with parameters a bfloat16 copy of its parameters, kept rounded from the float ones
+    // after every update; in float precision params is null
+    virtual void bind_bfloat16(bfloat16 const* params) {}
+
+    // Whether forward reads the bfloat16_output() of its antecedent instead of the float inputs
+    virtual bool bfloat16_inputs() const noexcept {return false;}
+
+    // The output of the last forward pass in bfloat16, or null if the node produces floats. Only
+    // nodes whose subsequents all read bfloat16 inputs may skip the float output()
+    virtual bfloat16 const* bfloat16_output() const {return nullptr;}
+
+    // Post-training quantization for inference (see Model::quantize). While calibrating, forward
+    // passes record the range of the values the node sees; quantize() then switches the node to
+    // integer arithmetic with the recorded ranges
+    virtual void calibrate(bool calibrating) {}
+    virtual void quantize() {}
 
-    // Access for loss-gradient with respect tot a parameter specified by index
-    virtual float* gradient(size_t index) {return nullptr;}
+    // Whether forward reads the quantized_output() of its antecedent, if it has one, instead of
+    // the float inputs
+    virtual bool quantized() const noexcept {return false;}
+
+    // The output of the last forward pass as 8-bit values, or a null view if the node only
+    // produces floats. Only nodes whose subsequents are all quantized may skip the float output()
+    virtual QuantizedView quantized_output() const {return {};}
+
+    // Input nodes: take the following forward passes from input, a [batch x output_size()]
+    // matrix of 8-bit values, instead of the float inputs, until reset with a null view.
+    // Returns false if the node does not support it
+    virtual bool feed_quantized(QuantizedView input) {return false;}
 
     // Human-readable name for debugging purposes
     string const& name() const noexcept {return name_;}
@@ -42,6 +169,7 @@ public:
 
 protected:
     friend class Model;
+    friend class ExecutionPlan;
 
     Model& model_;
     string name_;
@@ -51,23 +179,43 @@ protected:
     vector<Node*> subsequents_; // следующие узлы
 };
 
-// Base class of optimizer used to train a model
+// Base class of optimizer used to train a model. The update loops of the optimizers (like the
+// conversions of BFloat16.h) are compiled with target_clones for AVX-512, AVX2 and the baseline
+// instruction set, and the loader picks the widest version the CPU supports
 class Optimizer{
 public:
-    virtual void train(Node& node) = 0;
+    virtual ~Optimizer() = default;
+
+    // Update count parameters from their loss-gradients, which are reset to zero afterwards.
+    // Both arrays are cache-line aligned
+    virtual void train(float* params, float* gradients, size_t count) = 0;
+
+    // Name identifying the optimizer in checkpoints
+    virtual char const* name() const noexcept = 0;
+
+    // The arrays the optimizer keeps between steps, each laid out like the count parameters it
+    // trains (allocated if they do not exist yet), and the number of steps taken. Checkpoints save
+    // and restore them to resume training
+    virtual vector<FloatSpan> state(size_t count) {return {};}
+    virtual uint64_t steps() const noexcept {return 0;}
+    virtual void set_steps(uint64_t steps) {}
 };
 
 class Model{
 public:
     Model(string name);
+    Model(Model&&) noexcept;
+    Model& operator=(Model&&) noexcept;
+    ~Model();
 
     // Add a node to the model, forwarding arguments to the node's constructor
     template<typename Node_t, typename... T>
     Node_t& add_node(T&&... args){
         // emplace_back() instead of push_back() because we can initialize the node inplace
         // anothe words, emplace_back creates the object at the end of the vector 
-        nodes_.emplace_back(make_unique<Node_t>(*this, forward<T>(args)...));
+        nodes_.emplace_back(make_unique<Node_t>(*this, std::forward<T>(args)...));
         // nodes_.emplace_back(make_unique<Node_t>(args));
+        invalidate_plan();
         return reinterpret_cast<Node_t&>(*nodes_.back());
     }
 
@@ -78,6 +226,40 @@ public:
     // seed os 0, a new random seed is chosen instead. Returns the seed used.
     mt19937::result_type init(mt19937::result_type seed = 0);
 
+    // Make this model use the parameters of source, which must have been built identically.
+    // The parameters stay owned by source; the gradients stay private to this model
+    void share_parameters(Model& source);
+
+    // Run the graph on a batch of inputs, which are fed to every node without antecedents (an
+    // input node may also ignore them and produce its own batch)
+    void forward(float* inputs, size_t batch);
+
+    // Backpropagate the loss gradients of the last forward pass from the nodes without
+    // subsequents (the loss nodes) through the graph
+    void reverse();
+
+    // Switch every node into (or out of) forward-only inference mode
+    void set_inference(bool inference);
+
+    // Store the parameters and activations of the passes in the given precision. In bfloat16 the
+    // model keeps a rounded copy of the float parameters, refreshed by init, load and train, and
+    // nodes exchange bfloat16 activations where they can; this halves the memory and bandwidth of
+    // both while the optimizer keeps updating the float master parameters. Models sharing
+    // parameters must have the same precision. Saved checkpoints record it (see Checkpoint.h)
+    void set_precision(Precision precision);
+
+    Precision precision() const noexcept{
+        return precision_;
+    }
+
+    // Switch an inference-mode model to 8-bit integer arithmetic. The ranges of the values flowing
+    // through the graph are calibrated with a float forward pass over count samples, then the
+    // nodes quantize their parameters (see Node::quantize). Leaving inference mode undoes it
+    void quantize(float* samples, size_t count);
+
+    // Size of the arena of intermediate buffers, planned for the largest batch so far
+    MemoryStats memory();
+
     // Adjust all model parameters of constituent nodes using the provided optimizer (shown later)
     void train(Optimizer& optimizer);
 
@@ -87,12 +269,67 @@ public:
 
     void print() const;
 
-    // Routines for saving and loading model parameters to and from disk
-    void save(ofstream& out);
-    void load(ifstream& in);
+    // The nodes in the order they were added
+    vector<unique_ptr<Node>> const& nodes() const noexcept{
+        return nodes_;
+    }
+
+    // The parameters and the loss-gradients of all nodes, each as one contiguous cache-line
+    // aligned array in node order. Padding between the nodes is kept at zero
+    FloatSpan parameters();
+    FloatSpan gradients();
+
+    // Routines for saving and loading model parameters to and from disk, in the checkpoint format
+    // described in Checkpoint.h. Loading maps the file copy-on-write and uses the parameters in
+    // place, so only the header is read up front. It throws if the checkpoint does not match the
+    // topology of this model; verify also checks the parameters against their checksum, which
+    // reads them all. Models sharing this model's parameters must share them again after a load
+    // Files are written under a temporary name and renamed into place, so a checkpoint is either
+    // complete or absent
+    void save(filesystem::path const& path);
+    void load(filesystem::path const& path, bool verify = false);
+
+    // Save parameters().size parameters (e.g. a snapshot of parameters() taken while training
+    // goes on) together with the state of the training run
+    void save(filesystem::path const& path, float const* parameters, TrainingState const& training);
+
+    // Load a checkpoint saved with a training state, restore the optimizer's state from it and
+    // return the position of the run. Throws if the checkpoint was saved for another optimizer
+    TrainingState resume(filesystem::path const& path, Optimizer& optimizer, bool verify = false);
 
 private:
     friend class Node;
+
+    // Lay out the arenas for the nodes added so far and bind the nodes to them
+    void layout();
+    void bind();
+    // Refresh the bfloat16 copy of the parameters, if any
+    void round_parameters();
+
+    ExecutionPlan& plan();
+    void invalidate_plan();
+
+    // The parameter blob is arena_size_ values of the given type
+    void write_checkpoint(filesystem::path const& path, void const* parameters, checkpoint::DType dtype,
+                          TrainingState const* training);
+
     string name_;
     vector<unique_ptr<Node>> nodes_;
+    // Offset of the parameters of each node in the arenas
+    vector<size_t> offsets_;
+    size_t arena_size_{0};
+    aligned_vector<float> params_;
+    aligned_vector<float> gradients_;
+    // The parameters in use: params_, or the arena of the model they are shared with
+    float* parameters_{nullptr};
+    // In bfloat16 precision the rounded parameters: params16_, or those of the model sharing them
+    Precision precision_{Precision::Float32};
+    aligned_vector<bfloat16> params16_;
+    bfloat16* parameters16_{nullptr};
+    bool inference_{false};
+    // The checkpoint the parameters were loaded from and its header
+    unique_ptr<MappedFile> checkpoint_;
+    checkpoint::Header checkpoint_header_{};
+    // Compiled from the edges on first use and discarded when nodes or edges are added
+    unique_ptr<ExecutionPlan> plan_;
 };
\ No newline at end of file
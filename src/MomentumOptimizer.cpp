@@ -0,0 +1,35 @@
+#include "MomentumOptimizer.h"
+#include <stdexcept>
+
+namespace{
+
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void momentum_update(float* params, float* gradients, float* velocities, size_t count, float eta, float mu){
+    float* __restrict p = static_cast<float*>(__builtin_assume_aligned(params, CACHE_LINE));
+    float* __restrict g = static_cast<float*>(__builtin_assume_aligned(gradients, CACHE_LINE));
+    float* __restrict v = static_cast<float*>(__builtin_assume_aligned(velocities, CACHE_LINE));
+    for(size_t i = 0; i != count; i++){
+        float velocity = mu * v[i] + g[i];
+        v[i] = velocity;
+        p[i] -= eta * velocity;
+        g[i] = float{0.0};
+    }
+}
+
+} // namespace
+
+MomentumOptimizer::MomentumOptimizer(float eta, float mu): eta_{eta}, mu_{mu}{}
+
+void MomentumOptimizer::train(float* params, float* gradients, size_t count){
+    state(count);
+    momentum_update(params, gradients, velocities_.data(), count, eta_, mu_);
+}
+
+vector<FloatSpan> MomentumOptimizer::state(size_t count){
+    if(velocities_.empty()){
+        velocities_.assign(count, float{0.0});
+    }else if(velocities_.size() != count){
+        throw runtime_error{"Momentum optimizer used with models of different sizes"};
+    }
+    return {{velocities_.data(), velocities_.size()}};
+}
\ No newline at end of file
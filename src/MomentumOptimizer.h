@@ -0,0 +1,29 @@
+#pragma once
+#include "Model.h"
+
+// Stochastic gradient descent with (heavy-ball) momentum. A velocity is kept per parameter,
+// an exponentially decaying sum of past gradients:
+//   v' = mu * v + dL/dp
+//   p' = p - eta * v'
+// so consistent gradient directions accelerate while oscillating ones cancel out.
+
+class MomentumOptimizer : public Optimizer {
+public:
+    MomentumOptimizer(float eta, float mu = 0.9);
+
+    // The velocities are laid out like the parameters they belong to and are allocated on the
+    // first call, so an optimizer instance must always be used with the same model. Parameters,
+    // gradients and velocities are each read and written once per call
+    void train(float* params, float* gradients, size_t count) override;
+
+    char const* name() const noexcept override{
+        return "momentum";
+    }
+
+    vector<FloatSpan> state(size_t count) override;
+
+private:
+    float eta_;
+    float mu_;
+    aligned_vector<float> velocities_;
+};
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "Prefetcher.h"
+#include "Profiler.h"
+#include <chrono>
+#include <stdexcept>
+
+using profile::Clock;
+using profile::seconds_since;
+
+Prefetcher::Prefetcher(IDXDataset const& dataset, Sampler const& sampler, size_t depth, size_t workers, size_t first_sequence)
+    : dataset_{dataset}, sampler_{sampler}, produce_sequence_{first_sequence}, consume_sequence_{first_sequence}{
+    if(depth == 0 || workers == 0){
+        throw std::runtime_error{"Prefetcher requires a non-zero depth and worker count"};
+    }
+
+    // One extra slot holds the batch being consumed while depth batches are assembled ahead of it
+    slots_.reserve(depth + 1);
+    for(size_t i = 0; i != depth + 1; i++){
+        slots_.emplace_back(sampler_.batch_size(), dataset_.image_size());
+    }
+
+    for(size_t i = 0; i != workers; i++){
+        workers_.emplace_back(&Prefetcher::work, this);
+    }
+}
+
+Prefetcher::~Prefetcher(){
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stop_ = true;
+    }
+    released_.notify_all();
+    for(std::thread& worker : workers_){
+        worker.join();
+    }
+}
+
+Batch const& Prefetcher::next(){
+    NN_PROFILE_SCOPE("input", profile::Category::Input);
+    std::unique_lock<std::mutex> lock{mutex_};
+
+    // The previously returned batch is no longer referenced by the consumer
+    if(consuming_ != nullptr){
+        consuming_->state = State::Free;
+        consuming_ = nullptr;
+        released_.notify_all();
+    }
+
+    Slot& slot = slots_[consume_sequence_ % slots_.size()];
+    auto is_ready = [&]{ return slot.state == State::Ready && slot.sequence == consume_sequence_; };
+    if(!is_ready()){
+        auto start = Clock::now();
+        ready_.wait(lock, is_ready);
+        ++stats_.stalls;
+        stats_.stall_seconds += seconds_since(start);
+    }
+
+    slot.state = State::Consuming;
+    consuming_ = &slot;
+    ++consume_sequence_;
+    ++stats_.batches;
+    return slot.batch;
+}
+
+PipelineStats Prefetcher::stats() const{
+    std::lock_guard<std::mutex> lock{mutex_};
+    return stats_;
+}
+
+void Prefetcher::work(){
+    while(true){
+        std::unique_lock<std::mutex> lock{mutex_};
+
+        // Claim the next batch once its slot has been released by the consumer
+        auto can_claim = [&]{ return stop_ || slots_[produce_sequence_ % slots_.size()].state == State::Free; };
+        if(!can_claim()){
+            auto start = Clock::now();
+            released_.wait(lock, can_claim);
+            stats_.idle_seconds += seconds_since(start);
+        }
+        if(stop_){
+            return;
+        }
+
+        size_t sequence = produce_sequence_++;
+        Slot& slot = slots_[sequence % slots_.size()];
+        slot.state = State::Filling;
+        slot.sequence = sequence;
+        lock.unlock();
+
+        // Assembling the batch is the expensive part and happens outside the lock
+        fill(slot, sequence);
+
+        lock.lock();
+        slot.state = State::Ready;
+        ready_.notify_one();
+    }
+}
+
+void Prefetcher::fill(Slot& slot, size_t sequence){
+    BatchBuffers& buffers = slot.buffers;
+    size_t count = sampler_.batch(sequence, buffers.indices.data());
+    dataset_.gather(buffers.indices.data(), count, buffers.data.data(), buffers.labels.data(),
+                    buffers.label_index.data());
+    slot.batch.size = count;
+    slot.batch.sequence = sequence;
+}
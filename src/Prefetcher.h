@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Aligned.h"
+#include "IDXDataset.h"
+#include "Sampler.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A batch assembled by the input pipeline
+struct Batch{
+    // [size x image size] pixels normalized to [0, 1]
+    float* data;
+    // [size x CLASSES] one-hot encoded labels
+    float* labels;
+    // Index of the hot class of each sample
+    uint8_t* label_index;
+    size_t size;
+    // Global number of the batch in the sampler's order
+    size_t sequence;
+};
+
+// Counters describing how well the pipeline keeps up with training
+struct PipelineStats{
+    // Batches handed to the consumer
+    size_t batches = 0;
+    // Calls to next() that had to wait for a batch to be assembled
+    size_t stalls = 0;
+    // Total time the consumer spent waiting in next(). When this is a significant fraction
+    // of the run, training is input-bound
+    double stall_seconds = 0.0;
+    // Total time the workers spent waiting for a free buffer (the consumer is the bottleneck)
+    double idle_seconds = 0.0;
+};
+
+// Producer/consumer input pipeline. Worker threads gather, normalize and one-hot encode the
+// upcoming batches into a ring of preallocated, cache-line aligned buffers while the training
+// thread consumes the current one. At most depth batches are assembled ahead of the consumer.
+// Batches are delivered in the sampler's order, starting from batch number first_sequence.
+class Prefetcher{
+public:
+    // The dataset and sampler must outlive the prefetcher
+    Prefetcher(IDXDataset const& dataset, Sampler const& sampler, size_t depth = 4, size_t workers = 1, size_t first_sequence = 0);
+    ~Prefetcher();
+
+    Prefetcher(Prefetcher const&) = delete;
+    Prefetcher& operator=(Prefetcher const&) = delete;
+
+    // Blocks until the next batch is ready. The returned batch stays valid until the next call.
+    Batch const& next();
+
+    PipelineStats stats() const;
+
+private:
+    enum class State{
+        Free,
+        Filling,
+        Ready,
+        Consuming
+    };
+
+    struct Slot{
+        Slot(size_t batch_size, size_t image_size)
+            : buffers{batch_size, image_size},
+              batch{buffers.data.data(), buffers.labels.data(), buffers.label_index.data(), 0, 0}{}
+
+        BatchBuffers buffers;
+        Batch batch;
+        State state = State::Free;
+        size_t sequence = 0;
+    };
+
+    void work();
+    void fill(Slot& slot, size_t sequence);
+
+    IDXDataset const& dataset_;
+    Sampler const& sampler_;
+    std::vector<Slot> slots_;
+
+    mutable std::mutex mutex_;
+    // Signaled when a slot becomes ready (wakes the consumer)
+    std::condition_variable ready_;
+    // Signaled when a slot is released (wakes the workers)
+    std::condition_variable released_;
+    // Next batch to be claimed by a worker and next batch to be consumed
+    size_t produce_sequence_ = 0;
+    size_t consume_sequence_ = 0;
+    // Slot currently held by the consumer, if any
+    Slot* consuming_ = nullptr;
+    bool stop_ = false;
+    PipelineStats stats_;
+
+    std::vector<std::thread> workers_;
+};
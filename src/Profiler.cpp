@@ -0,0 +1,285 @@
+#include "Profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace profile{
+namespace{
+
+constexpr size_t CATEGORIES = 5;
+
+struct Event{
+    uint32_t name;
+    uint32_t samples;
+    // Nanoseconds since the origin
+    int64_t start;
+    int64_t duration;
+};
+
+// Accumulated events of one name since the last summary
+struct Totals{
+    int64_t nanoseconds{0};
+    size_t count{0};
+    size_t samples{0};
+};
+
+// The events of one thread. Summaries and traces read them from another thread, so the events
+// and totals are guarded by a lock that is practically uncontended
+struct ThreadLog{
+    uint32_t thread;
+    // Interned name of each name pointer this thread recorded under, per category, with a copy
+    // of the name to notice a pointer being reused for another name. Only used by the owning
+    // thread
+    std::unordered_map<char const*, std::pair<uint32_t, std::string>> ids[CATEGORIES];
+
+    std::mutex mutex;
+    std::vector<Event> events;
+    size_t dropped{0};
+    // Indexed by interned name
+    std::vector<Totals> totals;
+    // Span of the batches since the last summary
+    int64_t first_batch{INT64_MAX};
+    int64_t last_batch{INT64_MIN};
+};
+
+struct Name{
+    std::string text;
+    Category category;
+};
+
+std::atomic<bool> enabled_{false};
+Clock::time_point const origin = Clock::now();
+
+// The logs of all threads that recorded events and the names they recorded under
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<ThreadLog>> logs;
+std::vector<Name> names;
+
+ThreadLog& thread_log(){
+    thread_local ThreadLog* log = nullptr;
+    if(log == nullptr){
+        std::lock_guard<std::mutex> lock{registry_mutex};
+        logs.push_back(std::make_unique<ThreadLog>());
+        log = logs.back().get();
+        log->thread = static_cast<uint32_t>(logs.size());
+    }
+    return *log;
+}
+
+uint32_t intern(char const* name, Category category){
+    std::lock_guard<std::mutex> lock{registry_mutex};
+    for(uint32_t id = 0; id != names.size(); id++){
+        if(names[id].category == category && names[id].text == name){
+            return id;
+        }
+    }
+    names.push_back({name, category});
+    return static_cast<uint32_t>(names.size() - 1);
+}
+
+char const* category_name(Category category){
+    switch(category){
+    case Category::Forward:
+        return "forward";
+    case Category::Reverse:
+        return "reverse";
+    case Category::Optimizer:
+        return "optimizer";
+    case Category::Input:
+        return "input";
+    case Category::Batch:
+        return "batch";
+    }
+    return "";
+}
+
+std::string escape(std::string const& text){
+    std::string escaped;
+    for(char c : text){
+        if(c == '"' || c == '\\'){
+            escaped += '\\';
+        }
+        if(static_cast<unsigned char>(c) >= 0x20){
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+double milliseconds(int64_t nanoseconds, size_t batches){
+    return batches == 0 ? 0.0 : static_cast<double>(nanoseconds) * 1e-6 / static_cast<double>(batches);
+}
+
+} // namespace
+
+void enable(bool enabled) noexcept{
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+bool enabled() noexcept{
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+void record(char const* name, Category category, Clock::time_point start, Clock::time_point end, size_t samples){
+    ThreadLog& log = thread_log();
+    auto& ids = log.ids[static_cast<size_t>(category)];
+    auto found = ids.find(name);
+    if(found == ids.end() || found->second.second != name){
+        found = ids.insert_or_assign(name, std::pair{intern(name, category), std::string{name}}).first;
+    }
+    uint32_t id = found->second.first;
+
+    int64_t begin = std::chrono::duration_cast<std::chrono::nanoseconds>(start - origin).count();
+    int64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::lock_guard<std::mutex> lock{log.mutex};
+    if(log.events.size() < MAX_TRACE_EVENTS){
+        log.events.push_back({id, static_cast<uint32_t>(samples), begin, duration});
+    }else{
+        log.dropped++;
+    }
+    if(log.totals.size() <= id){
+        log.totals.resize(id + 1);
+    }
+    Totals& totals = log.totals[id];
+    totals.nanoseconds += duration;
+    totals.count++;
+    totals.samples += samples;
+    if(category == Category::Batch){
+        log.first_batch = std::min(log.first_batch, begin);
+        log.last_batch = std::max(log.last_batch, begin + duration);
+    }
+}
+
+void summary(FILE* out){
+    std::lock_guard<std::mutex> registry_lock{registry_mutex};
+
+    // Merge and reset the totals of all threads, counting the threads that recorded each category
+    std::vector<Totals> totals(names.size());
+    size_t category_threads[CATEGORIES] = {};
+    int64_t first_batch = INT64_MAX;
+    int64_t last_batch = INT64_MIN;
+    for(auto& log : logs){
+        std::lock_guard<std::mutex> lock{log->mutex};
+        bool recorded[CATEGORIES] = {};
+        for(size_t id = 0; id != log->totals.size(); id++){
+            totals[id].nanoseconds += log->totals[id].nanoseconds;
+            totals[id].count += log->totals[id].count;
+            totals[id].samples += log->totals[id].samples;
+            recorded[static_cast<size_t>(names[id].category)] |= log->totals[id].count != 0;
+        }
+        for(size_t c = 0; c != CATEGORIES; c++){
+            category_threads[c] += recorded[c];
+        }
+        first_batch = std::min(first_batch, log->first_batch);
+        last_batch = std::max(last_batch, log->last_batch);
+        log->totals.assign(log->totals.size(), Totals{});
+        log->first_batch = INT64_MAX;
+        log->last_batch = INT64_MIN;
+    }
+
+    int64_t category_totals[CATEGORIES] = {};
+    size_t batches = 0;
+    size_t samples = 0;
+    for(size_t id = 0; id != names.size(); id++){
+        category_totals[static_cast<size_t>(names[id].category)] += totals[id].nanoseconds;
+        if(names[id].category == Category::Batch){
+            batches += totals[id].count;
+            samples += totals[id].samples;
+        }
+    }
+    if(batches == 0){
+        return;
+    }
+
+    // Times are per batch, as seen by the threads running the batches. Where more threads share
+    // the work of a batch (the replicas of data-parallel training) their times overlap, so the sum
+    // over the threads is scaled down by how many more threads recorded the category than batches
+    size_t batch_threads = category_threads[static_cast<size_t>(Category::Batch)];
+    auto per_batch = [&](Category category, int64_t nanoseconds){
+        size_t threads = std::max<size_t>(category_threads[static_cast<size_t>(category)], batch_threads);
+        return milliseconds(nanoseconds, batches) * static_cast<double>(batch_threads) / static_cast<double>(threads);
+    };
+    auto category_time = [&](Category category){
+        return per_batch(category, category_totals[static_cast<size_t>(category)]);
+    };
+    double seconds = static_cast<double>(last_batch - first_batch) * 1e-9;
+    double input = category_time(Category::Input);
+    double forward = category_time(Category::Forward);
+    double reverse = category_time(Category::Reverse);
+    double optimizer = category_time(Category::Optimizer);
+    char const* bound = "compute";
+    if(input > forward + reverse && input > optimizer){
+        bound = "input";
+    }else if(optimizer > forward + reverse){
+        bound = "optimizer";
+    }
+
+    fprintf(out, "Profile: %zu batches, %.0f samples/s, per batch %.3f ms input, %.3f ms forward, "
+            "%.3f ms reverse, %.3f ms optimizer (%s-bound) |",
+            batches, static_cast<double>(samples) / seconds, input, forward, reverse, optimizer, bound);
+    // Nodes as forward/reverse milliseconds per batch, in the order they first ran
+    for(size_t id = 0; id != names.size(); id++){
+        if(names[id].category != Category::Forward || totals[id].count == 0){
+            continue;
+        }
+        int64_t reversed = 0;
+        for(size_t other = 0; other != names.size(); other++){
+            if(names[other].category == Category::Reverse && names[other].text == names[id].text){
+                reversed = totals[other].nanoseconds;
+            }
+        }
+        fprintf(out, " %s %.3f/%.3f", names[id].text.c_str(), per_batch(Category::Forward, totals[id].nanoseconds),
+                per_batch(Category::Reverse, reversed));
+    }
+    fprintf(out, "\n");
+}
+
+void write_trace(std::filesystem::path const& path){
+    FILE* out = fopen(path.c_str(), "w");
+    if(out == nullptr){
+        throw std::runtime_error{"Cannot open " + path.string() + " for writing"};
+    }
+
+    std::lock_guard<std::mutex> registry_lock{registry_mutex};
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    auto separate = [&]{
+        fprintf(out, first ? "" : ",\n");
+        first = false;
+    };
+    for(auto& log : logs){
+        std::lock_guard<std::mutex> lock{log->mutex};
+        separate();
+        fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                "\"args\": {\"name\": \"thread %u\"}}", log->thread, log->thread);
+        for(Event const& event : log->events){
+            Name const& name = names[event.name];
+            separate();
+            fprintf(out, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+                    "\"ts\": %.3f, \"dur\": %.3f",
+                    escape(name.text).c_str(), category_name(name.category), log->thread,
+                    static_cast<double>(event.start) * 1e-3, static_cast<double>(event.duration) * 1e-3);
+            if(name.category == Category::Batch){
+                double seconds = std::max<double>(static_cast<double>(event.duration) * 1e-9, 1e-9);
+                fprintf(out, ", \"args\": {\"samples\": %u, \"samples_per_second\": %.0f}",
+                        event.samples, event.samples / seconds);
+            }
+            fprintf(out, "}");
+        }
+        if(log->dropped != 0){
+            fprintf(stderr, "Profile trace: %zu events of thread %u beyond the first %zu were not kept\n",
+                    log->dropped, log->thread, MAX_TRACE_EVENTS);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    if(fclose(out) != 0){
+        throw std::runtime_error{"Cannot write " + path.string()};
+    }
+}
+
+} // namespace profile
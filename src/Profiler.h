@@ -0,0 +1,96 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+
+// Opt-in instrumentation of the hot paths of training and inference. Timed scopes record the
+// forward and reverse pass of every node, the optimizer step, the time spent waiting for input
+// and every batch as a whole (with its number of samples) as events of the calling thread. From
+// them summary() prints per-interval throughput and where the time of a batch goes, and
+// write_trace() exports the whole timeline as Chrome trace-event JSON (chrome://tracing or
+// https://ui.perfetto.dev).
+//
+// The scopes are compiled in only when NN_PROFILE is defined (cmake -DNN_PROFILE=ON); otherwise
+// NN_PROFILE_SCOPE expands to nothing and the hot paths are exactly as without profiling. When
+// compiled in, nothing is recorded until enable(true), and a disabled scope costs a single
+// relaxed atomic load.
+namespace profile{
+
+#ifdef NN_PROFILE
+constexpr bool COMPILED = true;
+#else
+constexpr bool COMPILED = false;
+#endif
+
+enum class Category : uint8_t{
+    Forward,
+    Reverse,
+    Optimizer,
+    Input,
+    Batch
+};
+
+using Clock = std::chrono::steady_clock;
+
+inline double seconds_since(Clock::time_point start){
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void enable(bool enabled) noexcept;
+bool enabled() noexcept;
+
+// Records an event of the calling thread. Events are told apart by their name and category, so
+// the nodes of several replicas add up. Batch events carry their number of samples
+void record(char const* name, Category category, Clock::time_point start, Clock::time_point end,
+            size_t samples = 0);
+
+// Prints one line on the events since the previous summary: samples per second, the average
+// time per batch spent on input, forward, reverse and optimizer, which of these bounds the run,
+// and the forward and reverse time of every node. When several threads share each batch, as the
+// replicas of data-parallel training do, their node times are averaged over the threads so they
+// compare with the wall time of the input
+void summary(FILE* out);
+
+// Writes every event recorded so far as Chrome trace-event JSON. A thread keeps at most
+// MAX_TRACE_EVENTS events for the trace; later ones only count towards the summaries
+constexpr size_t MAX_TRACE_EVENTS = size_t{1} << 20;
+void write_trace(std::filesystem::path const& path);
+
+// Records the time from its construction to its destruction
+class Scope{
+public:
+    Scope(char const* name, Category category, size_t samples = 0) noexcept
+        : name_{name}, category_{category}, samples_{samples}, active_{enabled()}{
+        if(active_){
+            start_ = Clock::now();
+        }
+    }
+
+    ~Scope(){
+        if(active_){
+            record(name_, category_, start_, Clock::now(), samples_);
+        }
+    }
+
+    Scope(Scope const&) = delete;
+    Scope& operator=(Scope const&) = delete;
+
+private:
+    char const* name_;
+    Category category_;
+    size_t samples_;
+    bool active_;
+    Clock::time_point start_;
+};
+
+} // namespace profile
+
+#ifdef NN_PROFILE
+#define NN_PROFILE_JOIN_(a, b) a##b
+#define NN_PROFILE_JOIN(a, b) NN_PROFILE_JOIN_(a, b)
+#define NN_PROFILE_SCOPE(...) profile::Scope NN_PROFILE_JOIN(profile_scope_, __LINE__){__VA_ARGS__}
+#else
+#define NN_PROFILE_SCOPE(...) static_cast<void>(0)
+#endif
@@ -0,0 +1,147 @@
+#include "QGEMM.h"
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define NN_QGEMM_X86 1
+#endif
+
+namespace{
+
+// Every kernel computes RB rows of C for one row of A at a time, so each slice of the row of A is
+// loaded once for RB rows of B
+constexpr size_t RB = 4;
+
+void qgemm_generic(size_t m, size_t n, size_t k, uint8_t const* a, size_t lda,
+                   int8_t const* b, size_t ldb, int32_t* c, size_t ldc){
+    for(size_t i = 0; i != m; i++){
+        uint8_t const* ai = a + i * lda;
+        for(size_t j = 0; j != n; j++){
+            int8_t const* bj = b + j * ldb;
+            int32_t acc = 0;
+            for(size_t p = 0; p != k; p++){
+                acc += int32_t{ai[p]} * int32_t{bj[p]};
+            }
+            c[i * ldc + j] = acc;
+        }
+    }
+}
+
+#ifdef NN_QGEMM_X86
+// vpmaddubsw would multiply twice as many bytes per instruction, but it saturates the sum of two
+// products to 16 bits (2 * 255 * 127 does not fit), which makes the result depend on the data.
+// Widening both operands to 16 bits and using vpmaddwd keeps the sums exact
+template <size_t Rows>
+__attribute__((target("avx2")))
+void dot_avx2(size_t k, uint8_t const* a, int8_t const* b, size_t ldb, int32_t* c){
+    __m256i acc[Rows];
+#pragma GCC unroll 4
+    for(size_t r = 0; r != Rows; r++){
+        acc[r] = _mm256_setzero_si256();
+    }
+    size_t p = 0;
+    for(; p + 16 <= k; p += 16){
+        __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const*>(a + p)));
+#pragma GCC unroll 4
+        for(size_t r = 0; r != Rows; r++){
+            __m256i w = _mm256_cvtepi8_epi16(_mm_load_si128(reinterpret_cast<__m128i const*>(b + r * ldb + p)));
+            acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(x, w));
+        }
+    }
+#pragma GCC unroll 4
+    for(size_t r = 0; r != Rows; r++){
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc[r]), _mm256_extracti128_si256(acc[r], 1));
+        sum = _mm_hadd_epi32(sum, sum);
+        sum = _mm_hadd_epi32(sum, sum);
+        int32_t total = _mm_cvtsi128_si32(sum);
+        for(size_t q = p; q != k; q++){
+            total += int32_t{a[q]} * int32_t{b[r * ldb + q]};
+        }
+        c[r] = total;
+    }
+}
+
+// The tail of the row of A is read with a masked load, so A needs no padding, while the padding
+// of B contributes zero products
+template <size_t Rows>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+void dot_vnni(size_t k, uint8_t const* a, int8_t const* b, size_t ldb, int32_t* c){
+    __m512i acc[Rows];
+#pragma GCC unroll 4
+    for(size_t r = 0; r != Rows; r++){
+        acc[r] = _mm512_setzero_si512();
+    }
+    for(size_t p = 0; p < k; p += 64){
+        __mmask64 mask = k - p >= 64 ? ~__mmask64{0} : (__mmask64{1} << (k - p)) - 1;
+        __m512i x = _mm512_maskz_loadu_epi8(mask, a + p);
+#pragma GCC unroll 4
+        for(size_t r = 0; r != Rows; r++){
+            acc[r] = _mm512_dpbusd_epi32(acc[r], x, _mm512_load_si512(b + r * ldb + p));
+        }
+    }
+#pragma GCC unroll 4
+    for(size_t r = 0; r != Rows; r++){
+        c[r] = _mm512_reduce_add_epi32(acc[r]);
+    }
+}
+
+template <void (*Dot)(size_t, uint8_t const*, int8_t const*, size_t, int32_t*),
+          void (*Tail)(size_t, uint8_t const*, int8_t const*, size_t, int32_t*)>
+void qgemm_rows(size_t m, size_t n, size_t k, uint8_t const* a, size_t lda,
+                int8_t const* b, size_t ldb, int32_t* c, size_t ldc){
+    for(size_t i = 0; i != m; i++){
+        size_t j = 0;
+        for(; j + RB <= n; j += RB){
+            Dot(k, a + i * lda, b + j * ldb, ldb, c + i * ldc + j);
+        }
+        for(; j != n; j++){
+            Tail(k, a + i * lda, b + j * ldb, ldb, c + i * ldc + j);
+        }
+    }
+}
+#endif
+
+using QgemmFn = void (*)(size_t, size_t, size_t, uint8_t const*, size_t, int8_t const*, size_t, int32_t*, size_t);
+
+struct QgemmKernel{
+    QgemmFn fn;
+    char const* name;
+};
+
+QgemmKernel select_kernel(){
+    char const* requested = std::getenv("NN_QGEMM");
+    auto allowed = [requested](char const* name){
+        return requested == nullptr || std::strcmp(requested, name) == 0;
+    };
+
+#ifdef NN_QGEMM_X86
+    __builtin_cpu_init();
+    if(allowed("vnni") && __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")){
+        return {&qgemm_rows<dot_vnni<RB>, dot_vnni<1>>, "vnni"};
+    }
+    if(allowed("avx2") && __builtin_cpu_supports("avx2")){
+        return {&qgemm_rows<dot_avx2<RB>, dot_avx2<1>>, "avx2"};
+    }
+#endif
+    (void)allowed;
+    return {&qgemm_generic, "generic"};
+}
+
+QgemmKernel const& kernel(){
+    static QgemmKernel const selected = select_kernel();
+    return selected;
+}
+
+} // namespace
+
+void qgemm(size_t m, size_t n, size_t k,
+           uint8_t const* a, size_t lda,
+           int8_t const* b, size_t ldb,
+           int32_t* c, size_t ldc){
+    kernel().fn(m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+char const* qgemm_kernel_name() noexcept{
+    return kernel().name;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Integer matrix multiplication used by quantized inference (see Model::quantize).
+// The dot products of unsigned 8-bit activations with signed 8-bit weights are accumulated
+// exactly in 32 bits. The kernel is selected once at runtime from the features of the host CPU:
+// AVX-512 VNNI (vpdpbusd), AVX2, or a portable fallback. All of them produce identical results.
+
+// Weight rows are zero-padded to a multiple of this many bytes
+constexpr size_t QGEMM_ALIGN = 64;
+
+// C = A * B^T, where A is an unsigned m x k matrix, B a signed n x k matrix and C an int32 m x n
+// matrix, all row-major. lda and ldc are the row strides of A and C. The rows of B must be
+// cache-line aligned and zero-padded to ldb, a multiple of QGEMM_ALIGN; A needs neither.
+void qgemm(size_t m, size_t n, size_t k,
+           uint8_t const* a, size_t lda,
+           int8_t const* b, size_t ldb,
+           int32_t* c, size_t ldc);
+
+// Name of the kernel selected for this CPU (for diagnostics and benchmarks)
+char const* qgemm_kernel_name() noexcept;
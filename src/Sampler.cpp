@@ -0,0 +1,68 @@
+#include "Sampler.h"
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+namespace{
+constexpr size_t CACHED_EPOCHS = 3;
+} // namespace
+
+Sampler::Sampler(size_t dataset_size, size_t batch_size, uint32_t seed, bool shuffle)
+    : dataset_size_{dataset_size}, batch_size_{batch_size}, seed_{seed}, shuffle_{shuffle}{
+    if(dataset_size_ == 0 || batch_size_ == 0){
+        throw std::runtime_error{"Sampler requires a non-empty dataset and batch size"};
+    }
+}
+
+size_t Sampler::batch(size_t sequence, size_t* indices) const{
+    size_t epoch = sequence / batches_per_epoch();
+    size_t first = (sequence % batches_per_epoch()) * batch_size_;
+    size_t count = std::min(batch_size_, dataset_size_ - first);
+
+    if(!shuffle_){
+        std::iota(indices, indices + count, first);
+        return count;
+    }
+
+    std::shared_ptr<Permutation const> order = permutation(epoch);
+    for(size_t i = 0; i != count; i++){
+        indices[i] = (*order)[first + i];
+    }
+    return count;
+}
+
+std::shared_ptr<Sampler::Permutation const> Sampler::permutation(size_t epoch) const{
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for(auto const& [cached_epoch, order] : cache_){
+            if(cached_epoch == epoch){
+                return order;
+            }
+        }
+    }
+
+    // Fisher-Yates shuffle driven directly by mt19937 so the order only depends on the seed and
+    // the epoch, not on the standard library's distribution implementations
+    std::seed_seq seq{seed_, static_cast<uint32_t>(epoch), static_cast<uint32_t>(uint64_t{epoch} >> 32)};
+    std::mt19937 rne{seq};
+    auto order = std::make_shared<Permutation>(dataset_size_);
+    std::iota(order->begin(), order->end(), uint32_t{0});
+    for(size_t i = dataset_size_ - 1; i > 0; i--){
+        size_t j = static_cast<size_t>((uint64_t{rne()} * (i + 1)) >> 32);
+        std::swap((*order)[i], (*order)[j]);
+    }
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    for(auto const& [cached_epoch, cached] : cache_){
+        // Another thread generated the same epoch in the meantime
+        if(cached_epoch == epoch){
+            return cached;
+        }
+    }
+    if(cache_.size() == CACHED_EPOCHS){
+        cache_.erase(cache_.begin());
+    }
+    cache_.emplace_back(epoch, order);
+    return order;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Epoch-driven sampling order. Every epoch visits each sample of the dataset exactly once, in an
+// order given by a permutation generated from the seed and the epoch number, so a run is fully
+// reproducible from its seed. Batches are numbered globally: batch k belongs to epoch
+// k / batches_per_epoch(), and the last batch of an epoch may be smaller than the batch size.
+class Sampler{
+public:
+    // With shuffle disabled every epoch visits the samples in dataset order
+    Sampler(size_t dataset_size, size_t batch_size, uint32_t seed, bool shuffle = true);
+
+    size_t batches_per_epoch() const noexcept{
+        return (dataset_size_ + batch_size_ - 1) / batch_size_;
+    }
+
+    size_t batch_size() const noexcept{
+        return batch_size_;
+    }
+
+    uint32_t seed() const noexcept{
+        return seed_;
+    }
+
+    // Write the dataset indices of the given batch (at most batch_size()) and return their
+    // count. Safe to call from several threads.
+    size_t batch(size_t sequence, size_t* indices) const;
+
+private:
+    using Permutation = std::vector<uint32_t>;
+
+    std::shared_ptr<Permutation const> permutation(size_t epoch) const;
+
+    size_t dataset_size_;
+    size_t batch_size_;
+    uint32_t seed_;
+    bool shuffle_;
+
+    // The permutations of the most recently used epochs (consumers straddle at most a couple)
+    mutable std::mutex mutex_;
+    mutable std::vector<std::pair<size_t, std::shared_ptr<Permutation const>>> cache_;
+};
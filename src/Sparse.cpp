@@ -0,0 +1,476 @@
+#include "Sparse.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define NN_SPARSE_X86 1
+#endif
+
+namespace{
+
+// Compression kernels write the entries of one row of x starting at indices/values and return
+// how many are non-zero. They may write up to SLACK entries past the last one kept
+constexpr size_t SLACK = 16;
+
+// The columns are numbered from first
+size_t compress_scalar(float const* x, size_t cols, uint32_t* indices, float* values, size_t first){
+    size_t count = 0;
+    for(size_t j = 0; j != cols; j++){
+        // Every entry is written and only kept if it is non-zero, so there is no branch to mispredict
+        indices[count] = static_cast<uint32_t>(first + j);
+        values[count] = x[j];
+        count += x[j] != 0.0f;
+    }
+    return count;
+}
+
+size_t compress_generic(float const* x, size_t cols, uint32_t* indices, float* values){
+    return compress_scalar(x, cols, indices, values, 0);
+}
+
+#ifdef NN_SPARSE_X86
+// The non-zero lanes of each vector are packed to the front (vcompressps) and the whole vector
+// is stored, so 16 entries are scanned per step
+__attribute__((target("avx512f")))
+size_t compress_avx512(float const* x, size_t cols, uint32_t* indices, float* values){
+    __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i const step = _mm512_set1_epi32(16);
+    size_t count = 0;
+    for(size_t j = 0; j < cols; j += 16){
+        __mmask16 valid = cols - j >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << (cols - j)) - 1);
+        __m512 v = _mm512_maskz_loadu_ps(valid, x + j);
+        __mmask16 nonzero = _mm512_mask_cmp_ps_mask(valid, v, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+        _mm512_storeu_ps(values + count, _mm512_maskz_compress_ps(nonzero, v));
+        _mm512_storeu_si512(indices + count, _mm512_maskz_compress_epi32(nonzero, index));
+        count += static_cast<size_t>(__builtin_popcount(nonzero));
+        index = _mm512_add_epi32(index, step);
+    }
+    return count;
+}
+#endif
+
+void gemm_generic(SparseRows const& x, float const* weights_t, size_t ldw, size_t n, float* z, size_t ldz){
+    for(size_t r = 0; r != x.rows(); r++){
+        float* zr = z + r * ldz;
+        std::fill(zr, zr + n, 0.0f);
+        for(size_t e = x.starts[r]; e != x.starts[r + 1]; e++){
+            float v = x.values[e];
+            float const* row = weights_t + x.indices[e] * ldw;
+            for(size_t j = 0; j != n; j++){
+                zr[j] += v * row[j];
+            }
+        }
+    }
+}
+
+void outer_generic(SparseRows const& x, float const* dz, size_t ldz, size_t n, float* gradients_t, size_t ldg){
+    for(size_t r = 0; r != x.rows(); r++){
+        float const* g = dz + r * ldz;
+        for(size_t e = x.starts[r]; e != x.starts[r + 1]; e++){
+            float v = x.values[e];
+            float* row = gradients_t + x.indices[e] * ldg;
+            for(size_t j = 0; j != n; j++){
+                row[j] += v * g[j];
+            }
+        }
+    }
+}
+
+#ifdef NN_SPARSE_X86
+// AVX2 has no compressing store: the 8-bit mask of non-zero lanes selects a permutation that
+// moves those lanes to the front
+struct CompressTable{
+    alignas(32) uint32_t lanes[256][8];
+
+    CompressTable(){
+        for(uint32_t mask = 0; mask != 256; mask++){
+            uint32_t count = 0;
+            for(uint32_t lane = 0; lane != 8; lane++){
+                if(mask & (1u << lane)){
+                    lanes[mask][count++] = lane;
+                }
+            }
+            while(count != 8){
+                lanes[mask][count++] = 0;
+            }
+        }
+    }
+};
+
+CompressTable const compress_table;
+
+__attribute__((target("avx2")))
+size_t compress_avx2(float const* x, size_t cols, uint32_t* indices, float* values){
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i const step = _mm256_set1_epi32(8);
+    size_t count = 0;
+    size_t j = 0;
+    for(; j + 8 <= cols; j += 8){
+        __m256 v = _mm256_loadu_ps(x + j);
+        auto mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_NEQ_UQ)));
+        __m256i lanes = _mm256_load_si256(reinterpret_cast<__m256i const*>(compress_table.lanes[mask]));
+        _mm256_storeu_ps(values + count, _mm256_permutevar8x32_ps(v, lanes));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(indices + count), _mm256_permutevar8x32_epi32(index, lanes));
+        count += static_cast<size_t>(__builtin_popcount(mask));
+        index = _mm256_add_epi32(index, step);
+    }
+    return count + compress_scalar(x + j, cols - j, indices + count, values + count, j);
+}
+
+// The SIMD kernels work on column blocks of up to two vectors, so each non-zero entry's index and
+// value are loaded once for 16 (AVX2) or 32 (AVX-512) columns. The padding of the transposed rows
+// lets a block read and write whole vectors
+template <size_t V>
+__attribute__((target("avx2,fma")))
+void gemm_block_avx2(SparseRows const& x, size_t r, float const* weights_t, size_t ldw, size_t width, float* zr){
+    uint32_t const* indices = x.indices.data();
+    float const* values = x.values.data();
+    size_t begin = x.starts[r];
+    size_t end = x.starts[r + 1];
+    __m256 acc[2][V];
+    for(size_t u = 0; u != 2; u++){
+        for(size_t k = 0; k != V; k++){
+            acc[u][k] = _mm256_setzero_ps();
+        }
+    }
+    size_t e = begin;
+    for(; e + 2 <= end; e += 2){
+#pragma GCC unroll 2
+        for(size_t u = 0; u != 2; u++){
+            __m256 v = _mm256_broadcast_ss(values + e + u);
+            float const* row = weights_t + indices[e + u] * ldw;
+            for(size_t k = 0; k != V; k++){
+                acc[u][k] = _mm256_fmadd_ps(v, _mm256_loadu_ps(row + 8 * k), acc[u][k]);
+            }
+        }
+    }
+    if(e != end){
+        __m256 v = _mm256_broadcast_ss(values + e);
+        float const* row = weights_t + indices[e] * ldw;
+        for(size_t k = 0; k != V; k++){
+            acc[0][k] = _mm256_fmadd_ps(v, _mm256_loadu_ps(row + 8 * k), acc[0][k]);
+        }
+    }
+    alignas(32) float sum[8 * V];
+    for(size_t k = 0; k != V; k++){
+        _mm256_store_ps(sum + 8 * k, _mm256_add_ps(acc[0][k], acc[1][k]));
+    }
+    std::copy(sum, sum + width, zr);
+}
+
+__attribute__((target("avx2,fma")))
+void gemm_avx2(SparseRows const& x, float const* weights_t, size_t ldw, size_t n, float* z, size_t ldz){
+    for(size_t r = 0; r != x.rows(); r++){
+        for(size_t j0 = 0; j0 < n; j0 += 16){
+            size_t width = std::min(n - j0, size_t{16});
+            if(width > 8){
+                gemm_block_avx2<2>(x, r, weights_t + j0, ldw, width, z + r * ldz + j0);
+            }else{
+                gemm_block_avx2<1>(x, r, weights_t + j0, ldw, width, z + r * ldz + j0);
+            }
+        }
+    }
+}
+
+template <size_t V>
+__attribute__((target("avx2,fma")))
+void outer_block_avx2(SparseRows const& x, size_t r, float const* dz, size_t width, float* gradients_t, size_t ldg){
+    uint32_t const* indices = x.indices.data();
+    float const* values = x.values.data();
+    // The padding columns of G^T receive zeros
+    alignas(32) float chunk[8 * V] = {};
+    std::copy(dz, dz + width, chunk);
+    __m256 g[V];
+    for(size_t k = 0; k != V; k++){
+        g[k] = _mm256_load_ps(chunk + 8 * k);
+    }
+    for(size_t e = x.starts[r]; e != x.starts[r + 1]; e++){
+        __m256 v = _mm256_broadcast_ss(values + e);
+        float* row = gradients_t + indices[e] * ldg;
+        for(size_t k = 0; k != V; k++){
+            _mm256_storeu_ps(row + 8 * k, _mm256_fmadd_ps(v, g[k], _mm256_loadu_ps(row + 8 * k)));
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void outer_avx2(SparseRows const& x, float const* dz, size_t ldz, size_t n, float* gradients_t, size_t ldg){
+    for(size_t r = 0; r != x.rows(); r++){
+        for(size_t j0 = 0; j0 < n; j0 += 16){
+            size_t width = std::min(n - j0, size_t{16});
+            if(width > 8){
+                outer_block_avx2<2>(x, r, dz + r * ldz + j0, width, gradients_t + j0, ldg);
+            }else{
+                outer_block_avx2<1>(x, r, dz + r * ldz + j0, width, gradients_t + j0, ldg);
+            }
+        }
+    }
+}
+
+// Lanes of the last vector of a block of width columns
+inline __mmask16 tail_mask(size_t width){
+    return width % 16 == 0 ? __mmask16(0xFFFF) : __mmask16((1u << (width % 16)) - 1);
+}
+
+template <size_t V>
+__attribute__((target("avx512f")))
+void gemm_block_avx512(SparseRows const& x, size_t r, float const* weights_t, size_t ldw, size_t width, float* zr){
+    uint32_t const* indices = x.indices.data();
+    float const* values = x.values.data();
+    size_t begin = x.starts[r];
+    size_t end = x.starts[r + 1];
+    __m512 acc[2][V];
+    for(size_t u = 0; u != 2; u++){
+        for(size_t k = 0; k != V; k++){
+            acc[u][k] = _mm512_setzero_ps();
+        }
+    }
+    size_t e = begin;
+    for(; e + 2 <= end; e += 2){
+#pragma GCC unroll 2
+        for(size_t u = 0; u != 2; u++){
+            __m512 v = _mm512_set1_ps(values[e + u]);
+            float const* row = weights_t + indices[e + u] * ldw;
+            for(size_t k = 0; k != V; k++){
+                acc[u][k] = _mm512_fmadd_ps(v, _mm512_loadu_ps(row + 16 * k), acc[u][k]);
+            }
+        }
+    }
+    if(e != end){
+        __m512 v = _mm512_set1_ps(values[e]);
+        float const* row = weights_t + indices[e] * ldw;
+        for(size_t k = 0; k != V; k++){
+            acc[0][k] = _mm512_fmadd_ps(v, _mm512_loadu_ps(row + 16 * k), acc[0][k]);
+        }
+    }
+    for(size_t k = 0; k + 1 < V; k++){
+        _mm512_storeu_ps(zr + 16 * k, _mm512_add_ps(acc[0][k], acc[1][k]));
+    }
+    _mm512_mask_storeu_ps(zr + 16 * (V - 1), tail_mask(width), _mm512_add_ps(acc[0][V - 1], acc[1][V - 1]));
+}
+
+__attribute__((target("avx512f")))
+void gemm_avx512(SparseRows const& x, float const* weights_t, size_t ldw, size_t n, float* z, size_t ldz){
+    for(size_t r = 0; r != x.rows(); r++){
+        for(size_t j0 = 0; j0 < n; j0 += 32){
+            size_t width = std::min(n - j0, size_t{32});
+            if(width > 16){
+                gemm_block_avx512<2>(x, r, weights_t + j0, ldw, width, z + r * ldz + j0);
+            }else{
+                gemm_block_avx512<1>(x, r, weights_t + j0, ldw, width, z + r * ldz + j0);
+            }
+        }
+    }
+}
+
+template <size_t V>
+__attribute__((target("avx512f")))
+void outer_block_avx512(SparseRows const& x, size_t r, float const* dz, size_t width, float* gradients_t, size_t ldg){
+    uint32_t const* indices = x.indices.data();
+    float const* values = x.values.data();
+    // The padding columns of G^T receive zeros
+    __m512 g[V];
+    for(size_t k = 0; k + 1 < V; k++){
+        g[k] = _mm512_loadu_ps(dz + 16 * k);
+    }
+    g[V - 1] = _mm512_maskz_loadu_ps(tail_mask(width), dz + 16 * (V - 1));
+    for(size_t e = x.starts[r]; e != x.starts[r + 1]; e++){
+        __m512 v = _mm512_set1_ps(values[e]);
+        float* row = gradients_t + indices[e] * ldg;
+        for(size_t k = 0; k != V; k++){
+            _mm512_storeu_ps(row + 16 * k, _mm512_fmadd_ps(v, g[k], _mm512_loadu_ps(row + 16 * k)));
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void outer_avx512(SparseRows const& x, float const* dz, size_t ldz, size_t n, float* gradients_t, size_t ldg){
+    for(size_t r = 0; r != x.rows(); r++){
+        for(size_t j0 = 0; j0 < n; j0 += 32){
+            size_t width = std::min(n - j0, size_t{32});
+            if(width > 16){
+                outer_block_avx512<2>(x, r, dz + r * ldz + j0, width, gradients_t + j0, ldg);
+            }else{
+                outer_block_avx512<1>(x, r, dz + r * ldz + j0, width, gradients_t + j0, ldg);
+            }
+        }
+    }
+}
+
+// One 8 x 8 block in registers
+__attribute__((target("avx2")))
+void transpose_8x8_avx2(float const* src, size_t lds, float* dst, size_t ldd, bool accumulate){
+    __m256 r[8];
+    __m256 t[8];
+    for(size_t i = 0; i != 8; i++){
+        r[i] = _mm256_loadu_ps(src + i * lds);
+    }
+    for(size_t i = 0; i != 4; i++){
+        t[2 * i] = _mm256_unpacklo_ps(r[2 * i], r[2 * i + 1]);
+        t[2 * i + 1] = _mm256_unpackhi_ps(r[2 * i], r[2 * i + 1]);
+    }
+    for(size_t i = 0; i != 2; i++){
+        r[4 * i] = _mm256_shuffle_ps(t[4 * i], t[4 * i + 2], 0x44);
+        r[4 * i + 1] = _mm256_shuffle_ps(t[4 * i], t[4 * i + 2], 0xEE);
+        r[4 * i + 2] = _mm256_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0x44);
+        r[4 * i + 3] = _mm256_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0xEE);
+    }
+    for(size_t k = 0; k != 4; k++){
+        t[k] = _mm256_permute2f128_ps(r[k], r[4 + k], 0x20);
+        t[4 + k] = _mm256_permute2f128_ps(r[k], r[4 + k], 0x31);
+    }
+    for(size_t i = 0; i != 8; i++){
+        float* row = dst + i * ldd;
+        _mm256_storeu_ps(row, accumulate ? _mm256_add_ps(_mm256_loadu_ps(row), t[i]) : t[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+void transpose_avx2(float const* src, size_t lds, float* dst, size_t ldd, bool accumulate){
+    for(size_t i = 0; i != 16; i += 8){
+        for(size_t j = 0; j != 16; j += 8){
+            transpose_8x8_avx2(src + i * lds + j, lds, dst + j * ldd + i, ldd, accumulate);
+        }
+    }
+}
+
+// One 16 x 16 block in registers: pairs of rows are interleaved at 1, 2, 4 and 8 element granularity
+__attribute__((target("avx512f")))
+void transpose_avx512(float const* src, size_t lds, float* dst, size_t ldd, bool accumulate){
+    __m512 r[16];
+    __m512 t[16];
+    for(size_t i = 0; i != 16; i++){
+        r[i] = _mm512_loadu_ps(src + i * lds);
+    }
+    for(size_t i = 0; i != 8; i++){
+        t[2 * i] = _mm512_unpacklo_ps(r[2 * i], r[2 * i + 1]);
+        t[2 * i + 1] = _mm512_unpackhi_ps(r[2 * i], r[2 * i + 1]);
+    }
+    for(size_t i = 0; i != 4; i++){
+        r[4 * i] = _mm512_shuffle_ps(t[4 * i], t[4 * i + 2], 0x44);
+        r[4 * i + 1] = _mm512_shuffle_ps(t[4 * i], t[4 * i + 2], 0xEE);
+        r[4 * i + 2] = _mm512_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0x44);
+        r[4 * i + 3] = _mm512_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0xEE);
+    }
+    for(size_t i = 0; i != 2; i++){
+        for(size_t k = 0; k != 4; k++){
+            t[8 * i + k] = _mm512_shuffle_f32x4(r[8 * i + k], r[8 * i + 4 + k], 0x88);
+            t[8 * i + 4 + k] = _mm512_shuffle_f32x4(r[8 * i + k], r[8 * i + 4 + k], 0xDD);
+        }
+    }
+    for(size_t k = 0; k != 8; k++){
+        r[k] = _mm512_shuffle_f32x4(t[k], t[8 + k], 0x88);
+        r[8 + k] = _mm512_shuffle_f32x4(t[k], t[8 + k], 0xDD);
+    }
+    for(size_t i = 0; i != 16; i++){
+        float* row = dst + i * ldd;
+        _mm512_storeu_ps(row, accumulate ? _mm512_add_ps(_mm512_loadu_ps(row), r[i]) : r[i]);
+    }
+}
+#endif
+
+using CompressFn = size_t (*)(float const*, size_t, uint32_t*, float*);
+using GemmFn = void (*)(SparseRows const&, float const*, size_t, size_t, float*, size_t);
+using OuterFn = void (*)(SparseRows const&, float const*, size_t, size_t, float*, size_t);
+using TransposeFn = void (*)(float const*, size_t, float*, size_t, bool);
+
+struct SparseKernel{
+    CompressFn compress;
+    GemmFn gemm;
+    OuterFn outer;
+    // Transposes a full 16 x 16 block, null where the scalar loops are used
+    TransposeFn transpose;
+    char const* name;
+};
+
+SparseKernel select_kernel(){
+    char const* requested = std::getenv("NN_SPARSE");
+    auto allowed = [requested](char const* name){
+        return requested == nullptr || std::strcmp(requested, name) == 0;
+    };
+
+#ifdef NN_SPARSE_X86
+    __builtin_cpu_init();
+    if(allowed("avx512") && __builtin_cpu_supports("avx512f")){
+        return {&compress_avx512, &gemm_avx512, &outer_avx512, &transpose_avx512, "avx512"};
+    }
+    if(allowed("avx2") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        return {&compress_avx2, &gemm_avx2, &outer_avx2, &transpose_avx2, "avx2"};
+    }
+#endif
+    (void)allowed;
+    return {&compress_generic, &gemm_generic, &outer_generic, nullptr, "generic"};
+}
+
+SparseKernel const& kernel(){
+    static SparseKernel const selected = select_kernel();
+    return selected;
+}
+
+} // namespace
+
+bool compress_rows(float const* x, size_t rows, size_t cols, float max_density, SparseRows& sparse){
+    size_t budget = static_cast<size_t>(max_density * static_cast<float>(rows * cols));
+    // A row is only compressed while the budget is not yet exceeded, so at most one row goes past it
+    size_t capacity = budget + cols + SLACK;
+    if(sparse.values.size() < capacity){
+        sparse.indices.resize(capacity);
+        sparse.values.resize(capacity);
+    }
+    sparse.starts.resize(rows + 1);
+
+    CompressFn compress = kernel().compress;
+    size_t count = 0;
+    for(size_t r = 0; r != rows; r++){
+        if(count > budget){
+            return false;
+        }
+        sparse.starts[r] = count;
+        count += compress(x + r * cols, cols, sparse.indices.data() + count, sparse.values.data() + count);
+    }
+    sparse.starts[rows] = count;
+    return count <= budget;
+}
+
+void sparse_gemm(SparseRows const& x, float const* weights_t, size_t ldw, size_t n, float* z, size_t ldz){
+    kernel().gemm(x, weights_t, ldw, n, z, ldz);
+}
+
+void sparse_outer(SparseRows const& x, float const* dz, size_t ldz, size_t n, float* gradients_t, size_t ldg){
+    kernel().outer(x, dz, ldz, n, gradients_t, ldg);
+}
+
+void transpose(float const* src, size_t rows, size_t cols, size_t lds,
+               float* dst, size_t ldd, bool accumulate){
+    // Square tiles keep both the rows read and the rows written in L1
+    constexpr size_t TILE = 16;
+    TransposeFn block = kernel().transpose;
+    for(size_t i0 = 0; i0 < rows; i0 += TILE){
+        size_t i1 = std::min(i0 + TILE, rows);
+        for(size_t j0 = 0; j0 < cols; j0 += TILE){
+            size_t j1 = std::min(j0 + TILE, cols);
+            if(block != nullptr && i1 - i0 == TILE && j1 - j0 == TILE){
+                block(src + i0 * lds + j0, lds, dst + j0 * ldd + i0, ldd, accumulate);
+                continue;
+            }
+            for(size_t j = j0; j != j1; j++){
+                float* d = dst + j * ldd;
+                if(accumulate){
+                    for(size_t i = i0; i != i1; i++){
+                        d[i] += src[i * lds + j];
+                    }
+                }else{
+                    for(size_t i = i0; i != i1; i++){
+                        d[i] = src[i * lds + j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+char const* sparse_kernel_name() noexcept{
+    return kernel().name;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include "Aligned.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// Kernels for dense layers whose inputs are mostly zero, such as the pixels of MNIST digits
+// (about 80% background). The batch of inputs is compressed row by row to its non-zero entries
+// and only the weight columns of those entries are read in the forward pass and updated in the
+// weight-gradient pass. Both use the weights (and their gradients) transposed, [in x out], so
+// that the column of an input is one contiguous row.
+
+// The transposed matrices have a row stride that is a multiple of this many floats
+constexpr size_t SPARSE_ALIGN = 16;
+
+// Densities (fractions of non-zero inputs) up to which the sparse kernels beat the dense GEMMs in
+// a feedforward layer with the given number of outputs, measured with bench/sparse_bench for 16
+// to 128 outputs. The sparse kernels touch a row of outputs floats per non-zero input while the
+// GEMMs get more efficient as the layer widens, so the crossovers fall with the width, about as
+// 1 / sqrt(outputs); they are capped at the values measured for narrow layers. The forward pass
+// gains more, as W is read but not written
+inline float sparse_forward_density(size_t outputs) noexcept{
+    return std::min(0.3f, 0.3f * std::sqrt(32.0f / static_cast<float>(std::max<size_t>(outputs, 1))));
+}
+
+inline float sparse_gradient_density(size_t outputs) noexcept{
+    return std::min(0.2f, 0.2f * std::sqrt(32.0f / static_cast<float>(std::max<size_t>(outputs, 1))));
+}
+
+// The non-zero entries of a [rows x cols] matrix: the entries of row r are
+// values[starts[r] .. starts[r + 1]) in the columns indices[starts[r] .. starts[r + 1])
+struct SparseRows{
+    std::vector<size_t> starts;
+    aligned_vector<uint32_t> indices;
+    aligned_vector<float> values;
+
+    size_t rows() const noexcept{
+        return starts.empty() ? 0 : starts.size() - 1;
+    }
+};
+
+// Compresses the [rows x cols] matrix x into sparse, unless more than max_density of its entries
+// are non-zero, where the dense product is faster. Returns whether x was compressed; the scan
+// stops as soon as the budget of non-zero entries is exceeded
+bool compress_rows(float const* x, size_t rows, size_t cols, float max_density, SparseRows& sparse);
+
+// Z = X * W^T for a compressed X, with W^T the [cols x n] transposed weights (row stride ldw, a
+// multiple of SPARSE_ALIGN, padding readable). Z is [rows x n] with row stride ldz and is overwritten
+void sparse_gemm(SparseRows const& x, float const* weights_t, size_t ldw, size_t n, float* z, size_t ldz);
+
+// G^T += X^T * dZ for a compressed X and the [rows x n] dZ (row stride ldz). Only the rows of the
+// transposed gradients G^T ([cols x n], row stride ldg) of non-zero columns of X are touched
+void sparse_outer(SparseRows const& x, float const* dz, size_t ldz, size_t n, float* gradients_t, size_t ldg);
+
+// dst = src^T, or dst += src^T when accumulating, for a [rows x cols] src
+void transpose(float const* src, size_t rows, size_t cols, size_t lds,
+               float* dst, size_t ldd, bool accumulate);
+
+// Name of the kernels selected for this CPU (for diagnostics and benchmarks)
+char const* sparse_kernel_name() noexcept;
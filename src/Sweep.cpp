@@ -0,0 +1,77 @@
+#include "Sweep.h"
+#include "Evaluator.h"
+#include "Profiler.h"
+#include "Sampler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+#include <stdexcept>
+
+Sweep::Sweep(ThreadPool& pool, IDXDataset const& training, IDXDataset const* test)
+    : pool_{pool}, training_{training}, test_{test}{}
+
+void Sweep::run(vector<Trial>& trials, size_t epochs, uint32_t seed){
+    for(Trial& trial : trials){
+        if(trial.batch_size == 0 || !trial.optimizer){
+            throw runtime_error{"Every trial of a sweep needs an optimizer and a non-zero batch size"};
+        }
+    }
+
+    // The largest models start first, so the pool does not end up waiting for a large trial
+    // started last while the other threads are idle
+    vector<size_t> order(trials.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){
+        return trials[a].replica.model.parameters().size > trials[b].replica.model.parameters().size;
+    });
+
+    pool_.run(order.size(), [&](size_t t){ run(trials[order[t]], epochs, seed); });
+}
+
+void Sweep::run(Trial& trial, size_t epochs, uint32_t seed){
+    auto start = std::chrono::steady_clock::now();
+    Replica& replica = trial.replica;
+    replica.model.init(seed);
+    Sampler sampler{training_.size(), trial.batch_size, seed};
+
+    BatchBuffers buffers{trial.batch_size, training_.image_size()};
+    replica.loss->set_target(buffers.labels.data(), buffers.label_index.data());
+
+    size_t batches = epochs * sampler.batches_per_epoch();
+    for(size_t sequence = 0; sequence != batches; sequence++){
+        // The scores cover the last epoch only
+        if(sequence % sampler.batches_per_epoch() == 0){
+            replica.loss->reset_score();
+        }
+        size_t size = sampler.batch(sequence, buffers.indices.data());
+        training_.gather(buffers.indices.data(), size, buffers.data.data(), buffers.labels.data(),
+                         buffers.label_index.data());
+        replica.loss->set_step_size(size);
+        replica.model.forward(buffers.data.data(), size);
+        replica.model.reverse();
+        replica.model.train(*trial.optimizer);
+    }
+
+    TrialResult& result = trial.result;
+    result.batches = batches;
+    if(batches != 0){
+        result.train_loss = replica.loss->avg_loss();
+        result.train_accuracy = replica.loss->accuracy();
+    }
+
+    if(test_ != nullptr){
+        // An evaluator of its own, running inline on this task's thread
+        ThreadPool inline_pool{1};
+        vector<Replica> replicas;
+        replicas.push_back(std::move(trial.replica));
+        {
+            Evaluator evaluator{replicas, inline_pool, *test_, 1000};
+            evaluator.run();
+            result.test_loss = evaluator.primary().loss->avg_loss();
+            result.test_accuracy = evaluator.primary().loss->accuracy();
+        }
+        trial.replica = std::move(replicas.front());
+    }
+    result.seconds = profile::seconds_since(start);
+}
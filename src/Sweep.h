@@ -0,0 +1,52 @@
+#pragma once
+
+#include "DataParallelTrainer.h"
+#include "IDXDataset.h"
+#include "ThreadPool.h"
+#include <limits>
+
+// Outcome of training one model of a sweep
+struct TrialResult{
+    // Over the last training epoch
+    float train_loss{std::numeric_limits<float>::quiet_NaN()};
+    float train_accuracy{std::numeric_limits<float>::quiet_NaN()};
+    // Over the test set, NaN without one
+    float test_loss{std::numeric_limits<float>::quiet_NaN()};
+    float test_accuracy{std::numeric_limits<float>::quiet_NaN()};
+    size_t batches{0};
+    double seconds{0.0};
+};
+
+// One model of a sweep with an optimizer of its own, trained on batches of batch_size samples.
+// The model must have been built for batches of that size
+struct Trial{
+    Replica replica;
+    unique_ptr<Optimizer> optimizer;
+    size_t batch_size;
+    TrialResult result;
+};
+
+// Concurrent training of many independent models on one dataset, e.g. to compare
+// hyperparameters. A single small model cannot keep several cores busy, but many of them can:
+// each trial is one task on the thread pool, which trains its model with its own optimizer and
+// sampler, assembling batches from the shared read-only dataset into buffers of its own, and then
+// scores it on the test set. Nothing is shared between the tasks but the datasets, so the trials
+// need no synchronization, and every trial's result depends only on its own settings and the
+// seed, whatever the number of threads.
+class Sweep{
+public:
+    // The datasets must outlive the sweep; test may be null
+    Sweep(ThreadPool& pool, IDXDataset const& training, IDXDataset const* test);
+
+    // Initialize the models of the trials from the seed and train each for the given number of
+    // epochs, then fill in their results. Every trial sees the samples in the order the seed gives
+    // for its batch size. The first exception thrown by a trial is rethrown once all have finished
+    void run(vector<Trial>& trials, size_t epochs, uint32_t seed);
+
+private:
+    void run(Trial& trial, size_t epochs, uint32_t seed);
+
+    ThreadPool& pool_;
+    IDXDataset const& training_;
+    IDXDataset const* test_;
+};
@@ -0,0 +1,85 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t threads){
+    for(size_t i = 1; i < threads; i++){
+        workers_.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stop_ = true;
+    }
+    start_.notify_all();
+    for(std::thread& worker : workers_){
+        worker.join();
+    }
+}
+
+void ThreadPool::run(size_t count, std::function<void(size_t)> const& task){
+    if(count == 0){
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        task_ = &task;
+        count_ = count;
+        next_.store(0, std::memory_order_relaxed);
+        active_ = workers_.size();
+        error_ = nullptr;
+        ++generation_;
+    }
+    start_.notify_all();
+
+    // The calling thread takes part in the work
+    drain();
+
+    std::unique_lock<std::mutex> lock{mutex_};
+    done_.wait(lock, [this]{ return active_ == 0; });
+    task_ = nullptr;
+
+    if(error_){
+        std::rethrow_exception(error_);
+    }
+}
+
+void ThreadPool::drain(){
+    while(true){
+        size_t i = next_.fetch_add(1, std::memory_order_relaxed);
+        if(i >= count_){
+            return;
+        }
+
+        try{
+            (*task_)(i);
+        }catch(...){
+            std::lock_guard<std::mutex> lock{mutex_};
+            if(!error_){
+                error_ = std::current_exception();
+            }
+        }
+    }
+}
+
+void ThreadPool::work(){
+    size_t seen = 0;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock{mutex_};
+            start_.wait(lock, [&]{ return stop_ || generation_ != seen; });
+            if(stop_){
+                return;
+            }
+            seen = generation_;
+        }
+
+        drain();
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        if(--active_ == 0){
+            done_.notify_one();
+        }
+    }
+}
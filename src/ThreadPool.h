@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size fork-join thread pool. run() executes a numbered set of tasks on the pool's threads
+// and the calling thread and returns once all of them have completed. Which thread executes a
+// task is unspecified, so results that must be deterministic should depend on the task index only.
+class ThreadPool{
+public:
+    // threads counts the calling thread, so a pool of size 1 runs everything inline
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    size_t size() const noexcept{
+        return workers_.size() + 1;
+    }
+
+    // Invoke task(i) for every i in [0, count). The first exception thrown by a task is
+    // rethrown here after all tasks have finished.
+    void run(size_t count, std::function<void(size_t)> const& task);
+
+private:
+    void work();
+    void drain();
+
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    // Incremented for every call to run() so sleeping workers know there is new work
+    size_t generation_ = 0;
+    bool stop_ = false;
+
+    std::function<void(size_t)> const* task_ = nullptr;
+    size_t count_ = 0;
+    std::atomic<size_t> next_{0};
+    // Workers still inside the current generation
+    size_t active_ = 0;
+    std::exception_ptr error_;
+
+    std::vector<std::thread> workers_;
+};
@@ -1,139 +1,688 @@
+#include "AdamOptimizer.h"
 #include "CCELossNode.h"
+#include "Checkpointer.h"
+#include "DataParallelTrainer.h"
+#include "Evaluator.h"
 #include "FFNode.h"
 #include "GDOptimizer.h"
+#include "HogwildTrainer.h"
+#include "ImageStream.h"
+#include "InferenceServer.h"
 #include "MNIST.h"
+#include "MomentumOptimizer.h"
+#include "QGEMM.h"
+#include "Prefetcher.h"
+#include "Profiler.h"
+#include "Sweep.h"
+#include "ThreadPool.h"
 #include "Model.h"
+#include <atomic>
 #include <cfenv>
+#include <chrono>
+#include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <numeric>
+#include <thread>
+#include <unistd.h>
 
 static constexpr size_t batch_size = 80;
 
-Model create_model(ifstream& images, ifstream& labels, MNIST** mnist, CCELossNode** loss){
+// Returns the value following the flag name in the arguments, or fallback if it is absent
+size_t option(int argc, char* argv[], char const* name, size_t fallback){
+    for(int i = 0; i + 1 < argc; i++){
+        if(strcmp(argv[i], name) == 0){
+            return strtoull(argv[i + 1], nullptr, 10);
+        }
+    }
+    return fallback;
+}
+
+// Returns the text following the flag name in the arguments, or fallback if it is absent
+char const* text_option(int argc, char* argv[], char const* name, char const* fallback){
+    for(int i = 0; i + 1 < argc; i++){
+        if(strcmp(argv[i], name) == 0){
+            return argv[i + 1];
+        }
+    }
+    return fallback;
+}
+
+// Returns the comma-separated items of the text following the flag name, or of fallback if it
+// is absent
+vector<string> list_option(int argc, char* argv[], char const* name, char const* fallback){
+    vector<string> items;
+    string text = text_option(argc, argv, name, fallback);
+    for(size_t begin = 0; begin <= text.size();){
+        size_t end = min(text.find(',', begin), text.size());
+        if(end != begin){
+            items.push_back(text.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return items;
+}
+
+// Returns whether the flag is present in the arguments
+bool flag(int argc, char* argv[], char const* name){
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], name) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+// Without a dataset the input node is only fed batches assembled elsewhere. output, if not null,
+// receives the layer producing the logits. hidden_size and batch are the width of the hidden layer
+// and the training batch size (varied by sweeps); a checkpoint loads only into a model with the
+// hidden size it was trained with
+Model create_model(IDXDataset const* dataset, MNIST** mnist, CCELossNode** loss, FFNode** output,
+                   size_t hidden_size = 32, size_t batch = batch_size){
     
     // Here we create a simple fully-cobbected feedforwrd neural network
     Model model{"ff"};
 
-    *mnist = &model.add_node<MNIST>(images, labels);
+    *mnist = dataset == nullptr ? &model.add_node<MNIST>(batch) : &model.add_node<MNIST>(*dataset, batch);
 
-    FFNode& hidden = model.add_node<FFNode>("hidden", Activation::ReLU, 32, 784);
+    FFNode& hidden = model.add_node<FFNode>("hidden", Activation::ReLU, static_cast<uint16_t>(hidden_size), 784);
 
-    FFNode& output = model.add_node<FFNode>("output", Activation::Softmax, 10, 32);
+    FFNode& logits = model.add_node<FFNode>("output", Activation::Softmax, 10, static_cast<uint16_t>(hidden_size));
+    if(output != nullptr){
+        *output = &logits;
+    }
 
-    *loss = &model.add_node<CCELossNode>("loss", 10, batch_size);
-    (*loss)->set_target((*mnist)->label());
+    *loss = &model.add_node<CCELossNode>("loss", 10, batch);
+    (*loss)->set_target((*mnist)->label(), (*mnist)->label_index());
 
-    // The structure of our compurational graph is completely sequential. In fact, the fully connected node
-    // and loss node we'he implemented here do not support multiple inputs. Consider adding nodes that
-    // support "skip" connections that forward outputs from earlier nodes to downstream nodes that aren't
-    // directly adjacent (such skip nodes are used in the ResNet architecture)
+    // The structure of our compurational graph is completely sequential. The model compiles the edges into
+    // an execution plan that sums the outputs of several antecedents, so "skip" connections that forward
+    // outputs from earlier nodes to downstream nodes that aren't directly adjacent (as used in the ResNet
+    // architecture) are just additional edges between nodes of equal output size
 
     model.create_edge(hidden, **mnist);
-    model.create_edge(output, hidden);
-    model.create_edge(**loss, output);
+    model.create_edge(logits, hidden);
+    model.create_edge(**loss, logits);
     return model;
 }
 
-void train(char* argv[]){
+// The learning rate of the optimizer of the given name (sgd, momentum or adam) if none is given
+float default_learning_rate(string const& name){
+    if(name == "sgd"){
+        return 0.3;
+    }else if(name == "momentum"){
+        return 0.05;
+    }else if(name == "adam"){
+        return 0.002;
+    }
+    throw runtime_error{"Unknown optimizer " + name};
+}
+
+unique_ptr<Optimizer> create_optimizer(string const& name, float rate){
+    if(name == "sgd"){
+        return make_unique<GDOptimizer>(rate);
+    }else if(name == "momentum"){
+        return make_unique<MomentumOptimizer>(rate);
+    }else if(name == "adam"){
+        return make_unique<AdamOptimizer>(rate);
+    }
+    throw runtime_error{"Unknown optimizer " + name};
+}
+
+// --profile <trace file> records where the time goes (see Profiler.h) and writes it as a Chrome
+// trace when done. It needs a build configured with -DNN_PROFILE=ON
+char const* start_profiling(int argc, char* argv[]){
+    char const* trace = text_option(argc, argv, "--profile", nullptr);
+    if(trace != nullptr){
+        if(!profile::COMPILED){
+            throw runtime_error{"--profile needs a build configured with -DNN_PROFILE=ON"};
+        }
+        profile::enable(true);
+    }
+    return trace;
+}
+
+void finish_profiling(char const* trace){
+    if(trace != nullptr){
+        profile::summary(stdout);
+        profile::write_trace(trace);
+        printf("Profile trace written to %s\n", trace);
+    }
+}
+
+// Print the size of the arena holding the activations and gradients of one model replica
+void report_memory(Model& model){
+    MemoryStats memory = model.memory();
+    printf("Intermediate buffers: %zu bytes peak for batches of %zu (%zu bytes without reuse)\n",
+           memory.peak_bytes, memory.batch, memory.total_bytes);
+}
+
+void train(int argc, char* argv[]){
     // Uncomment tot debug floating point instability in the network
     // feenableexcept(FE_INVALID | FE_OVERFLOW);
 
     printf("Executing training routine\n");
 
-    ifstream images{
+    // The dataset is memory mapped; samples are normalized straight from the mapped pages
+    IDXDataset dataset{
         std::filesystem::path{argv[0]} / "train-images-idx3-ubyte",
-        std::ios::binary
-    };
-
-    ifstream labels{
-        std::filesystem::path{argv[0]} / "train-labels-idx1-ubyte",
-        std::ios::binary
+        std::filesystem::path{argv[0]} / "train-labels-idx1-ubyte"
     };
+    printf("Loaded images file with %zu entries\n", dataset.size());
+
+    // With --threads N (default 1) the model is replicated N times. All replicas share the
+    // parameters of the first one and run concurrently: by default each batch is split across
+    // them, with --hogwild every replica trains on batches of its own and updates the shared
+    // parameters without any synchronization
+    size_t threads = max<size_t>(option(argc, argv, "--threads", 1), 1);
+    bool hogwild = flag(argc, argv, "--hogwild");
+    ThreadPool pool{threads};
+    vector<Replica> replicas;
+    for(size_t t = 0; t != threads; ++t){
+        MNIST* mnist;
+        CCELossNode* loss;
+        Model replica = create_model(&dataset, &mnist, &loss, nullptr);
+        replicas.push_back(Replica{std::move(replica), mnist, loss});
+    }
 
-    MNIST* mnist;
-    CCELossNode* loss;
-    Model model = create_model(images, labels, &mnist, &loss);
-
-    model.init();
+    // --bf16 stores the weights and activations used by the passes in bfloat16, while the
+    // optimizer updates float master weights. The final checkpoint is saved in bfloat16
+    if(flag(argc, argv, "--bf16")){
+        for(Replica& replica : replicas){
+            replica.model.set_precision(Precision::BFloat16);
+        }
+        printf("Precision: bfloat16\n");
+    }
+    Model& model = replicas.front().model;
+    CCELossNode* loss = replicas.front().loss;
 
     // The gradient descent optimizer is stateless, but other optimizers may not be.
     // Some optimizers need to track "momentum" or gradient histories.
     // Others may slow the learning rate for each parameter at different rates
-    // depending on various factors
+    // depending on various factors. --optimizer selects sgd (default), momentum or adam and
+    // --lr overrides the learning rate of the optimizer
+    string optimizer_name = text_option(argc, argv, "--optimizer", "sgd");
+    char const* lr = text_option(argc, argv, "--lr", nullptr);
+    float rate = lr == nullptr ? default_learning_rate(optimizer_name) : strtof(lr, nullptr);
+    unique_ptr<Optimizer> optimizer = create_optimizer(optimizer_name, rate);
+    // Stateful optimizers keep their state for one model and cannot be shared by racing threads
+    if(hogwild && optimizer_name != "sgd"){
+        throw runtime_error{"Hogwild training supports the sgd optimizer only"};
+    }
+    printf("Optimizer: %s\n", optimizer_name.c_str());
+
+    // --seed makes the run reproducible: it drives both the parameter initialization and the
+    // per-epoch sample order. Without it a random seed is chosen and reported. --resume instead
+    // continues the run saved in a checkpoint: the parameters, the optimizer's state, the seed and
+    // the position in the sample order are restored from it
+    size_t first = 0;
+    mt19937::result_type seed;
+    if(char const* resume = text_option(argc, argv, "--resume", nullptr)){
+        TrainingState state = model.resume(std::filesystem::path{resume}, *optimizer, true);
+        seed = state.seed;
+        first = state.next_batch;
+        printf("Resumed from %s at batch %zu with seed %u\n", resume, first, static_cast<unsigned>(seed));
+    }else{
+        seed = model.init(static_cast<mt19937::result_type>(option(argc, argv, "--seed", 0)));
+        printf("Initialized with seed %u\n", static_cast<unsigned>(seed));
+    }
 
-    GDOptimizer optimizer{float{0.3}};
+    // Here, the number of epochs (full passes over the shuffled training set) is fixed by
+    // --epochs (default 1). In practice, training should halt when the average loss begins
+    // to vascillate, indicating that the model is starting to overfit the data. Implement some
+    // form of loss-improvement measure to determine when this inflection point occurs and stop accordingly.
+    size_t epochs = option(argc, argv, "--epochs", 1);
+    Sampler sampler{dataset.size(), batch_size, static_cast<uint32_t>(seed)};
+
+    // With --checkpoint-every N the run is saved to <model name>.ckpt every N batches. The
+    // parameters are snapshotted and written in the background while training goes on
+    size_t every = option(argc, argv, "--checkpoint-every", 0);
+    unique_ptr<Checkpointer> checkpointer;
+    if(every != 0){
+        checkpointer = make_unique<Checkpointer>(model, *optimizer,
+                                                 std::filesystem::current_path() / (model.name() + ".ckpt"));
+    }
 
-    // Here, hardcoded the number of batched to train on. In practice, training should
-    // halt when the average loss begins to vascillate, indicating that the model is starting 
-    // to overfit the data. Implement some form of loss-improvement measure to determine when 
-    // this inflection point occurs and stop accordingly.
+    // When profiling, a summary line is printed every --profile-every batches (default 100)
+    char const* trace = start_profiling(argc, argv);
+    size_t profile_every = trace == nullptr ? 0 : max<size_t>(option(argc, argv, "--profile-every", 100), 1);
+    auto stop = [&](size_t i, size_t end){
+        size_t count = end - i;
+        for(size_t period : {every, profile_every}){
+            if(period != 0){
+                count = min(count, period - i % period);
+            }
+        }
+        return i + count;
+    };
+    auto report = [&](size_t i){
+        if(checkpointer && i % every == 0){
+            checkpointer->save(i, static_cast<uint32_t>(seed));
+        }
+        if(profile_every != 0 && i % profile_every == 0){
+            profile::summary(stdout);
+        }
+    };
 
-    size_t i = 0;
-    for(i=0; i!=256; ++i){
-        loss->reset_score();
-        for(size_t j = 0; j != batch_size; ++j){
-            mnist->forward();
-            loss->reverse();
+    size_t i = first;
+    if(hogwild){
+        printf("Hogwild training on %zu threads\n", threads);
+        HogwildTrainer trainer{replicas, pool, dataset, sampler};
+        for(size_t epoch = first / sampler.batches_per_epoch(); epoch < epochs; ++epoch){
+            trainer.reset_scores();
+            // The threads are joined at every checkpoint (and profile summary) so the snapshot sees
+            // no update in flight
+            size_t end = (epoch + 1) * sampler.batches_per_epoch();
+            while(i != end){
+                size_t next = stop(i, end);
+                trainer.train(i, next - i, *optimizer);
+                i = next;
+                report(i);
+            }
+
+            trainer.merge_scores();
+            printf("Epoch %zu: ", epoch + 1);
+            loss->print();
         }
-        model.train(optimizer);
+        printf("Run %zu batches (%zu samples each)\n", i - first, batch_size);
+    }else{
+        DataParallelTrainer trainer{replicas, pool, MNIST::DIM};
+
+        // Batches are assembled by worker threads (--workers, default 1) up to --prefetch batches
+        // (default 4) ahead of the training loop
+        Prefetcher input{dataset, sampler, option(argc, argv, "--prefetch", 4), option(argc, argv, "--workers", 1), first};
+
+        // Each batch flows through the graph as a single [batch_size x features] matrix
+        for(size_t epoch = first / sampler.batches_per_epoch(); epoch < epochs; ++epoch){
+            trainer.reset_scores();
+            for(size_t end = (epoch + 1) * sampler.batches_per_epoch(); i != end;){
+                Batch const& batch = input.next();
+                {
+                    // The wait for the batch is recorded as input, before the batch itself
+                    NN_PROFILE_SCOPE("batch", profile::Category::Batch, batch.size);
+                    trainer.step(batch);
+                    model.train(*optimizer);
+                }
+                ++i;
+                report(i);
+            }
+
+            // Print the average loss over the epoch
+            trainer.merge_scores();
+            printf("Epoch %zu: ", epoch + 1);
+            loss->print();
+        }
+
+        printf("Run %zu batches (%zu samples each)\n", i - first, batch_size);
+
+        PipelineStats stats = input.stats();
+        printf("Input pipeline: %zu batches, %zu stalls, %.3f s stalled, workers idle %.3f s\n",
+               stats.batches, stats.stalls, stats.stall_seconds, stats.idle_seconds);
     }
 
-    printf("Run %zu batches (%zu samples each)\n", i, batch_size);
+    if(checkpointer){
+        checkpointer->flush();
+        CheckpointStats stats = checkpointer->stats();
+        printf("Checkpoints: %zu written, %.3f s stalled, %.3f s writing\n",
+               stats.checkpoints, stats.stall_seconds, stats.write_seconds);
+    }
 
-    // Pring the average loss computed in the final batch
-    loss->print();
+    finish_profiling(trace);
+    report_memory(model);
 
-    ofstream out{
-        std::filesystem::current_path() / (model.name() + ".params"),
-        std::ios::binary
-    };
-    model.save(out);
+    model.save(std::filesystem::current_path() / (model.name() + ".params"));
 }
 
-void evaluate(char* argv[]){
+void evaluate(int argc, char* argv[]){
     printf("Executing evaluatin routine\n");
 
-    ifstream images{
+    // The dataset is memory mapped; samples are normalized straight from the mapped pages
+    IDXDataset dataset{
         std::filesystem::path{argv[0]} / "t10k-images-idx3-ubyte",
-        std::ios::binary
+        std::filesystem::path{argv[0]} / "t10k-labels-idx1-ubyte"
     };
+    printf("Loaded images file with %zu entries\n", dataset.size());
 
-    ifstream labels{
-        std::filesystem::path{argv[0]} / "t10k-labels-idx1-ubyte",
-        std::ios::binary
+    // For the data to be loaded properly, the model myst be constructed in the same manner
+    // as it was constructed during training. One inference-only replica is built per thread
+    // (--threads, default all hardware threads); they share the parameters of the first one
+    size_t threads = option(argc, argv, "--threads", thread::hardware_concurrency());
+    threads = max<size_t>(threads, 1);
+    ThreadPool pool{threads};
+    vector<Replica> replicas;
+    for(size_t t = 0; t != threads; ++t){
+        MNIST* mnist;
+        CCELossNode* loss;
+        // --hidden gives the width of the hidden layer of the checkpoint (default 32, see sweep)
+        Model replica = create_model(&dataset, &mnist, &loss, nullptr, option(argc, argv, "--hidden", 32));
+        // --bf16 evaluates with bfloat16 weights and activations (see train)
+        if(flag(argc, argv, "--bf16")){
+            replica.set_precision(Precision::BFloat16);
+        }
+        replicas.push_back(Replica{std::move(replica), mnist, loss});
+    }
+
+    // Instead of initializing the parameters randompy, here we load it from 
+    // disk (saved from a previous training run). The checkpoint is mapped rather than read;
+    // --verify additionally checks the parameters against their checksum
+    replicas.front().model.load(std::filesystem::path{argv[1]}, flag(argc, argv, "--verify"));
+
+    // Evaluate all images in the test set in large batches (--batch, default 1000) spread over
+    // the threads and compute the loss average
+    Evaluator evaluator{replicas, pool, dataset, max<size_t>(option(argc, argv, "--batch", 1000), 1)};
+    char const* trace = start_profiling(argc, argv);
+    auto timed_run = [&]{
+        auto start = chrono::steady_clock::now();
+        evaluator.run();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        evaluator.primary().loss->print();
+        printf("Throughput: %.0f samples/s\n", static_cast<double>(dataset.size()) / seconds);
+        if(trace != nullptr){
+            profile::summary(stdout);
+        }
     };
+    timed_run();
+    report_memory(evaluator.primary().model);
+
+    // --quantize <training data directory> then evaluates again with 8-bit integer weights and
+    // activations, calibrated on --calibrate samples (default 1000) spread evenly over the
+    // training set, and reports the difference to the float model
+    if(char const* training = text_option(argc, argv, "--quantize", nullptr)){
+        IDXDataset calibration{
+            std::filesystem::path{training} / "train-images-idx3-ubyte",
+            std::filesystem::path{training} / "train-labels-idx1-ubyte"
+        };
+        size_t count = min(max<size_t>(option(argc, argv, "--calibrate", 1000), 1), calibration.size());
+        vector<size_t> indices(count);
+        for(size_t i = 0; i != count; i++){
+            indices[i] = i * calibration.size() / count;
+        }
+        aligned_vector<float> samples(count * calibration.image_size());
+        calibration.gather(indices.data(), count, samples.data(), nullptr, nullptr);
+
+        float accuracy = evaluator.primary().loss->accuracy();
+        evaluator.quantize(samples.data(), count);
+        printf("Quantized to int8 on %zu samples (%s kernel)\n", count, qgemm_kernel_name());
+        timed_run();
+        printf("Accuracy change: %+.3f%%\n", (evaluator.primary().loss->accuracy() - accuracy) * 100.0);
+    }
+    finish_profiling(trace);
+}
 
+// The model of the checkpoint at path, only making predictions: in inference mode and without a
+// target to score them against. logits receives the layer producing them. --hidden and --verify
+// as for evaluate
+Model create_predictor(int argc, char* argv[], char const* path, FFNode** logits){
     MNIST* mnist;
     CCELossNode* loss;
-    // For the data to be loaded properly, the model myst be constructed in the same manner
-    // as it was constructed during training.
+    Model model = create_model(nullptr, &mnist, &loss, logits, option(argc, argv, "--hidden", 32));
+    model.set_inference(true);
+    model.load(std::filesystem::path{path}, flag(argc, argv, "--verify"));
+    loss->set_target(nullptr);
+    return model;
+}
 
-    Model model = create_model(images, labels, &mnist, &loss);
+// Set by SIGINT and SIGTERM to shut the server down
+std::atomic<bool> stop_serving{false};
+
+void serve(int argc, char* argv[]){
+    printf("Executing serving routine\n");
+
+    FFNode* logits;
+    Model model = create_predictor(argc, argv, argv[0], &logits);
+
+    // Requests are batched up to --max-batch (default 64) images, waiting at most --max-delay
+    // microseconds (default 1000) for a batch to fill. A connection with --max-pending requests
+    // (default 256) unanswered is not read until its client reads answers. Latencies and
+    // throughput are reported every --report-every seconds (default 5) and on shutdown (SIGINT or
+    // SIGTERM)
+    ServerOptions options;
+    options.max_batch = max<size_t>(option(argc, argv, "--max-batch", 64), 1);
+    options.max_delay = chrono::microseconds{option(argc, argv, "--max-delay", 1000)};
+    options.max_pending = max<size_t>(option(argc, argv, "--max-pending", 256), 1);
+    options.report_interval = chrono::seconds{max<size_t>(option(argc, argv, "--report-every", 5), 1)};
+    InferenceServer server{model, *logits, text_option(argc, argv, "--socket", "nn.sock"), options};
+
+    auto stop = [](int){ stop_serving = true; };
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    server.run(stop_serving);
+}
 
-    // Instead of initializing the parameters randompy, here we load it from 
-    // disk (saved from a previous training run)
-    std::ifstream params_file{std::filesystem::path{argv[1]}, std::ios::binary};
-    model.load(params_file);
+// Returns the exit status: non-zero if the stream could not be read to its end
+int predict(int argc, char* argv[]){
+    // stdout carries the predictions; everything else goes to stderr
+    fflush(stdout);
+    FILE* out = fdopen(dup(STDOUT_FILENO), "wb");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    if(out == nullptr){
+        throw runtime_error{"Cannot write to stdout"};
+    }
+    vector<char> out_buffer(1 << 20);
+    setvbuf(out, out_buffer.data(), _IOFBF, out_buffer.size());
+
+    FFNode* logits;
+    Model model = create_predictor(argc, argv, argv[0], &logits);
+
+    // Images are read from stdin as an IDX image file or as raw 784-byte records (--format idx,
+    // raw or auto, the default) in chunks of --batch images (default 1000), the next chunk being
+    // read while the current one runs through the model
+    string format = text_option(argc, argv, "--format", "auto");
+    ImageStream::Format stream_format = ImageStream::Format::Auto;
+    if(format == "idx"){
+        stream_format = ImageStream::Format::IDX;
+    }else if(format == "raw"){
+        stream_format = ImageStream::Format::Raw;
+    }else if(format != "auto"){
+        throw runtime_error{"Unknown input format " + format};
+    }
+    size_t batch = max<size_t>(option(argc, argv, "--batch", 1000), 1);
+    ImageStream stream{STDIN_FILENO, stream_format, MNIST::DIM, batch};
+
+    // --output text (default) writes one line per image, binary one byte per image with the
+    // class. --probabilities adds the probabilities of the classes: as text, ten more columns;
+    // in binary, the image's 44-byte serving::Prediction record instead of the byte
+    string output = text_option(argc, argv, "--output", "text");
+    if(output != "text" && output != "binary"){
+        throw runtime_error{"Unknown output format " + output};
+    }
+    bool text = output == "text";
+    bool probabilities = flag(argc, argv, "--probabilities");
+
+    aligned_vector<float> inputs(batch * MNIST::DIM);
+    vector<serving::Prediction> predictions(batch);
+    vector<uint8_t> labels(batch);
+    size_t images = 0;
+    auto start = chrono::steady_clock::now();
+    // A stream that fails partway still gets the predictions of the images read before the
+    // failure written out
+    string error;
+    auto next = [&]{
+        try{
+            return stream.next();
+        }catch(std::exception const& e){
+            error = e.what();
+            return ImageChunk{nullptr, 0};
+        }
+    };
+    for(ImageChunk chunk = next(); chunk.count != 0; chunk = next()){
+        for(size_t i = 0; i != chunk.count * MNIST::DIM; i++){
+            inputs[i] = static_cast<float>(chunk.pixels[i]) * (float{1.0} / float{255.0});
+        }
+        model.forward(inputs.data(), chunk.count);
+        serving::predict(logits->output(), chunk.count, predictions.data());
+        images += chunk.count;
+
+        if(text){
+            for(size_t b = 0; b != chunk.count; b++){
+                fprintf(out, "%u", predictions[b].label);
+                if(probabilities){
+                    for(float probability : predictions[b].probabilities){
+                        fprintf(out, " %.6g", probability);
+                    }
+                }
+                fputc('\n', out);
+            }
+        }else if(probabilities){
+            fwrite(predictions.data(), sizeof(serving::Prediction), chunk.count, out);
+        }else{
+            for(size_t b = 0; b != chunk.count; b++){
+                labels[b] = static_cast<uint8_t>(predictions[b].label);
+            }
+            fwrite(labels.data(), 1, chunk.count, out);
+        }
+    }
+    if(fclose(out) != 0){
+        throw runtime_error{"Cannot write the predictions"};
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    fflush(stdout);
+    fprintf(stderr, "Predicted %zu images (%s input) in %.3f s: %.0f images/s\n", images,
+            stream.idx() ? "IDX" : "raw", seconds, static_cast<double>(images) / seconds);
+    if(!error.empty()){
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+void sweep(int argc, char* argv[]){
+    printf("Executing sweep routine\n");
+
+    // The datasets are mapped once and shared read-only by all trials
+    IDXDataset dataset{
+        std::filesystem::path{argv[0]} / "train-images-idx3-ubyte",
+        std::filesystem::path{argv[0]} / "train-labels-idx1-ubyte"
+    };
+    printf("Loaded images file with %zu entries\n", dataset.size());
+    // --test <dir> scores every trial on the test set and ranks them by test accuracy; otherwise
+    // they are ranked by the accuracy of their last training epoch
+    unique_ptr<IDXDataset> test;
+    if(char const* dir = text_option(argc, argv, "--test", nullptr)){
+        test = make_unique<IDXDataset>(std::filesystem::path{dir} / "t10k-images-idx3-ubyte",
+                                       std::filesystem::path{dir} / "t10k-labels-idx1-ubyte");
+        printf("Loaded test images file with %zu entries\n", test->size());
+    }
+
+    // One trial per combination of the comma-separated values of --lr (default: the optimizer's
+    // rate, see train), --hidden (default 32,64) and --batch (default 40,80); --optimizer as for
+    // train, each trial with an optimizer of its own
+    string optimizer_name = text_option(argc, argv, "--optimizer", "sgd");
+    vector<string> rates = list_option(argc, argv, "--lr", "");
+    if(rates.empty()){
+        rates.push_back(to_string(default_learning_rate(optimizer_name)));
+    }
+    vector<string> hidden_sizes = list_option(argc, argv, "--hidden", "32,64");
+    vector<string> batch_sizes = list_option(argc, argv, "--batch", "40,80");
+
+    struct Settings{
+        float lr;
+        size_t hidden;
+        size_t batch;
+    };
+    vector<Settings> settings;
+    vector<Trial> trials;
+    for(string const& lr : rates){
+        for(string const& hidden : hidden_sizes){
+            for(string const& batch : batch_sizes){
+                Settings trial_settings{strtof(lr.c_str(), nullptr), strtoull(hidden.c_str(), nullptr, 10),
+                                        strtoull(batch.c_str(), nullptr, 10)};
+                if(trial_settings.hidden == 0 || trial_settings.hidden > 65535 || trial_settings.batch == 0){
+                    throw runtime_error{"Invalid hidden size " + hidden + " or batch size " + batch};
+                }
+                MNIST* mnist;
+                CCELossNode* loss;
+                Model model = create_model(&dataset, &mnist, &loss, nullptr, trial_settings.hidden,
+                                           trial_settings.batch);
+                settings.push_back(trial_settings);
+                trials.push_back(Trial{Replica{std::move(model), mnist, loss},
+                                       create_optimizer(optimizer_name, trial_settings.lr), trial_settings.batch, {}});
+            }
+        }
+    }
 
-    // Evaluate all 10 000 images in the test set and compute the loss average
-    for(size_t i = 0; i != mnist->size(); i++){
-        mnist->forward();
+    // All trials start from the same seed (--seed, random if absent) for --epochs epochs (default
+    // 1), spread over --threads threads (default all hardware threads)
+    size_t epochs = max<size_t>(option(argc, argv, "--epochs", 1), 1);
+    auto seed = static_cast<uint32_t>(option(argc, argv, "--seed", 0));
+    if(seed == 0){
+        seed = std::random_device{}();
+    }
+    size_t threads = max<size_t>(option(argc, argv, "--threads", thread::hardware_concurrency()), 1);
+    printf("Training %zu trials with optimizer %s for %zu epochs on %zu threads, seed %u\n", trials.size(),
+           optimizer_name.c_str(), epochs, threads, static_cast<unsigned>(seed));
+
+    ThreadPool pool{threads};
+    Sweep sweep{pool, dataset, test.get()};
+    auto start = chrono::steady_clock::now();
+    sweep.run(trials, epochs, seed);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t samples = trials.size() * epochs * dataset.size();
+    printf("Trained %zu trials in %.1f s: %.0f samples/s\n", trials.size(), seconds,
+           static_cast<double>(samples) / seconds);
+
+    // Best first: by accuracy, then by loss
+    auto score = [&](Trial const& trial){
+        TrialResult const& result = trial.result;
+        return test ? make_pair(result.test_accuracy, -result.test_loss)
+                    : make_pair(result.train_accuracy, -result.train_loss);
+    };
+    vector<size_t> ranking(trials.size());
+    iota(ranking.begin(), ranking.end(), 0);
+    stable_sort(ranking.begin(), ranking.end(), [&](size_t a, size_t b){
+        return score(trials[a]) > score(trials[b]);
+    });
+
+    // The table is printed and written as tab-separated values to --results (default sweep.tsv)
+    string results = text_option(argc, argv, "--results", "sweep.tsv");
+    FILE* table = fopen(results.c_str(), "w");
+    if(table == nullptr){
+        throw runtime_error{"Cannot write " + results};
     }
-    loss->print();
+    fprintf(table, "rank\tlr\thidden\tbatch\ttrain_loss\ttrain_accuracy\ttest_loss\ttest_accuracy\tbatches\tseconds\n");
+    printf("rank        lr  hidden  batch  train loss  train acc  test loss  test acc  seconds\n");
+    for(size_t r = 0; r != ranking.size(); r++){
+        Trial const& trial = trials[ranking[r]];
+        Settings const& trial_settings = settings[ranking[r]];
+        TrialResult const& result = trial.result;
+        float lr = trial_settings.lr;
+        fprintf(table, "%zu\t%g\t%zu\t%zu\t%f\t%f\t%f\t%f\t%zu\t%.3f\n", r + 1, lr, trial_settings.hidden,
+                trial_settings.batch, result.train_loss, result.train_accuracy, result.test_loss,
+                result.test_accuracy, result.batches, result.seconds);
+        printf("%4zu  %8g  %6zu  %5zu  %10.4f  %8.2f%%  %9.4f  %7.2f%%  %7.1f\n", r + 1, lr, trial_settings.hidden,
+               trial_settings.batch, result.train_loss, result.train_accuracy * 100.0, result.test_loss,
+               result.test_accuracy * 100.0, result.seconds);
+    }
+    if(fclose(table) != 0){
+        throw runtime_error{"Cannot write " + results};
+    }
+    printf("Results written to %s\n", results.c_str());
+
+    // The best model is saved to --best (default sweep-best.params, so the model of train is not
+    // replaced). Loading it with evaluate, serve or predict needs the --hidden it was trained with
+    string path = text_option(argc, argv, "--best", "sweep-best.params");
+    trials[ranking.front()].replica.model.save(std::filesystem::path{path});
+    printf("Best trial saved to %s, load it with --hidden %zu\n", path.c_str(), settings[ranking.front()].hidden);
 }
 
 int main(int argc, char* argv[]){
     if(argc < 2){
-        printf("Supported commands include:\ntrain\nevaluate\n");
+        printf("Supported commands include:\ntrain\nevaluate\nserve\npredict\nsweep\n");
         return 1;
     }
 
     if(strcmp(argv[1], "train") == 0){
-        train(argv + 2);
+        train(argc - 2, argv + 2);
     }else if(strcmp(argv[1], "evaluate") == 0){
-        evaluate(argv + 2);
+        evaluate(argc - 2, argv + 2);
+    }else if(strcmp(argv[1], "serve") == 0){
+        serve(argc - 2, argv + 2);
+    }else if(strcmp(argv[1], "predict") == 0){
+        return predict(argc - 2, argv + 2);
+    }else if(strcmp(argv[1], "sweep") == 0){
+        sweep(argc - 2, argv + 2);
     }else{
         printf("Argument %s is an unrecognized directive.\n", argv[1]);
     }